@@ -0,0 +1,200 @@
+#include "batch.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <chrono>
+#include <atomic>
+
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/imgcodecs/imgcodecs.hpp"
+
+#include "prefetch.h"
+#include "threadpool.h"
+#include "writer.h"
+
+bool loadRecipe(const std::string& file, std::vector<recipeOp>& ops, std::string& error)
+{
+	ops.clear();
+	std::ifstream in(file);
+	if(!in)
+	{
+		error = "can not open " + file;
+		return false;
+	}
+
+	std::string line;
+	int n = 0;
+	while(std::getline(in, line))
+	{
+		n++;
+		std::istringstream ss(line);
+		std::string name;
+		if(!(ss >> name) || name[0] == '#')
+			continue;
+
+		recipeOp op;
+		op.channel = 0;
+		op.th_value = 0;
+		op.th_inv = false;
+		op.radius = 0;
+		bool ok;
+		if(name == "threshold")
+		{
+			int inv;
+			op.type = recipeOp::THRESHOLD;
+			ok = static_cast<bool>(ss >> op.channel >> op.th_value >> inv >> op.mask_id);
+			op.th_inv = inv != 0;
+			ok = ok && op.channel >= 1 && op.channel <= N_PLANES && op.th_value >= 0 && op.th_value <= 255;
+		}
+		else if(name == "range")
+		{
+			int inv;
+			op.type = recipeOp::RANGE;
+			ok = static_cast<bool>(ss >> inv >> op.mask_id);
+			op.th_inv = inv != 0;
+			planeRange r;
+			while(ok && ss >> op.channel)
+			{
+				ok = static_cast<bool>(ss >> r.lo >> r.hi) && op.channel >= 1 && op.channel <= N_PLANES
+					&& r.lo >= 0 && r.hi <= 255;
+				r.plane = op.channel - 1;
+				op.ranges.push_back(r);
+			}
+			ok = ok && !op.ranges.empty();
+		}
+		else if(name == "circle")
+		{
+			op.type = recipeOp::CIRCLE;
+			ok = static_cast<bool>(ss >> op.p1.x >> op.p1.y >> op.radius >> op.mask_id) && op.radius >= 0;
+		}
+		else if(name == "rectangle")
+		{
+			op.type = recipeOp::RECTANGLE;
+			ok = static_cast<bool>(ss >> op.p1.x >> op.p1.y >> op.p2.x >> op.p2.y >> op.mask_id);
+		}
+		else if(name == "cleanup")
+		{
+			op.type = recipeOp::CLEANUP;
+			ok = parseCleanup(ss, op.cleanup);
+			op.mask_id = op.cleanup.label;
+		}
+		else
+		{
+			error = "line " + std::to_string(n) + ": unknown operation " + name;
+			return false;
+		}
+
+		if(!ok || op.mask_id < 0 || op.mask_id > 255)
+		{
+			error = "line " + std::to_string(n) + ": wrong arguments for " + name;
+			return false;
+		}
+		ops.push_back(op);
+	}
+	return true;
+}
+
+void applyRecipe(const std::vector<recipeOp>& ops, channelProvider& planes, cv::Mat& mask)
+{
+	cv::Mat threshold_mask, cleaned;
+	for(const auto& op: ops)
+	{
+		switch(op.type)
+		{
+			case recipeOp::THRESHOLD:
+				// The same as APPLY THRESHOLD: the pixels that are 0 in the threshold get the label
+				if(op.channel < 1 || op.channel > planes.size())
+					break;
+				cv::threshold(planes.plane(op.channel - 1), threshold_mask, op.th_value, 255,
+							  op.th_inv ? cv::THRESH_BINARY_INV : cv::THRESH_BINARY);
+				mask.setTo(cv::Scalar(op.mask_id), threshold_mask==0);
+				break;
+			case recipeOp::RANGE:
+			{
+				// Only the bounded planes get converted, and they are compared in one pass
+				std::vector<cv::Mat> bounded;
+				for(const auto& r: op.ranges)
+					bounded.push_back(planes.plane(r.plane));
+				rangeThreshold(bounded, op.ranges, op.th_inv, threshold_mask);
+				mask.setTo(cv::Scalar(op.mask_id), threshold_mask==0);
+				break;
+			}
+			case recipeOp::CIRCLE:
+				cv::circle(mask, op.p1, op.radius, cv::Scalar(op.mask_id), cv::FILLED);
+				break;
+			case recipeOp::RECTANGLE:
+				cv::rectangle(mask, op.p1, op.p2, cv::Scalar(op.mask_id), cv::FILLED);
+				break;
+			case recipeOp::CLEANUP:
+			{
+				cv::Rect region = cleanLabel(mask, op.cleanup, cv::Rect(), cleaned);
+				if(!region.empty())
+					cleaned.copyTo(mask(region));
+				break;
+			}
+		}
+	}
+}
+
+batchStats runBatch(const std::string& path, const utils::stringvec& images, const std::vector<recipeOp>& ops,
+					const std::string& mask_ext, const std::vector<int>& params, const labelSet& labels, int n_threads,
+					bool overwrite, const std::string& journal_ext)
+{
+	std::atomic<int> processed(0), skipped(0), failed(0);
+	auto start = std::chrono::steady_clock::now();
+
+	{
+		threadPool pool(n_threads);
+		for(const auto& name: images)
+		{
+			pool.submit([&, name]
+			{
+				// The masks that have been saved (by hand, most likely) are kept
+				std::string file = utils::mask_path(path, name, mask_ext);
+				std::error_code ec;
+				if(!overwrite && std::filesystem::exists(utils::saved_mask_path(path, name, mask_ext), ec))
+				{
+					skipped++;
+					return;
+				}
+
+				decodedImage decoded;
+				if(!decodeImage(path + name, decoded))
+				{
+					std::cerr << "Could not decode " << name << std::endl;
+					failed++;
+					return;
+				}
+
+				cv::Mat mask = cv::Mat::zeros(decoded.image.rows, decoded.image.cols, CV_8UC1);
+				applyRecipe(ops, *decoded.planes, mask);
+
+				labelStats stats;
+				stats.reset(mask);
+				std::string json = labelStatsJson(stats, labels);
+				if(writeMaskAtomic(file, mask, params)
+				   && writeFileAtomic(labelStatsPath(file), std::vector<uchar>(json.begin(), json.end())))
+				{
+					// The unsaved edits of the old mask would be replayed on top of the new one
+					std::filesystem::remove(file + journal_ext, ec);
+					processed++;
+				}
+				else
+				{
+					std::cerr << "Could not write the mask of " << name << std::endl;
+					failed++;
+				}
+			});
+		}
+		pool.wait();
+	}
+
+	batchStats stats;
+	stats.processed = processed;
+	stats.skipped = skipped;
+	stats.failed = failed;
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return stats;
+}
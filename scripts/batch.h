@@ -0,0 +1,67 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+#include "utils.h"
+#include "channels.h"
+#include "threshold.h"
+#include "labels.h"
+#include "morphology.h"
+
+// Struct that holds one operation of a recipe. They are the same operations the user
+// does by hand: APPLY THRESHOLD (single or range), double click (circle), drag (rectangle)
+// and the cleanup of a label (C)
+struct recipeOp
+{
+	enum opType { THRESHOLD, RANGE, CIRCLE, RECTANGLE, CLEANUP };
+
+	opType type;
+	int mask_id; // Label the operation writes
+	int channel; // THRESHOLD: plane + 1 (1 R, 2 G, 3 B, 4 H... as the Channel trackbar, see channelPlane)
+	int th_value; // THRESHOLD: value of the threshold
+	bool th_inv; // THRESHOLD, RANGE: whether it is inverted
+	std::vector<planeRange> ranges; // RANGE: bounds of each plane
+	cv::Point p1; // CIRCLE: center. RECTANGLE: first corner
+	cv::Point p2; // RECTANGLE: second corner
+	int radius; // CIRCLE: radius
+	labelCleanup cleanup; // CLEANUP: steps (its label is mask_id too)
+};
+
+// Reads a recipe. Each line holds one operation (in real image coordinates), applied
+// in order to an empty mask. Empty lines and lines starting with # are ignored:
+//     threshold <channel> <th_value> <th_inv 0|1> <mask_id>
+//     range <th_inv 0|1> <mask_id> <channel> <lo> <hi> [<channel> <lo> <hi> ...]
+//     circle <x> <y> <radius> <mask_id>
+//     rectangle <x1> <y1> <x2> <y2> <mask_id>
+//     cleanup <mask_id> <open_radius> <close_radius> <fill_holes 0|1> <min_area>
+// Returns false (and the reason in error) if the recipe is not valid
+bool loadRecipe(const std::string& file, std::vector<recipeOp>& ops, std::string& error);
+
+// Applies the operations of a recipe to mask (CV_8UC1 with the size of the planes). Only
+// the planes the recipe thresholds get converted
+void applyRecipe(const std::vector<recipeOp>& ops, channelProvider& planes, cv::Mat& mask);
+
+// Struct that holds the result of a batch run
+struct batchStats
+{
+	int processed; // Masks written
+	int skipped; // Images that already had a saved mask (and overwrite was not given)
+	int failed; // Images that could not be read or masks that could not be written
+	double seconds;
+};
+
+// Applies the recipe to every image of path (the list given by utils::read_directory)
+// on n_threads workers (one per core if <= 0), and writes the masks where SAVE MASK does
+// (with the mask_ext format and the cv::imwrite params), with the stats of their labels.
+// The images that already have a saved mask are skipped unless overwrite is set. The
+// journal of every mask that gets written (its file + journal_ext) is removed, as its
+// edits were made on the mask it replaces
+batchStats runBatch(const std::string& path, const utils::stringvec& images, const std::vector<recipeOp>& ops,
+					const std::string& mask_ext, const std::vector<int>& params, const labelSet& labels, int n_threads,
+					bool overwrite, const std::string& journal_ext);
+
+#endif
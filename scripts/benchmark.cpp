@@ -0,0 +1,316 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <numeric>
+#include <filesystem>
+#include <cmath>
+#include <cstdlib>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/imgcodecs/imgcodecs.hpp"
+
+#include "editor.h"
+#include "labelmask.h"
+#include "writer.h"
+
+// Sizes (megapixels) of the synthetic images and number of timed runs of each kernel
+// (the first run is always a warm up that is not timed)
+#define BENCH_SIZES "1,4,16,64,200"
+#define BENCH_REPEAT 5
+// The same history the app uses
+#define BENCH_HISTORY_BUDGET (256*1024*1024)
+#define BENCH_HISTORY_TILE 64
+
+// Declaration of the extern extension variable (utils.h)
+std::string extension = ".tif";
+
+// Struct that holds the timings of one kernel at one image size
+struct benchResult
+{
+	std::string kernel;
+	double megapixels;
+	int width;
+	int height;
+	std::vector<double> ms; // Time of each run
+};
+
+// Runs setup + f repeat times (plus a warm up) and returns the time of each f
+template<typename Setup, typename F>
+benchResult measure(const std::string& kernel, const cv::Size& size, int repeat, Setup setup, F f)
+{
+	benchResult result;
+	result.kernel = kernel;
+	result.width = size.width;
+	result.height = size.height;
+	result.megapixels = static_cast<double>(size.area())/1e6;
+	for(int i=0; i<=repeat; i++)
+	{
+		setup(i);
+		auto start = std::chrono::steady_clock::now();
+		f(i);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		if(i > 0)
+			result.ms.push_back(ms);
+	}
+	return result;
+}
+
+template<typename F>
+benchResult measure(const std::string& kernel, const cv::Size& size, int repeat, F f)
+{
+	return measure(kernel, size, repeat, [](int){}, f);
+}
+
+// Image with smooth gradients and random blobs (so as to the threshold and the label
+// masks look like the real ones, not like noise)
+cv::Mat syntheticImage(const cv::Size& size, cv::RNG& rng)
+{
+	cv::Mat image(size, CV_8UC3);
+	for(int y=0; y<size.height; y++)
+	{
+		cv::Vec3b* row = image.ptr<cv::Vec3b>(y);
+		for(int x=0; x<size.width; x++)
+			row[x] = cv::Vec3b(static_cast<uchar>(x*255/size.width), static_cast<uchar>(y*255/size.height),
+							   static_cast<uchar>((x + y) & 0xff));
+	}
+	int blobs = std::max(16, static_cast<int>(size.area()/1000000)*16);
+	for(int i=0; i<blobs; i++)
+	{
+		cv::Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+		int radius = rng.uniform(size.width/100 + 1, size.width/20 + 2);
+		cv::circle(image, center, radius, cv::Scalar(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256)), cv::FILLED);
+	}
+	return image;
+}
+
+// Prepares a data struct as the app does (without window, presenter nor buttons)
+void setupData(data& globalData, maskHistory& history)
+{
+	globalData.imagePlusControls = cv::Mat::zeros(DISPLAY_SIZE_H, static_cast<int>(1.5f*DISPLAY_SIZE_W), CV_8UC3);
+	globalData.history = &history;
+	globalData.mask_id = 1;
+	globalData.actual_channel = 0;
+	globalData.th_value = 128;
+	globalData.current_image = 0;
+	globalData.radiusClick = 50;
+	globalData.mask_view_on = false;
+	globalData.add_on = true;
+	globalData.th_on = false;
+	globalData.th_inv = false;
+	globalData.decode_options.warm_size = cv::Size(DISPLAY_SIZE_W, DISPLAY_SIZE_H);
+
+	globalData.label_set = defaultLabelSet();
+	paletteFromLabels(globalData.label_set, 255, false, globalData.mask_palette);
+	clearPalette(globalData.threshold_palette);
+	setPaletteLabel(globalData.threshold_palette, 0, cv::Scalar(0,255,255), 255);
+}
+
+void benchmarkSize(double megapixels, int repeat, const std::string& dir, std::vector<benchResult>& results)
+{
+	// I keep the 4:3 aspect ratio of most cameras
+	int width = static_cast<int>(std::sqrt(megapixels*1e6*4/3));
+	cv::Size size(width, static_cast<int>(megapixels*1e6/width));
+	cv::RNG rng(12345);
+
+	std::string image_file = dir + "/bench_" + std::to_string(size.width) + "x" + std::to_string(size.height) + ".tif";
+	cv::imwrite(image_file, syntheticImage(size, rng));
+
+	data globalData;
+	maskHistory history(BENCH_HISTORY_BUDGET, BENCH_HISTORY_TILE, true);
+	setupData(globalData, history);
+
+	// Reading: decoding (with the channels and the pyramids) and mapping it from the cache
+	results.push_back(measure("readImage", size, repeat, [&](int){ readImage(image_file, globalData); }));
+	globalData.decode_options.cache_dir = dir + "/.cache/";
+	globalData.decode_options.map_min_pixels = 0;
+	results.push_back(measure("readImage/mapped", size, repeat, [&](int){ readImage(image_file, globalData); }));
+	globalData.decode_options.cache_dir.clear();
+	readImage(image_file, globalData);
+
+	// Shapes (as double click and drag do, with the history and the redraw)
+	results.push_back(measure("drawCircle", size, repeat, [&](int)
+	{
+		drawCircle(globalData, cv::Point(rng.uniform(0, size.width), rng.uniform(0, size.height)));
+	}));
+	results.push_back(measure("drawRectangle", size, repeat, [&](int)
+	{
+		cv::Point p1(rng.uniform(0, size.width), rng.uniform(0, size.height));
+		drawRectangle(globalData, p1, p1 + cv::Point(size.width/10, size.height/10));
+	}));
+	// One brush segment, as a 120 Hz mouse move while dragging does (a few pixels each)
+	beginStroke(globalData, cv::Point(size.width/2, size.height/2));
+	results.push_back(measure("continueStroke", size, repeat, [&](int i)
+	{
+		double a = i*0.05;
+		continueStroke(globalData, cv::Point(size.width/2 + cvRound(size.width/4*std::cos(a)),
+											 size.height/2 + cvRound(size.height/4*std::sin(a))));
+	}));
+	endStroke(globalData);
+
+	// Click-to-label: over-segmenting the image (from the display level) and labelling a region
+	regionIndex regions;
+	const cv::Mat& region_level = globalData.pyramid.levelFor(cv::Size(DISPLAY_SIZE_W, DISPLAY_SIZE_H));
+	results.push_back(measure("buildRegionIndex", size, repeat, [&](int)
+	{
+		buildRegionIndex(region_level, size, 24, regions);
+	}));
+	results.push_back(measure("paintRegion", size, repeat, [&](int i)
+	{
+		regions.paint(i % regions.size(), globalData.mask, static_cast<uchar>(1 + (i & 1)));
+	}));
+
+	// Display modes
+	results.push_back(measure("display_img/plain", size, repeat, [&](int){ display_img(globalData, false); }));
+	results.push_back(measure("display_img/mask", size, repeat, [&](int){ display_img(globalData, true); }));
+
+	// Threshold: building the index of a channel, moving the slider and displaying it
+	globalData.actual_channel = 1;
+	results.push_back(measure("thresholdValueChanged/build", size, repeat,
+		[&](int){ globalData.th_on = false; globalData.th_index.assign(globalData.planes->size(), thresholdIndex()); },
+		[&](int i){ previewThreshold(globalData, 64 + i); }));
+	results.push_back(measure("thresholdValueChanged", size, repeat, [&](int i){ previewThreshold(globalData, (i*37) & 0xff); }));
+	results.push_back(measure("display_img/threshold", size, repeat, [&](int){ display_img(globalData, false); }));
+	results.push_back(measure("applyThreshold", size, repeat,
+		[&](int){ globalData.th_on = true; },
+		[&](int){ applyThreshold(globalData); }));
+
+	// Range threshold: H in a band, S and V above a bound (moving the H bounds and applying it)
+	globalData.th_range_on = true;
+	globalData.actual_channel = 1 + PLANE_H;
+	globalData.th_ranges = {{PLANE_H, 20, 80}, {PLANE_S, 60, 255}, {PLANE_V, 40, 255}};
+	previewRange(globalData);
+	results.push_back(measure("previewRange", size, repeat, [&](int i)
+	{
+		setRangeBounds(globalData, PLANE_H, 20 + (i*7) % 40, 80 + (i*11) % 60);
+		previewRange(globalData);
+	}));
+	cv::Mat range_mask;
+	std::vector<cv::Mat> range_planes;
+	for(const auto& r: globalData.th_ranges)
+		range_planes.push_back(globalData.planes->plane(r.plane));
+	results.push_back(measure("rangeThreshold", size, repeat, [&](int)
+	{
+		rangeThreshold(range_planes, globalData.th_ranges, false, range_mask);
+	}));
+	results.push_back(measure("applyThreshold/range", size, repeat,
+		[&](int){ globalData.th_on = true; },
+		[&](int){ applyThreshold(globalData); }));
+	globalData.th_range_on = false;
+	globalData.th_ranges.clear();
+
+	// Cleanup of the thresholded label (it is undone before every run, so each one cleans
+	// the same speckled mask)
+	labelCleanup cleanup;
+	cleanup.label = globalData.mask_id;
+	cleanup.open_radius = 1;
+	cleanup.close_radius = 1;
+	cleanup.fill_holes = true;
+	cleanup.min_area = 64;
+	cv::Mat cleaned;
+	results.push_back(measure("cleanLabel", size, repeat, [&](int)
+	{
+		cleanLabel(globalData.mask, cleanup, cv::Rect(), cleaned);
+	}));
+	results.push_back(measure("applyCleanup", size, repeat,
+		[&](int i){ if(i > 0) undoEdit(globalData); },
+		[&](int){ applyCleanup(globalData, cleanup); }));
+
+	// Saving the mask in the native format and as a LZW TIFF (encoded and written)
+	std::vector<uchar> buffer;
+	results.push_back(measure("encodeLabelMask", size, repeat, [&](int){ encodeLabelMask(globalData.mask, buffer); }));
+	results.push_back(measure("saveMask/lbl", size, repeat, [&](int)
+	{
+		writeMaskAtomic(dir + "/mask" + LABEL_MASK_EXTENSION, globalData.mask, std::vector<int>());
+	}));
+	results.push_back(measure("saveMask/tif", size, repeat, [&](int)
+	{
+		writeMaskAtomic(dir + "/mask.tif", globalData.mask, {cv::IMWRITE_TIFF_COMPRESSION, 5});
+	}));
+	// Label stats: counting the whole mask (when it is loaded) and writing them as json
+	results.push_back(measure("labelStats/reset", size, repeat, [&](int){ globalData.label_stats.reset(globalData.mask); }));
+	results.push_back(measure("labelStatsJson", size, repeat, [&](int){ labelStatsJson(globalData.label_stats, globalData.label_set); }));
+	cv::Mat loaded;
+	results.push_back(measure("loadMask/lbl", size, repeat, [&](int){ readLabelMask(dir + "/mask" + LABEL_MASK_EXTENSION, loaded); }));
+
+	std::error_code ec;
+	std::filesystem::remove(image_file, ec);
+	std::filesystem::remove_all(dir + "/.cache", ec);
+}
+
+// One json object per kernel and size, with the time of every run and its summary
+void writeResults(std::ostream& out, const std::vector<benchResult>& results)
+{
+	out << "{\"benchmark\":\"maskCreator\",\"results\":[";
+	for(size_t k=0; k<results.size(); k++)
+	{
+		const benchResult& r = results[k];
+		std::vector<double> sorted = r.ms;
+		std::sort(sorted.begin(), sorted.end());
+		double mean = sorted.empty() ? 0 : std::accumulate(sorted.begin(), sorted.end(), 0.0)/sorted.size();
+		double median = sorted.empty() ? 0 : sorted[sorted.size()/2];
+		double min = sorted.empty() ? 0 : sorted.front();
+
+		out << (k ? ",\n" : "\n") << "{\"kernel\":\"" << r.kernel << "\",\"megapixels\":" << r.megapixels
+			<< ",\"width\":" << r.width << ",\"height\":" << r.height << ",\"runs\":" << r.ms.size()
+			<< ",\"min_ms\":" << min << ",\"median_ms\":" << median << ",\"mean_ms\":" << mean << ",\"ms\":[";
+		for(size_t i=0; i<r.ms.size(); i++)
+			out << (i ? "," : "") << r.ms[i];
+		out << "]}";
+	}
+	out << "\n]}\n";
+}
+
+// Usage: benchmark [--sizes 1,4,16,64,200] [--repeat n] [--out results.json] [--dir tmp]
+int main(int argc, char** argv)
+{
+	std::string sizes = BENCH_SIZES;
+	std::string out_file;
+	std::string dir = (std::filesystem::temp_directory_path()/"maskCreator-bench").string();
+	int repeat = BENCH_REPEAT;
+	for(int i=1; i<argc; i++)
+	{
+		std::string arg = argv[i];
+		if(arg == "--sizes" && i + 1 < argc)
+			sizes = argv[++i];
+		else if(arg == "--repeat" && i + 1 < argc)
+			repeat = std::max(1, std::atoi(argv[++i]));
+		else if(arg == "--out" && i + 1 < argc)
+			out_file = argv[++i];
+		else if(arg == "--dir" && i + 1 < argc)
+			dir = argv[++i];
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [--sizes 1,4,16,64,200] [--repeat n] [--out results.json] [--dir tmp]" << std::endl;
+			return 1;
+		}
+	}
+
+	std::error_code ec;
+	std::filesystem::create_directories(dir, ec);
+
+	std::vector<benchResult> results;
+	std::stringstream list(sizes);
+	std::string item;
+	while(std::getline(list, item, ','))
+	{
+		double megapixels = std::atof(item.c_str());
+		if(megapixels <= 0)
+			continue;
+		std::cerr << "Benchmarking " << megapixels << " MP" << std::endl;
+		benchmarkSize(megapixels, repeat, dir, results);
+	}
+
+	if(out_file.empty())
+		writeResults(std::cout, results);
+	else
+	{
+		std::ofstream out(out_file);
+		writeResults(out, results);
+	}
+	return 0;
+}
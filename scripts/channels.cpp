@@ -0,0 +1,129 @@
+#include "channels.h"
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "trace.h"
+
+const char* planeName(int plane)
+{
+	static const char* names[N_PLANES] = {"R", "G", "B", "H", "S", "V", "L", "Lab a", "Lab b", "C", "M", "Y", "K", "Gray"};
+	return plane >= 0 && plane < N_PLANES ? names[plane] : "";
+}
+
+channelProvider::channelProvider(const cv::Mat& image, const std::vector<cv::Mat>& rgb,
+								 const std::vector<imagePyramid>& rgb_pyramids,
+								 const std::shared_ptr<mappedFile>& backing, const cv::Size& warm_size)
+	: _image(image), _backing(backing), _warm_size(warm_size)
+{
+	for(size_t i=0; i<rgb.size() && i<3; i++)
+	{
+		planes[PLANE_R + i] = rgb[i];
+		if(i < rgb_pyramids.size())
+			pyramids[PLANE_R + i] = rgb_pyramids[i];
+		else
+			pyramids[PLANE_R + i].reset(rgb[i]);
+	}
+}
+
+int channelProvider::size() const
+{
+	return N_PLANES;
+}
+
+bool channelProvider::ready(int idx) const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return idx >= 0 && idx < N_PLANES && !planes[idx].empty();
+}
+
+cv::Mat channelProvider::plane(int idx)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if(planes[idx].empty())
+		convert(idx);
+	return planes[idx];
+}
+
+cv::Mat channelProvider::level(int idx, const cv::Size& size)
+{
+	// The levels that are missing get pushed to the pyramid, so it is only touched here
+	std::lock_guard<std::mutex> lock(_mutex);
+	if(planes[idx].empty())
+		convert(idx);
+	return pyramids[idx].levelFor(size);
+}
+
+size_t channelProvider::bytes() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	size_t bytes = 0;
+	for(int i=PLANE_H; i<N_PLANES; i++)
+		for(const auto& level: pyramids[i].levels())
+			bytes += level.total()*level.elemSize();
+	return bytes;
+}
+
+void channelProvider::convert(int idx)
+{
+	TRACE_SCOPE("channelProvider/convert");
+	std::vector<cv::Mat> split;
+	int first;
+	if(idx >= PLANE_H && idx <= PLANE_V)
+	{
+		// The full range H (0-255 instead of 0-179) uses the whole threshold slider
+		cv::Mat hsv;
+		cv::cvtColor(_image, hsv, cv::COLOR_BGR2HSV_FULL);
+		cv::split(hsv, split);
+		first = PLANE_H;
+	}
+	else if(idx >= PLANE_L && idx <= PLANE_LAB_B)
+	{
+		cv::Mat lab;
+		cv::cvtColor(_image, lab, cv::COLOR_BGR2Lab);
+		cv::split(lab, split);
+		first = PLANE_L;
+	}
+	else if(idx >= PLANE_C && idx <= PLANE_K)
+	{
+		// K = 255 - max(R,G,B) and C = (max - R)*255/max (the same for M, Y), computed with
+		// whole image operations (cv::divide gives 0 where max is 0, which is pure black)
+		std::vector<cv::Mat> bgr;
+		cv::split(_image, bgr);
+		cv::Mat max_rgb, diff;
+		cv::max(bgr[0], bgr[1], max_rgb);
+		cv::max(max_rgb, bgr[2], max_rgb);
+		split.resize(4);
+		for(int c=0; c<3; c++)
+		{
+			// C comes from R, M from G and Y from B
+			cv::subtract(max_rgb, bgr[2 - c], diff);
+			cv::divide(diff, max_rgb, split[c], 255.0);
+		}
+		cv::subtract(cv::Scalar(255), max_rgb, split[3]);
+		first = PLANE_C;
+	}
+	else if(idx == PLANE_GRAY)
+	{
+		split.resize(1);
+		cv::cvtColor(_image, split[0], cv::COLOR_BGR2GRAY);
+		first = PLANE_GRAY;
+	}
+	else
+	{
+		// The RGB planes are given, unless the image could not be split
+		cv::split(_image, split);
+		if(split.size() == 3)
+			std::swap(split[0], split[2]);
+		else
+			split.assign(3, split.at(0));
+		first = PLANE_R;
+	}
+
+	for(size_t i=0; i<split.size(); i++)
+	{
+		planes[first + i] = split[i];
+		pyramids[first + i].reset(split[i]);
+		if(_warm_size.width > 0 && _warm_size.height > 0)
+			pyramids[first + i].warm(_warm_size);
+	}
+}
@@ -0,0 +1,69 @@
+#ifndef CHANNELS_H
+#define CHANNELS_H
+
+#include <memory>
+#include <mutex>
+
+#include "opencv2/core/core.hpp"
+
+#include "pyramid.h"
+#include "mapped.h"
+
+// Planes that can be displayed and thresholded (the Channel trackbar shows the plane
+// idx+1, 0 is the color image). H is scaled to 0-255 and a, b of Lab are offset by 128,
+// as cv::cvtColor does for 8 bit images
+enum channelPlane
+{
+	PLANE_R, PLANE_G, PLANE_B,
+	PLANE_H, PLANE_S, PLANE_V,
+	PLANE_L, PLANE_LAB_A, PLANE_LAB_B,
+	PLANE_C, PLANE_M, PLANE_Y, PLANE_K,
+	PLANE_GRAY,
+	N_PLANES
+};
+
+// Name of a plane ("R", "H", "Lab a"...)
+const char* planeName(int plane);
+
+// Class that gives the planes of an image. The RGB ones are the ones that were split
+// when the image was decoded, and the rest are converted (a whole color space at once,
+// with the vectorized cv functions) the first time one of them is asked for, and kept.
+// So the color spaces that are not used cost nothing. It can be shared between threads:
+// the planes and their levels are built under its mutex and given by value (the Mats
+// share their data), never the pyramids they are kept in
+class channelProvider
+{
+public:
+	// image is the BGR image and rgb its R, G, B planes with their pyramids (backing is
+	// the mapped file they point to, if any). The pyramids of the converted planes are
+	// warmed for warm_size (none if empty), so as to they are not built while displaying
+	channelProvider(const cv::Mat& image, const std::vector<cv::Mat>& rgb, const std::vector<imagePyramid>& rgb_pyramids,
+					const std::shared_ptr<mappedFile>& backing, const cv::Size& warm_size);
+
+	// Number of planes (N_PLANES)
+	int size() const;
+	// Full resolution plane idx (CV_8UC1)
+	cv::Mat plane(int idx);
+	// Level of the pyramid of the plane idx for size (see imagePyramid::levelFor)
+	cv::Mat level(int idx, const cv::Size& size);
+	// Whether the plane idx is already available
+	bool ready(int idx) const;
+	// Memory used by the planes converted so far (with their pyramids)
+	size_t bytes() const;
+
+	channelProvider(const channelProvider&) = delete;
+	channelProvider& operator=(const channelProvider&) = delete;
+
+private:
+	// Converts the color space of the plane idx (the mutex must be held)
+	void convert(int idx);
+
+	cv::Mat _image;
+	std::shared_ptr<mappedFile> _backing;
+	cv::Size _warm_size;
+	cv::Mat planes[N_PLANES];
+	imagePyramid pyramids[N_PLANES];
+	mutable std::mutex _mutex;
+};
+
+#endif
@@ -0,0 +1,338 @@
+#include "dataset.h"
+
+#include <iostream>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "opencv2/imgcodecs/imgcodecs.hpp"
+
+#include "labelmask.h"
+#include "threadpool.h"
+#include "writer.h"
+
+namespace
+{
+	// Bytes of records the shard writer gathers before writing them at once
+	const size_t WRITE_BUFFER = 8 << 20;
+
+	template<typename T>
+	void put(std::vector<uchar>& out, T v)
+	{
+		size_t o = out.size();
+		out.resize(o + sizeof(T));
+		std::memcpy(&out[o], &v, sizeof(T));
+	}
+
+	std::string shardPath(const std::string& dir, int shard, const char* ext)
+	{
+		char name[32];
+		std::snprintf(name, sizeof(name), "shard-%05d", shard);
+		return (std::filesystem::path(dir)/name).string() + ext;
+	}
+
+	size_t tileBytes(const datasetTile& tile)
+	{
+		return tile.image.size() + tile.image_bytes.size() + tile.mask_bytes.size();
+	}
+
+	// Positions of the tiles along a side of size: every stride, and the last one aligned to
+	// the border (a side smaller than the tile gives one tile)
+	std::vector<int> tileStarts(int size, int tile, int stride)
+	{
+		std::vector<int> starts;
+		if(size <= tile)
+			return {0};
+		for(int p=0; p + tile < size; p += stride)
+			starts.push_back(p);
+		starts.push_back(size - tile);
+		return starts;
+	}
+
+	// Image and mask that are being tiled. Every row of tiles holds it, and done is called
+	// when the last one has been encoded
+	struct tileSource
+	{
+		std::string name;
+		cv::Mat image;
+		cv::Mat mask;
+		std::function<void()> done;
+
+		~tileSource()
+		{
+			if(done)
+				done();
+		}
+	};
+}
+
+shardWriter::shardWriter(const std::string& dir, size_t shard_bytes, size_t max_pending)
+	: _dir(dir), _shard_bytes(shard_bytes), _max_pending(max_pending), fd(-1), shard(0), offset(0),
+	  pending_bytes(0), writing(false), completed(0), written(0), failed(false), stop(false)
+{
+	std::error_code ec;
+	std::filesystem::create_directories(dir, ec);
+	buffer.reserve(WRITE_BUFFER + (1 << 20));
+	thread = std::thread(&shardWriter::worker, this);
+}
+
+shardWriter::~shardWriter()
+{
+	close();
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		stop = true;
+	}
+	work_cv.notify_all();
+	thread.join();
+}
+
+void shardWriter::add(datasetTile tile)
+{
+	size_t bytes = tileBytes(tile);
+	{
+		// A tile bigger than max_pending is let in alone
+		std::unique_lock<std::mutex> lock(_mutex);
+		space_cv.wait(lock, [&]{ return pending_bytes == 0 || pending_bytes + bytes <= _max_pending; });
+		pending_bytes += bytes;
+		queue.push_back(std::move(tile));
+	}
+	work_cv.notify_one();
+}
+
+bool shardWriter::close()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	space_cv.wait(lock, [&]{ return queue.empty() && !writing; });
+	// The thread is waiting for tiles, so the shard is mine until I release the mutex
+	finishShard();
+	return !failed;
+}
+
+int shardWriter::shards() const
+{
+	return completed;
+}
+
+long long shardWriter::bytes() const
+{
+	return written;
+}
+
+void shardWriter::writeTile(const datasetTile& tile)
+{
+	// The record is built in the buffer, and its header is filled once its size is known
+	size_t start = buffer.size();
+	put<uint32_t>(buffer, 0);
+	put<uint32_t>(buffer, 0);
+	put<uint16_t>(buffer, static_cast<uint16_t>(tile.image.size()));
+	buffer.insert(buffer.end(), tile.image.begin(), tile.image.end());
+	for(int v: {tile.rect.x, tile.rect.y, tile.rect.width, tile.rect.height})
+		put<int32_t>(buffer, v);
+	put<uint32_t>(buffer, static_cast<uint32_t>(tile.image_bytes.size()));
+	buffer.insert(buffer.end(), tile.image_bytes.begin(), tile.image_bytes.end());
+	put<uint32_t>(buffer, static_cast<uint32_t>(tile.mask_bytes.size()));
+	buffer.insert(buffer.end(), tile.mask_bytes.begin(), tile.mask_bytes.end());
+	size_t record = buffer.size() - start;
+	uint32_t size = static_cast<uint32_t>(record - 8), checksum = fnv1a(&buffer[start + 8], record - 8);
+	std::memcpy(&buffer[start], &size, 4);
+	std::memcpy(&buffer[start + 4], &checksum, 4);
+
+	// A full shard is completed before the record (which is still in the buffer) is written
+	if(fd >= 0 && offset > 0 && offset + record > _shard_bytes)
+	{
+		std::vector<uchar> pending(buffer.begin() + start, buffer.end());
+		buffer.resize(start);
+		finishShard();
+		buffer.swap(pending);
+	}
+	if(fd < 0)
+	{
+		fd = ::open(shardPath(_dir, shard, ".rec.tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0)
+		{
+			std::cerr << "Could not create " << shardPath(_dir, shard, ".rec") << std::endl;
+			failed = true;
+			buffer.clear();
+			return;
+		}
+		offset = 0;
+		index.clear();
+	}
+	index += std::to_string(offset) + "\t" + std::to_string(record) + "\t" + std::to_string(tile.rect.x) + "\t"
+		+ std::to_string(tile.rect.y) + "\t" + std::to_string(tile.rect.width) + "\t"
+		+ std::to_string(tile.rect.height) + "\t" + tile.image + "\n";
+	offset += record;
+	if(buffer.size() >= WRITE_BUFFER)
+		flushBuffer();
+}
+
+void shardWriter::flushBuffer()
+{
+	if(fd >= 0 && !buffer.empty())
+	{
+		if(writeAll(fd, buffer.data(), buffer.size()))
+			written += buffer.size();
+		else
+			failed = true;
+	}
+	buffer.clear();
+}
+
+void shardWriter::finishShard()
+{
+	if(fd < 0)
+		return;
+	flushBuffer();
+	if(::fdatasync(fd) != 0)
+		failed = true;
+	::close(fd);
+	fd = -1;
+
+	std::error_code ec;
+	std::filesystem::rename(shardPath(_dir, shard, ".rec.tmp"), shardPath(_dir, shard, ".rec"), ec);
+	if(ec || !writeFileAtomic(shardPath(_dir, shard, ".idx"), std::vector<uchar>(index.begin(), index.end())))
+	{
+		std::cerr << "Could not complete " << shardPath(_dir, shard, ".rec") << std::endl;
+		failed = true;
+	}
+	completed++;
+	shard++;
+	index.clear();
+}
+
+void shardWriter::worker()
+{
+	while(true)
+	{
+		datasetTile tile;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			work_cv.wait(lock, [&]{ return stop || !queue.empty(); });
+			if(queue.empty())
+				return;
+			tile = std::move(queue.front());
+			queue.pop_front();
+			writing = true;
+		}
+
+		// The state of the shard is only touched by this thread while writing is set (and
+		// by close() while it is not)
+		writeTile(tile);
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			pending_bytes -= tileBytes(tile);
+			writing = false;
+		}
+		space_cv.notify_all();
+	}
+}
+
+exportStats exportDataset(const std::string& path, const utils::stringvec& images, const std::string& out_dir,
+						  const exportOptions& options)
+{
+	auto start = std::chrono::steady_clock::now();
+	int tile = options.tile;
+	int stride = options.stride > 0 ? options.stride : tile;
+	std::atomic<int> exported(0), skipped(0);
+	std::atomic<long long> tiles(0), empty(0);
+
+	shardWriter writer(out_dir, options.shard_bytes, options.max_pending);
+	// Reading is faster than encoding and an image may take hundreds of MB, so only as many
+	// images as threads are loaded at once (they are declared before the pool, which may
+	// release the last one while it stops)
+	std::mutex loaded_mutex;
+	std::condition_variable loaded_cv;
+	int loaded = 0;
+	{
+		threadPool pool(options.n_threads);
+		for(const auto& name: images)
+		{
+			{
+				std::unique_lock<std::mutex> lock(loaded_mutex);
+				loaded_cv.wait(lock, [&]{ return loaded < pool.size(); });
+				loaded++;
+			}
+			pool.submit([&, name]
+			{
+				std::shared_ptr<tileSource> source = std::make_shared<tileSource>();
+				source->name = name;
+				source->done = [&]
+				{
+					{
+						std::lock_guard<std::mutex> lock(loaded_mutex);
+						loaded--;
+					}
+					loaded_cv.notify_one();
+				};
+
+				// Only the images that have been labelled (their mask has been saved) are exported
+				std::string mask_file = utils::saved_mask_path(path, name, options.mask_ext);
+				std::error_code ec;
+				if(!std::filesystem::exists(mask_file, ec))
+				{
+					skipped++;
+					return;
+				}
+				source->image = cv::imread(path + name);
+				if(source->image.empty() || !readMask(mask_file, source->mask) || source->mask.size() != source->image.size())
+				{
+					std::cerr << "Could not read " << name << " with its mask" << std::endl;
+					skipped++;
+					return;
+				}
+				exported++;
+
+				// Each row of tiles is a task, so the tiles of one image get encoded in parallel
+				std::vector<int> xs = tileStarts(source->image.cols, tile, stride);
+				for(int y: tileStarts(source->image.rows, tile, stride))
+				{
+					pool.submit([&, source, xs, y]
+					{
+						for(int x: xs)
+						{
+							cv::Rect rect(x, y, std::min(tile, source->image.cols), std::min(tile, source->image.rows));
+							cv::Mat mask = source->mask(rect);
+							if(!options.keep_empty && cv::countNonZero(mask) == 0)
+							{
+								empty++;
+								continue;
+							}
+							datasetTile t;
+							t.image = source->name;
+							t.rect = rect;
+							if(!cv::imencode(options.image_ext, source->image(rect), t.image_bytes, options.image_params)
+							   || !cv::imencode(".png", mask, t.mask_bytes))
+							{
+								std::cerr << "Could not encode a tile of " << source->name << std::endl;
+								continue;
+							}
+							writer.add(std::move(t));
+							tiles++;
+						}
+					});
+				}
+			});
+		}
+		pool.wait();
+	}
+
+	exportStats stats;
+	stats.ok = writer.close();
+	stats.images = exported;
+	stats.skipped = skipped;
+	stats.tiles = tiles;
+	stats.empty = empty;
+	stats.shards = writer.shards();
+	stats.bytes = writer.bytes();
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return stats;
+}
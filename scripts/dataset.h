@@ -0,0 +1,124 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+#include "opencv2/core/core.hpp"
+
+#include "utils.h"
+
+// Struct that holds one tile of the dataset: a region of an image and of its mask, encoded
+struct datasetTile
+{
+	std::string image; // Name of the image (as in the image list)
+	cv::Rect rect; // Region of the image
+	std::vector<uchar> image_bytes; // Encoded tile of the image
+	std::vector<uchar> mask_bytes; // Encoded tile of the mask (PNG, one byte per pixel with the labels)
+};
+
+// Class that writes the tiles to a few big shard files instead of two small files per
+// tile. Each shard (shard-<n>.rec in dir) is a sequence of records (little endian):
+//     uint32 size, uint32 checksum (FNV-1a of the payload), payload of size bytes:
+//     uint16 name length, name, int32 x y w h, uint32 n, image tile (n bytes), uint32 m, mask tile (m bytes)
+// and its index (shard-<n>.idx) has one line per record: offset, size (of the whole record),
+// x, y, w, h and name, separated by tabs. The records are written in the order they are
+// added (the one they get encoded in) by one background thread, through a big buffer, so
+// the disk only sees sequential writes. A shard is written as .tmp and renamed when it is
+// complete, and a new one is started once it reaches shard_bytes
+class shardWriter
+{
+public:
+	// Up to max_pending bytes of tiles can be waiting to be written before add() blocks
+	shardWriter(const std::string& dir, size_t shard_bytes, size_t max_pending);
+	// Writes every pending tile and completes the last shard before returning
+	~shardWriter();
+
+	// Queues a tile to be written (it waits if there are already max_pending bytes waiting)
+	void add(datasetTile tile);
+	// Writes every pending tile and completes the last shard. Returns false if anything
+	// could not be written
+	bool close();
+
+	int shards() const; // Shards that have been completed
+	long long bytes() const; // Bytes written to them
+
+	shardWriter(const shardWriter&) = delete;
+	shardWriter& operator=(const shardWriter&) = delete;
+
+private:
+	// Inf. loop run by the writer thread
+	void worker();
+	// Appends a record to the current shard (starting a new one if it is full)
+	void writeTile(const datasetTile& tile);
+	// Writes the buffer to the shard
+	void flushBuffer();
+	// Completes the current shard (and writes its index)
+	void finishShard();
+
+	std::string _dir;
+	size_t _shard_bytes;
+	size_t _max_pending;
+
+	// State of the writer thread
+	int fd;
+	int shard; // Number of the current shard
+	uint64_t offset; // Bytes of the current shard
+	std::vector<uchar> buffer; // Records that have not been written yet
+	std::string index; // Index of the current shard
+
+	std::deque<datasetTile> queue;
+	size_t pending_bytes;
+	bool writing; // Whether the thread is writing a tile right now
+	std::atomic<int> completed;
+	std::atomic<long long> written;
+	std::atomic<bool> failed;
+
+	mutable std::mutex _mutex;
+	std::condition_variable work_cv; // The thread waits here for tiles
+	std::condition_variable space_cv; // add() and close() wait here for the thread
+	bool stop;
+	std::thread thread;
+};
+
+// Struct that holds how a dataset gets exported
+struct exportOptions
+{
+	int tile = 512; // Side of the tiles (images smaller than it give one tile of their size)
+	int stride = 0; // Distance between tiles (tile if 0, smaller than it to overlap them). The last ones are aligned to the border of the image
+	bool keep_empty = false; // Whether the tiles without any label (all background) are exported
+	std::string image_ext = ".png"; // Format of the image tiles (any of cv::imencode)
+	std::vector<int> image_params; // And its cv::imencode params
+	std::string mask_ext; // Format of the saved masks (as for utils::mask_path)
+	size_t shard_bytes = 1LL << 30; // Size at which a new shard is started
+	size_t max_pending = 256LL << 20; // Bytes of encoded tiles that can wait for the writer
+	int n_threads = 0; // Threads that cut and encode the tiles (one per core if <= 0)
+};
+
+// Struct that holds the result of an export
+struct exportStats
+{
+	int images; // Images exported
+	int skipped; // Images without saved mask (or that could not be read)
+	long long tiles; // Tiles written
+	long long empty; // Tiles left out by the empty filter
+	int shards;
+	long long bytes;
+	double seconds;
+	bool ok; // false if the shards could not be written
+};
+
+// Exports every image of path (the list given by utils::read_directory) that has a saved
+// mask to shards in out_dir. The images are read on a thread pool (only as many at once as
+// there are threads), and each row of tiles of an image is cut and encoded as a task of its
+// own, so a few huge images keep every thread busy too
+exportStats exportDataset(const std::string& path, const utils::stringvec& images, const std::string& out_dir,
+						  const exportOptions& options);
+
+#endif
@@ -0,0 +1,739 @@
+#include "editor.h"
+
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "labelmask.h"
+#include "trace.h"
+
+namespace
+{
+	// Threshold index of a plane, built the first time it gets thresholded
+	thresholdIndex& builtIndex(data& globalData, int plane)
+	{
+		thresholdIndex& index = globalData.th_index.at(plane);
+		if(!index.built())
+		{
+			TRACE_SCOPE("threshold/build");
+			index.build(globalData.planes->level(plane, cv::Size(DISPLAY_SIZE_W, DISPLAY_SIZE_H)),
+						cv::Size(DISPLAY_SIZE_W, DISPLAY_SIZE_H));
+		}
+		return index;
+	}
+
+	// Paints the capsule (segment p1-p2 with round ends) of a stroke of radius r. The ends
+	// are the same circles a double click draws, and the line between them covers their
+	// diameter
+	void paintSegment(cv::Mat& mask, const cv::Point& p1, const cv::Point& p2, int r, int value)
+	{
+		cv::circle(mask, p2, r, cv::Scalar(value), cv::FILLED);
+		if(p1 != p2)
+			cv::line(mask, p1, p2, cv::Scalar(value), 2*r + 1, cv::LINE_8);
+	}
+
+	// Region of the mask the capsule covers
+	cv::Rect segmentRegion(const cv::Point& p1, const cv::Point& p2, int r)
+	{
+		return cv::Rect(cv::Point(std::min(p1.x, p2.x) - r, std::min(p1.y, p2.y) - r),
+						cv::Point(std::max(p1.x, p2.x) + r + 1, std::max(p1.y, p2.y) + r + 1));
+	}
+
+	// The threshold APPLY THRESHOLD applies (single or range)
+	void thresholdPlane(channelProvider& planes, int plane, int th, bool inv, cv::Mat& out)
+	{
+		cv::threshold(planes.plane(plane), out, th, 255, inv ? cv::THRESH_BINARY_INV : cv::THRESH_BINARY);
+	}
+
+	void thresholdRanges(channelProvider& planes, const std::vector<planeRange>& ranges, bool inv, cv::Mat& out)
+	{
+		std::vector<cv::Mat> bounded;
+		for(const auto& r: ranges)
+			bounded.push_back(planes.plane(r.plane));
+		rangeThreshold(bounded, ranges, inv, out);
+	}
+
+	void journal(data& globalData, journalRecord::recordType type, const std::vector<int>& args)
+	{
+		if(globalData.journal)
+			globalData.journal->append({type, args});
+	}
+
+	// The edits that can not be repeated from their parameters are journaled with the tiles
+	// they change (the history reports them between both calls)
+	void captureTiles(data& globalData)
+	{
+		globalData.journal_tiles.clear();
+		globalData.journal_capture = globalData.journal != nullptr;
+	}
+
+	void journalTiles(data& globalData)
+	{
+		globalData.journal_capture = false;
+		if(!globalData.journal || globalData.journal_tiles.empty())
+			return;
+		globalData.journal->append({journalRecord::BEGIN, {}});
+		for(auto& tile: globalData.journal_tiles)
+			globalData.journal->append(std::move(tile));
+		globalData.journal->append({journalRecord::END, {}});
+		globalData.journal_tiles.clear();
+	}
+}
+
+void readImage(const std::string& _path, data& globalData)
+{
+	TRACE_SCOPE("readImage");
+	decodedImage decoded;
+	// If I have read an image
+	if(decodeImage(_path, decoded, globalData.decode_options))
+		installImage(decoded, globalData);
+}
+
+void installImage(decodedImage& decoded, data& globalData, openMask* restored)
+{
+	TRACE_SCOPE("installImage");
+	// A stroke that is still open belongs to the image I leave
+	endStroke(globalData);
+	// I store the info in my globalData struct (the buffers are moved, not copied)
+	globalData.read_image = decoded.image;
+	globalData.image_backing = decoded.backing;
+	// Mask initialization to 0 (in a mapped file too if the image is mapped). A restored
+	// mask keeps its mapped file, which must not be created again (it would be truncated)
+	globalData.mask_backing.reset();
+	if(restored)
+	{
+		globalData.mask = restored->mask;
+		globalData.mask_backing = std::move(restored->backing);
+	}
+	else if(decoded.backing)
+		globalData.mask = createMappedMask(decoded.cache_base + globalData.mask_cache_tag + ".mask", decoded.image.size(), globalData.mask_backing);
+	else
+		globalData.mask = cv::Mat::zeros(decoded.image.rows, decoded.image.cols, CV_8UC1);
+	globalData.view.reset(decoded.image.size(), cv::Size(DISPLAY_SIZE_W, DISPLAY_SIZE_H));
+	globalData.planes = decoded.planes;
+	globalData.pyramid = std::move(decoded.pyramid);
+	globalData.image_file = decoded.file;
+	globalData.history->clear();
+	// The history reports the tiles every edit changes, so the label stats follow them (and
+	// the journal gets the ones of the edits it keeps by content)
+	data* g = &globalData;
+	globalData.history->listen([g](const cv::Rect& rect, const uchar* before, const uchar* after)
+	{
+		g->label_stats.update(rect, before, after);
+		if(g->journal_capture)
+			g->journal_tiles.push_back(tileRecord(rect, after));
+	});
+	globalData.journal_capture = false;
+	if(restored)
+		globalData.label_stats = std::move(restored->stats);
+	else
+		globalData.label_stats.resetEmpty(globalData.mask.size());
+	globalData.stroking = false;
+	globalData.threshold_mask.release();
+	globalData.th_index.assign(globalData.planes->size(), thresholdIndex());
+	globalData.th_range_preview.reset();
+	globalData.th_on = false;
+
+	// The regions of the image get indexed in background (or read from the cache)
+	if(globalData.regions)
+		globalData.regions->request(globalData.image_file, globalData.pyramid);
+}
+
+void loadSavedMask(const std::string& file, data& globalData)
+{
+	TRACE_SCOPE("loadSavedMask");
+	std::error_code ec;
+	if(!std::filesystem::exists(file, ec))
+		return;
+
+	// saved shares the buffer of the mask, so a .lbl of the same size gets decoded in place
+	cv::Mat saved = globalData.mask;
+	if(!readMask(file, saved) || saved.size() != globalData.mask.size())
+	{
+		// A saved mask that can not be read or does not fit the image is ignored
+		std::cerr << "Ignoring the saved mask " << file << std::endl;
+		globalData.mask.setTo(cv::Scalar(0));
+		globalData.label_stats.resetEmpty(globalData.mask.size());
+		return;
+	}
+	if(saved.data != globalData.mask.data)
+		saved.copyTo(globalData.mask);
+	// The only time the whole mask gets counted
+	globalData.label_stats.reset(globalData.mask);
+}
+
+void saveMask(const std::string& file, data& globalData)
+{
+	TRACE_SCOPE("saveMask");
+	if(!globalData.writer)
+		return;
+	// The saved mask contains the edits journaled up to now, so they are removed from the
+	// journal once it has been written
+	std::function<void()> done;
+	if(globalData.journal && !globalData.journal->file().empty())
+	{
+		editJournal* journal = globalData.journal;
+		std::string journal_file = journal->file();
+		uint32_t mark = journal->mark();
+		done = [journal, journal_file, mark]{ journal->compact(journal_file, mark); };
+	}
+	globalData.writer->save(file, globalData.mask, labelStatsJson(globalData.label_stats, globalData.label_set), done);
+}
+
+int replayJournal(data& globalData, const std::vector<journalRecord>& records)
+{
+	TRACE_SCOPE("replayJournal");
+	cv::Mat& mask = globalData.mask;
+	cv::Rect whole(0, 0, mask.cols, mask.rows);
+	int edits = 0;
+	bool grouped = false;
+	for(const auto& r: records)
+	{
+		const std::vector<int>& a = r.args;
+		if(r.type == journalRecord::BEGIN || r.type == journalRecord::END)
+		{
+			if(grouped)
+			{
+				globalData.history->commit(mask);
+				edits++;
+			}
+			grouped = r.type == journalRecord::BEGIN;
+			if(grouped)
+				globalData.history->begin(mask, cv::Rect());
+			continue;
+		}
+
+		// I check the record and I get the region it changes
+		cv::Rect region;
+		bool ok;
+		switch(r.type)
+		{
+			case journalRecord::CIRCLE:
+				ok = a.size() == 4 && a[2] >= 0;
+				region = ok ? cv::Rect(a[0] - a[2], a[1] - a[2], 2*a[2] + 1, 2*a[2] + 1) : cv::Rect();
+				break;
+			case journalRecord::RECTANGLE:
+				ok = a.size() == 5;
+				region = ok ? cv::Rect(cv::Point(a[0], a[1]), cv::Point(a[2] + 1, a[3] + 1)) : cv::Rect();
+				break;
+			case journalRecord::SEGMENT:
+				ok = a.size() == 6 && a[4] >= 0;
+				region = ok ? segmentRegion(cv::Point(a[0], a[1]), cv::Point(a[2], a[3]), a[4]) : cv::Rect();
+				break;
+			case journalRecord::THRESHOLD:
+				ok = a.size() == 4 && a[0] >= 0 && a[0] < globalData.planes->size();
+				region = whole;
+				break;
+			case journalRecord::RANGE:
+				ok = a.size() >= 5 && (a.size() - 2) % 3 == 0;
+				for(size_t i=2; ok && i<a.size(); i+=3)
+					ok = a[i] >= 0 && a[i] < globalData.planes->size();
+				region = whole;
+				break;
+			case journalRecord::TILE:
+				ok = a.size() == 4;
+				region = ok ? cv::Rect(a[0], a[1], a[2], a[3]) : cv::Rect();
+				break;
+			default:
+				ok = false;
+		}
+		if(!ok)
+			continue;
+
+		// Each record is an edit, unless it is inside BEGIN/END
+		if(grouped)
+			globalData.history->extend(mask, region);
+		else
+			globalData.history->begin(mask, region);
+		cv::Mat threshold_mask;
+		switch(r.type)
+		{
+			case journalRecord::CIRCLE:
+				cv::circle(mask, cv::Point(a[0], a[1]), a[2], cv::Scalar(a[3]), cv::FILLED);
+				break;
+			case journalRecord::RECTANGLE:
+				cv::rectangle(mask, cv::Point(a[0], a[1]), cv::Point(a[2], a[3]), cv::Scalar(a[4]), cv::FILLED);
+				break;
+			case journalRecord::SEGMENT:
+				paintSegment(mask, cv::Point(a[0], a[1]), cv::Point(a[2], a[3]), a[4], a[5]);
+				break;
+			case journalRecord::THRESHOLD:
+				thresholdPlane(*globalData.planes, a[0], a[1], a[2] != 0, threshold_mask);
+				mask.setTo(cv::Scalar(a[3]), threshold_mask==0);
+				break;
+			case journalRecord::RANGE:
+			{
+				std::vector<planeRange> ranges;
+				for(size_t i=2; i<a.size(); i+=3)
+					ranges.push_back({a[i], a[i + 1], a[i + 2]});
+				thresholdRanges(*globalData.planes, ranges, a[0] != 0, threshold_mask);
+				mask.setTo(cv::Scalar(a[1]), threshold_mask==0);
+				break;
+			}
+			case journalRecord::TILE:
+				applyTileRecord(r, mask);
+				break;
+			default:
+				break;
+		}
+		if(!grouped)
+		{
+			globalData.history->commit(mask);
+			edits++;
+		}
+	}
+	// A stroke the crash has cut is kept up to its last segment
+	if(grouped)
+	{
+		globalData.history->commit(mask);
+		edits++;
+	}
+	return edits;
+}
+
+
+void display_img(data& globalData, bool displayMask)
+{
+	TRACE_SCOPE("display_img");
+	// The whole image has to be recomposited (the view mode, the channel or the
+	// threshold have changed)
+	globalData.dirty_rect = cv::Rect(0, 0, globalData.read_image.cols, globalData.read_image.rows);
+	composeDirty(globalData, displayMask);
+	// The buttons may have changed too, so I submit the whole image
+	publishDisplay(globalData, cv::Rect(0, 0, globalData.imagePlusControls.cols, globalData.imagePlusControls.rows));
+}
+
+void display_dirty(data& globalData, bool displayMask)
+{
+	TRACE_SCOPE("display_dirty");
+	cv::Rect region = composeDirty(globalData, displayMask);
+	if(!region.empty())
+		publishDisplay(globalData, region);
+}
+
+cv::Rect composeDirty(data& globalData, bool displayMask)
+{
+	cv::Rect dirty = globalData.dirty_rect & cv::Rect(0, 0, globalData.read_image.cols, globalData.read_image.rows);
+	globalData.dirty_rect = cv::Rect();
+	if(dirty.empty())
+		return cv::Rect();
+
+	// I get the displayed region that contains the dirty region (with a margin of one
+	// displayed pixel, as tile borders are rounded)
+	cv::Rect displayed = globalData.view.imageToDisplay(dirty);
+	if(displayed.empty())
+		return cv::Rect();
+	displayed = cv::Rect(displayed.x - 1, displayed.y - 1, displayed.width + 2, displayed.height + 2);
+
+	return composeDisplayRegion(globalData, displayMask, displayed);
+}
+
+cv::Rect composeDisplayRegion(data& globalData, bool displayMask, const cv::Rect& displayRegion)
+{
+	TRACE_SCOPE("composeDisplayRegion");
+	cv::Rect region;
+	cv::Rect r = displayRegion & cv::Rect(0, 0, DISPLAY_SIZE_W, DISPLAY_SIZE_H);
+	if(r.empty())
+		return region;
+
+	// I get the display tiles that contain the region
+	int tx0 = r.x/DISPLAY_TILE_SIZE, tx1 = (r.x + r.width - 1)/DISPLAY_TILE_SIZE;
+	int ty0 = r.y/DISPLAY_TILE_SIZE, ty1 = (r.y + r.height - 1)/DISPLAY_TILE_SIZE;
+
+	for(int ty=ty0; ty<=ty1; ty++)
+	{
+		for(int tx=tx0; tx<=tx1; tx++)
+		{
+			cv::Rect tile(tx*DISPLAY_TILE_SIZE, ty*DISPLAY_TILE_SIZE, DISPLAY_TILE_SIZE, DISPLAY_TILE_SIZE);
+			tile &= cv::Rect(0, 0, DISPLAY_SIZE_W, DISPLAY_SIZE_H);
+			if(!tile.empty())
+			{
+				composeTile(globalData, displayMask, tile);
+				region = region.empty() ? tile : (region | tile);
+			}
+		}
+	}
+
+	return region;
+}
+
+void markDirty(data& globalData, const cv::Rect& region)
+{
+	if(globalData.dirty_rect.empty())
+		globalData.dirty_rect = region;
+	else
+		globalData.dirty_rect |= region;
+}
+
+void composeTile(data& globalData, bool displayMask, const cv::Rect& tile)
+{
+	TRACE_SCOPE("composeTile");
+	cv::Mat display_tile = globalData.imagePlusControls(tile);
+	bool zoomed = globalData.view.zoom() > 1.0;
+
+	// The threshold preview is already at display resolution, so if the whole image is
+	// displayed the tile is composited from the channel proxy and the preview of the
+	// threshold index
+	if(!displayMask && globalData.th_on && !zoomed)
+	{
+		const thresholdIndex& index = globalData.th_index.at(globalData.actual_channel-1);
+		const cv::Mat& preview = globalData.th_range_on ? globalData.th_range_preview.preview() : index.preview();
+		overlayLabels(index.proxy()(tile), preview(tile), globalData.threshold_palette, display_tile);
+		return;
+	}
+
+	// If I wanna plot the color image I take the pyramid of the read image, else I want
+	// to plot a certain channel. I sample from the smallest level that keeps the displayed
+	// resolution, so as to the cost does not depend on the size of the read image (and
+	// only the displayed part of the level is read)
+	cv::Mat level = globalData.actual_channel == 0 ? globalData.pyramid.levelFor(globalData.view.neededLevelSize())
+		: globalData.planes->level(globalData.actual_channel-1, globalData.view.neededLevelSize());
+
+	// I resize the region of the level that gets displayed in the tile. Adjacent tiles
+	// share their borders, so as to the result is the same as resizing the whole region
+	cv::Mat img;
+	cv::Rect src = globalData.view.tileToSource(tile, level.size());
+	int interpolation = src.width > tile.width ? cv::INTER_AREA : cv::INTER_LINEAR;
+	{
+		TRACE_SCOPE("composeTile/resize");
+		cv::resize(level(src), img, tile.size(), 0, 0, interpolation);
+	}
+
+	// If I want to display the mask, I sample it (at full resolution) at the displayed
+	// pixels and I color each label with its palette entry
+	if(displayMask)
+	{
+		cv::Mat labels;
+		cv::resize(globalData.mask(globalData.view.tileToSource(tile, globalData.mask.size())), labels,
+				   tile.size(), 0, 0, cv::INTER_NEAREST);
+		overlayLabels(img, labels, globalData.mask_palette, display_tile);
+	}
+	// When zoomed, the threshold preview is computed on the displayed pixels
+	else if(globalData.th_on && !globalData.th_range_on)
+	{
+		cv::Mat preview;
+		cv::threshold(img, preview, globalData.th_value, 255,
+					  globalData.th_inv ? cv::THRESH_BINARY_INV : cv::THRESH_BINARY);
+		overlayLabels(img, preview, globalData.threshold_palette, display_tile);
+	}
+	// (and the range one on the displayed pixels of each bounded plane, sampled as the channel is)
+	else if(globalData.th_on)
+	{
+		std::vector<cv::Mat> samples(globalData.th_ranges.size());
+		for(size_t i=0; i<samples.size(); i++)
+		{
+			cv::Mat plane_level = globalData.planes->level(globalData.th_ranges[i].plane, globalData.view.neededLevelSize());
+			cv::Rect plane_src = globalData.view.tileToSource(tile, plane_level.size());
+			cv::resize(plane_level(plane_src), samples[i], tile.size(), 0, 0,
+					   plane_src.width > tile.width ? cv::INTER_AREA : cv::INTER_LINEAR);
+		}
+		cv::Mat preview;
+		rangeThreshold(samples, globalData.th_ranges, globalData.th_inv, preview);
+		overlayLabels(img, preview, globalData.threshold_palette, display_tile);
+	}
+	else if(img.channels() == 1)
+		cv::cvtColor(img, display_tile, cv::COLOR_GRAY2BGR);
+	else
+		img.copyTo(display_tile);
+}
+
+void publishDisplay(data& globalData, const cv::Rect& region)
+{
+	// I submit it to the presenter (the display_thread will display it)
+	if(globalData.presenter)
+		globalData.presenter->submit(globalData.imagePlusControls, region);
+}
+
+void applyThreshold(data& globalData)
+{
+	TRACE_SCOPE("applyThreshold");
+	// A stroke that is still open is one edit of its own, so it ends before this one
+	endStroke(globalData);
+	// The full resolution threshold is only computed now (the slider only updates
+	// the display resolution preview). The range one is a single pass over every bounded plane
+	// The journal only gets its parameters
+	if(globalData.th_range_on)
+	{
+		thresholdRanges(*globalData.planes, globalData.th_ranges, globalData.th_inv, globalData.threshold_mask);
+		std::vector<int> args = {globalData.th_inv, globalData.mask_id};
+		for(const auto& r: globalData.th_ranges)
+			args.insert(args.end(), {r.plane, r.lo, r.hi});
+		journal(globalData, journalRecord::RANGE, args);
+	}
+	else
+	{
+		thresholdPlane(*globalData.planes, globalData.actual_channel-1, globalData.th_value, globalData.th_inv,
+					   globalData.threshold_mask);
+		journal(globalData, journalRecord::THRESHOLD,
+				{globalData.actual_channel-1, globalData.th_value, globalData.th_inv, globalData.mask_id});
+	}
+
+	// I apply the threshold to the mask (with the mask_id label). The history only
+	// keeps the tiles that change
+	globalData.history->begin(globalData.mask, cv::Rect(0, 0, globalData.mask.cols, globalData.mask.rows));
+	globalData.mask.setTo(cv::Scalar(globalData.mask_id), globalData.threshold_mask==0);
+	globalData.history->commit(globalData.mask);
+	globalData.th_on = false;
+	display_img(globalData, globalData.mask_view_on);
+}
+
+void previewThreshold(data& globalData, int value)
+{
+	TRACE_SCOPE("previewThreshold");
+	// If the preview was already displayed only the pixels that cross the threshold
+	// have to be redrawn
+	bool previewing = globalData.th_on && !globalData.mask_view_on;
+
+	// I save the slider's pos at th_value, I set mask_view_on to false because I wanna
+	// see the threshold and I activate th_on becasue I'm working with the threshold
+	globalData.th_value = value;
+	globalData.mask_view_on = false;
+	globalData.th_on = true;
+
+	// I update the display resolution preview (the index of each channel is built the
+	// first time it gets thresholded) according to the value of th_inv
+	thresholdIndex& index = builtIndex(globalData, globalData.actual_channel-1);
+	cv::Rect changed;
+	{
+		TRACE_SCOPE("threshold/update");
+		changed = index.update(value, globalData.th_inv);
+	}
+
+	if(previewing && globalData.view.zoom() == 1.0)
+	{
+		cv::Rect region = composeDisplayRegion(globalData, false, changed);
+		if(!region.empty())
+			publishDisplay(globalData, region);
+		return;
+	}
+
+	// Finally, I display it
+	display_img(globalData, globalData.mask_view_on);
+}
+
+void setRangeBounds(data& globalData, int plane, int lo, int hi)
+{
+	for(auto& r: globalData.th_ranges)
+	{
+		if(r.plane == plane)
+		{
+			r.lo = lo;
+			r.hi = hi;
+			return;
+		}
+	}
+	globalData.th_ranges.push_back({plane, lo, hi});
+}
+
+void previewRange(data& globalData)
+{
+	TRACE_SCOPE("previewRange");
+	if(globalData.th_ranges.empty() || globalData.actual_channel == 0)
+	{
+		globalData.th_on = false;
+		display_img(globalData, globalData.mask_view_on);
+		return;
+	}
+	// The same as previewThreshold, but the preview is the range one (only the pixels
+	// of the plane whose bounds have moved that enter or leave its range get redrawn)
+	bool previewing = globalData.th_on && !globalData.mask_view_on;
+	globalData.mask_view_on = false;
+	globalData.th_on = true;
+
+	// The displayed channel is the base of the preview, so its index is built too
+	builtIndex(globalData, globalData.actual_channel-1);
+	std::vector<const thresholdIndex*> indexes;
+	for(const auto& r: globalData.th_ranges)
+		indexes.push_back(&builtIndex(globalData, r.plane));
+	cv::Rect changed;
+	{
+		TRACE_SCOPE("range/update");
+		changed = globalData.th_range_preview.update(indexes, globalData.th_ranges, globalData.th_inv);
+	}
+
+	if(previewing && globalData.view.zoom() == 1.0)
+	{
+		cv::Rect region = composeDisplayRegion(globalData, false, changed);
+		if(!region.empty())
+			publishDisplay(globalData, region);
+		return;
+	}
+	display_img(globalData, globalData.mask_view_on);
+}
+
+void drawCircle(data& globalData, const cv::Point& center)
+{
+	TRACE_SCOPE("drawCircle");
+	int r = globalData.radiusClick;
+	cv::Rect region(center.x - r, center.y - r, 2*r + 1, 2*r + 1);
+	globalData.history->begin(globalData.mask, region);
+
+	// I delete is enabled im deleting -> mask 0 (background), else I use mask_id
+	cv::Scalar c = globalData.add_on ? cv::Scalar(globalData.mask_id) : cv::Scalar(0);
+
+	// I create the circle and I only redraw the region it covers
+	cv::circle(globalData.mask, center, r, c, cv::FILLED);
+	globalData.history->commit(globalData.mask);
+	journal(globalData, journalRecord::CIRCLE, {center.x, center.y, r, static_cast<int>(c[0])});
+	markDirty(globalData, region);
+	display_dirty(globalData, globalData.mask_view_on);
+}
+
+void drawRectangle(data& globalData, const cv::Point& p1, const cv::Point& p2)
+{
+	TRACE_SCOPE("drawRectangle");
+	// The same as explained with circles
+	cv::Rect region(p1, p2);
+	region.width++;
+	region.height++;
+	globalData.history->begin(globalData.mask, region);
+
+	cv::Scalar c = globalData.add_on ? cv::Scalar(globalData.mask_id) : cv::Scalar(0);
+
+	cv::rectangle(globalData.mask, p1, p2, c, cv::FILLED);
+	globalData.history->commit(globalData.mask);
+	journal(globalData, journalRecord::RECTANGLE, {p1.x, p1.y, p2.x, p2.y, static_cast<int>(c[0])});
+	markDirty(globalData, region);
+	display_dirty(globalData, globalData.mask_view_on);
+}
+
+void applyCleanup(data& globalData, const labelCleanup& step)
+{
+	TRACE_SCOPE("applyCleanup");
+	endStroke(globalData);
+	// The label stats give its bounding box, so the mask is not scanned to find it
+	cv::Mat cleaned;
+	cv::Rect region = cleanLabel(globalData.mask, step, globalData.label_stats.bounds(step.label), cleaned);
+	if(region.empty())
+		return;
+	globalData.history->begin(globalData.mask, region);
+	cleaned.copyTo(globalData.mask(region));
+	// The journal keeps the changed tiles, as the cleanup depends on the mask it is applied to
+	captureTiles(globalData);
+	globalData.history->commit(globalData.mask);
+	journalTiles(globalData);
+	markDirty(globalData, region);
+	display_dirty(globalData, globalData.mask_view_on);
+}
+
+bool fillRegion(data& globalData, const cv::Point& p)
+{
+	TRACE_SCOPE("fillRegion");
+	endStroke(globalData);
+	if(!globalData.regions)
+		return false;
+	std::shared_ptr<const regionIndex> index = globalData.regions->get(globalData.image_file);
+	if(!index || index->full != globalData.mask.size())
+		return false;
+	int region = index->regionAt(p);
+	if(region < 0)
+		return false;
+
+	// Only the bounding box of the region is saved and redrawn, and only its runs are painted
+	cv::Rect box = index->bounds(region);
+	globalData.history->begin(globalData.mask, box);
+	index->paint(region, globalData.mask, static_cast<uchar>(globalData.add_on ? globalData.mask_id : 0));
+	// The journal keeps the changed tiles, as the index may not be the same when it is replayed
+	captureTiles(globalData);
+	globalData.history->commit(globalData.mask);
+	journalTiles(globalData);
+	markDirty(globalData, box);
+	display_dirty(globalData, globalData.mask_view_on);
+	return true;
+}
+
+namespace
+{
+	// Paints the capsule (segment p1-p2 with round ends) of the stroke and returns the
+	// region of the mask it covers
+	cv::Rect paintCapsule(data& globalData, const cv::Point& p1, const cv::Point& p2)
+	{
+		int r = globalData.radiusClick;
+		cv::Rect region = segmentRegion(p1, p2, r);
+		globalData.history->extend(globalData.mask, region);
+
+		int value = globalData.add_on ? globalData.mask_id : 0;
+		paintSegment(globalData.mask, p1, p2, r, value);
+		journal(globalData, journalRecord::SEGMENT, {p1.x, p1.y, p2.x, p2.y, r, value});
+		return region;
+	}
+
+	// Redraws the painted region, unless the previous frame has not been shown yet
+	void displayStroke(data& globalData, bool force)
+	{
+		if(!force && globalData.presenter && globalData.presenter->waiting())
+			return;
+		display_dirty(globalData, globalData.mask_view_on);
+	}
+}
+
+void beginStroke(data& globalData, const cv::Point& p)
+{
+	TRACE_SCOPE("beginStroke");
+	if(globalData.stroking)
+		endStroke(globalData);
+	globalData.history->begin(globalData.mask, cv::Rect());
+	journal(globalData, journalRecord::BEGIN, {});
+	globalData.stroking = true;
+	globalData.stroke_last = p;
+	markDirty(globalData, paintCapsule(globalData, p, p));
+	displayStroke(globalData, false);
+}
+
+void continueStroke(data& globalData, const cv::Point& p)
+{
+	TRACE_SCOPE("continueStroke");
+	// The mouse may report the same point again
+	if(!globalData.stroking || p == globalData.stroke_last)
+		return;
+	markDirty(globalData, paintCapsule(globalData, globalData.stroke_last, p));
+	globalData.stroke_last = p;
+	displayStroke(globalData, false);
+}
+
+void endStroke(data& globalData)
+{
+	TRACE_SCOPE("endStroke");
+	if(!globalData.stroking)
+		return;
+	globalData.stroking = false;
+	globalData.history->commit(globalData.mask);
+	journal(globalData, journalRecord::END, {});
+	// The last points may not have been displayed
+	displayStroke(globalData, true);
+}
+
+bool undoEdit(data& globalData)
+{
+	TRACE_SCOPE("undoEdit");
+	endStroke(globalData);
+	// I restore the tiles changed by the last edit and I display the result
+	// The journal keeps the restored tiles (the edit may be older than the journal)
+	cv::Rect changed;
+	captureTiles(globalData);
+	bool undone = globalData.history->undo(globalData.mask, changed);
+	journalTiles(globalData);
+	if(!undone)
+		return false;
+	markDirty(globalData, changed);
+	display_dirty(globalData, globalData.mask_view_on);
+	return true;
+}
+
+bool redoEdit(data& globalData)
+{
+	TRACE_SCOPE("redoEdit");
+	endStroke(globalData);
+	// I apply again the last undone edit
+	cv::Rect changed;
+	captureTiles(globalData);
+	bool redone = globalData.history->redo(globalData.mask, changed);
+	journalTiles(globalData);
+	if(!redone)
+		return false;
+	markDirty(globalData, changed);
+	display_dirty(globalData, globalData.mask_view_on);
+	return true;
+}
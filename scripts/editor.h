@@ -0,0 +1,168 @@
+#ifndef EDITOR_H
+#define EDITOR_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+
+#include "opencv2/core/core.hpp"
+
+#include "utils.h"
+#include "prefetch.h"
+#include "presenter.h"
+#include "history.h"
+#include "overlay.h"
+#include "threshold.h"
+#include "viewport.h"
+#include "mapped.h"
+#include "writer.h"
+#include "replay.h"
+#include "regions.h"
+#include "labels.h"
+#include "journal.h"
+#include "navigation.h"
+#include "morphology.h"
+
+// Size to which the image will be resized so as to be displayed. This size
+// should be multiple of the real image dimmentions, so as to reconstruct the
+// mask from the resized image with more precision
+#define DISPLAY_SIZE_H 800
+#define DISPLAY_SIZE_W 800
+// Side of the square tiles in which the displayed image is divided. When the mask
+// changes, only the tiles that contain the changed region get recomposited
+#define DISPLAY_TILE_SIZE 100
+
+// Struct that holds all the features we need to
+// create a button
+struct rectanglesButtons
+{
+	cv::Rect _rect;
+	std::string _name;
+	cv::Scalar _color;
+};
+
+// Struct that holds data that we might want to use in mouse and
+// slider callbacks
+struct data
+{
+	cv::Mat read_image;	// The image that has been read from the specified directory
+	cv::Mat imagePlusControls; // a image containing the resized read image + buttons
+	cv::Mat mask; // Te current created mask
+	maskHistory* history; // Undo/redo history of the mask
+	labelSet label_set; // Names and colors of the labels
+	labelStats label_stats; // Pixels and bounding box of each label of the mask (updated by every edit)
+	labelPalette mask_palette; // Colors with which each label of the mask is displayed
+	labelPalette threshold_palette; // Colors with which the threshold mask is displayed
+	cv::Mat threshold_mask; // A cv::Mat that holds the threshold (only computed when it is applied)
+	std::vector<thresholdIndex> th_index; // Display resolution threshold preview of each channel
+	std::vector<planeRange> th_ranges; // Bounds of the planes of the range threshold (the ones whose sliders have been moved)
+	rangePreview th_range_preview; // Display resolution preview of the range threshold
+	utils::imageList Images; // List of the image files in the directory (it grows while the directory is scanned)
+	std::shared_ptr<channelProvider> planes; // Planes of the read image (actual_channel-1), converted when first displayed
+	imagePyramid pyramid; // Reduced versions of read_image, from which it gets displayed
+	std::shared_ptr<mappedFile> image_backing; // Mapped cache of read_image (null if it is in memory)
+	std::shared_ptr<mappedFile> mask_backing; // Mapped file of the mask (null if it is in memory)
+	decodeOptions decode_options; // How the images get decoded
+	std::string mask_cache_tag; // Appended to the name of the mapped mask (sessions that edit the same image need their own)
+	viewport view; // Region of the read image that is displayed (zoom and pan)
+	cv::Point pan_start; // Last displayed point while dragging with the right button
+	int mask_id; // The id of the mask with which we're working (0 (background) to the last one of label_set)
+	int actual_channel; // The idx of the channel which is being displayed (0 means color image)
+	int th_value; // Current value of the threshold (trackbar)
+	int th_max = 255; // Current upper bound of the range threshold (trackbar, only used in range mode)
+	int current_image; // idx of the current image
+	int radiusClick; // Radius of the circle displayed when doubleclicked the image
+	rectanglesButtons* buttons = nullptr; // Array of rectanglesButtons
+	imagePrefetcher* prefetcher = nullptr; // Decodes the next images in background
+	maskWriter* writer = nullptr; // Writes the saved masks in background
+	regionIndexer* regions = nullptr; // Over-segments the images in background (click-to-label is disabled if null)
+	std::string image_file; // Path of the read image
+	framePresenter* presenter = nullptr; // Where the composited image gets submitted (nothing is displayed if null)
+	sessionRecorder* recorder = nullptr; // Logs the events of the session (nothing is logged if null)
+	std::string replay_session; // Session being replayed (the images are opened with the masks it recorded)
+	navigationCache* navigation = nullptr; // Images that have been visited and the masks they were left with (nothing is kept if null)
+	editJournal* journal = nullptr; // Logs the edits of the current image until it gets saved (nothing is logged if null)
+	bool journal_capture = false; // Whether the tiles the history changes are kept in journal_tiles
+	std::vector<journalRecord> journal_tiles; // Tiles of the edit being journaled by content
+	std::chrono::time_point<std::chrono::system_clock> event_time; // Time of the event being handled (the recorded one when replaying)
+	bool mask_view_on; // boolean that holds whether we want to see the mask or not
+	bool add_on; // true when add is ON, false when delete is ON
+	bool th_on;   // boolean that enables the threshold mode (so as to not trying to do a threshold to a 3-channel image)
+	bool th_inv; // boolean that holds whether the threshold mode is inverted or not
+	bool th_range_on = false; // Whether the threshold is the range one (th_ranges) instead of th_value on the current channel
+	cv::Point2d rect_p1; // Coordinates of the point 1 (when displaying the rectangle)
+	cv::Point2d rect_p2; // Coordinates of the point 2 (when displaying the rectangle)
+	cv::Rect dirty_rect; // Region of the read image that has changed since it was last displayed
+	bool stroking = false; // Whether a brush stroke is being painted
+	bool click_handled = false; // Whether the left button went down for a region fill or a stroke (so its release is not a rectangle)
+	cv::Point stroke_last; // Last point of the stroke (real image coordinates)
+	std::chrono::time_point<std::chrono::system_clock> m_StartTime; // Start time of the rectangle display is clicked
+	std::chrono::time_point<std::chrono::system_clock> m_EndTime;  // End time when rectangle is finished
+
+};
+
+// Function that reads all the images with the specified extension in the specifies path
+void readImage(const std::string& _path, data& globalData);
+// Function that swaps an already decoded image into globalData. If restored is given, the
+// image gets the mask it had been left with (which is moved in) instead of an empty one
+void installImage(decodedImage& decoded, data& globalData, openMask* restored = nullptr);
+// Function that reads the saved mask file (if there is one) into the mask
+void loadSavedMask(const std::string& file, data& globalData);
+// Function that queues the mask (and its label stats) to be written to file by the writer.
+// Once it has been written, the edits it contains are removed from the journal
+void saveMask(const std::string& file, data& globalData);
+// Function that repeats the edits of a journal on the mask (each one can be undone, as
+// if it had just been made). Returns the number of edits
+int replayJournal(data& globalData, const std::vector<journalRecord>& records);
+// Functions that copies the corresponding image (masks, thresholds and so on to the global image)
+void display_img(data& globalData, bool displayMask);
+// Same as display_img but it only recomposites the display tiles that contain dirty_rect
+void display_dirty(data& globalData, bool displayMask);
+// Recomposites the tiles that contain dirty_rect and returns the displayed region they cover
+cv::Rect composeDirty(data& globalData, bool displayMask);
+// Recomposites the tiles that contain a region of the displayed image and returns the region they cover
+cv::Rect composeDisplayRegion(data& globalData, bool displayMask, const cv::Rect& region);
+// Adds a region of the read image (the one an edit has changed) to dirty_rect
+void markDirty(data& globalData, const cv::Rect& region);
+// Composites the read image (+ mask or threshold) into one tile of the displayed image
+void composeTile(data& globalData, bool displayMask, const cv::Rect& tile);
+// Submits the region of the composited image that has changed to the presenter
+void publishDisplay(data& globalData, const cv::Rect& region);
+
+// Mask edits (they are stored in the history and the changed region gets displayed)
+// Applies the threshold of the current channel (or the range threshold in range mode) to
+// the mask (APPLY THRESHOLD)
+void applyThreshold(data& globalData);
+// Updates the threshold preview of the current channel to value and displays it
+void previewThreshold(data& globalData, int value);
+// Sets the bounds of plane in th_ranges (it is added if it had none)
+void setRangeBounds(data& globalData, int plane, int lo, int hi);
+// Updates the preview of the range threshold to th_ranges and displays it over the
+// current channel (nothing is previewed while th_ranges is empty)
+void previewRange(data& globalData);
+// Draws a circle of radiusClick (double click) and a rectangle (drag), both in real
+// image coordinates, with mask_id (or 0 when deleting)
+void drawCircle(data& globalData, const cv::Point& center);
+void drawRectangle(data& globalData, const cv::Point& p1, const cv::Point& p2);
+// Cleans up the pixels of step.label (opening, closing, hole fill and small components, see
+// labelCleanup). Only the region around its bounding box is processed
+void applyCleanup(data& globalData, const labelCleanup& step);
+// Labels the whole region of the over-segmentation that contains p (real image coordinates)
+// with mask_id (or 0 when deleting). If the index of the image is still being built it
+// waits for it. Returns false if there is no index
+bool fillRegion(data& globalData, const cv::Point& p);
+// Brush strokes (real image coordinates, with radiusClick and mask_id or 0 when deleting).
+// Each new point paints the capsule from the previous one, only updating and redrawing
+// the rectangle it covers, and the whole stroke is one undo step. While the presenter
+// has not shown the previous frame the redraw is postponed (the dirty region grows), so
+// as to fast mouse moves do not queue frames
+void beginStroke(data& globalData, const cv::Point& p);
+void continueStroke(data& globalData, const cv::Point& p);
+void endStroke(data& globalData);
+// Undoes (redoes) the last edit and displays the restored region. They return false if
+// there is nothing to do
+bool undoEdit(data& globalData);
+bool redoEdit(data& globalData);
+
+#endif
@@ -0,0 +1,229 @@
+#include "history.h"
+
+#include <cstring>
+#include <algorithm>
+
+namespace
+{
+	// Copies the tile rect of mask into a contiguous buffer
+	void readTile(const cv::Mat& mask, const cv::Rect& rect, std::vector<uchar>& out)
+	{
+		out.resize(static_cast<size_t>(rect.width)*rect.height);
+		for(int y=0; y<rect.height; y++)
+			std::memcpy(&out[static_cast<size_t>(y)*rect.width], mask.ptr<uchar>(rect.y + y) + rect.x, rect.width);
+	}
+
+	// Run-length encodes a tile as (run length, value) pairs. Masks are mostly made of
+	// long runs of the same label, so tiles usually shrink a lot
+	void encodeRLE(const std::vector<uchar>& in, std::vector<uchar>& out)
+	{
+		out.clear();
+		size_t i = 0;
+		while(i < in.size())
+		{
+			uchar v = in[i];
+			size_t run = 1;
+			while(i + run < in.size() && in[i + run] == v && run < 255)
+				run++;
+			out.push_back(static_cast<uchar>(run));
+			out.push_back(v);
+			i += run;
+		}
+	}
+
+	void decodeRLE(const std::vector<uchar>& in, std::vector<uchar>& out, size_t n)
+	{
+		out.resize(n);
+		size_t o = 0;
+		for(size_t i=0; i+1<in.size() && o<n; i+=2)
+		{
+			size_t run = std::min<size_t>(in[i], n - o);
+			std::memset(&out[o], in[i + 1], run);
+			o += run;
+		}
+	}
+
+	size_t tileBytes(const maskTile& tile)
+	{
+		return tile.before.capacity() + tile.after.capacity() + sizeof(maskTile);
+	}
+}
+
+maskHistory::maskHistory(size_t byte_budget, int tile_size, bool compress)
+	: _budget(byte_budget), _tile_size(tile_size > 0 ? tile_size : 64), _compress(compress),
+	  used_bytes(0), pending_open(false)
+{
+}
+
+void maskHistory::listen(const tileListener& listener)
+{
+	_listener = listener;
+}
+
+void maskHistory::begin(const cv::Mat& mask, const cv::Rect& region)
+{
+	pending.tiles.clear();
+	pending.region = cv::Rect();
+	pending.bytes = 0;
+	pending_keys.clear();
+	pending_open = true;
+	extend(mask, region);
+}
+
+void maskHistory::extend(const cv::Mat& mask, const cv::Rect& region)
+{
+	cv::Rect r = region & cv::Rect(0, 0, mask.cols, mask.rows);
+	if(!pending_open || r.empty())
+		return;
+
+	// I save every tile of the grid that intersects the region (the ones that had already
+	// been saved keep their content before the edit)
+	long long cols = (mask.cols + _tile_size - 1)/_tile_size;
+	int tx0 = r.x/_tile_size, tx1 = (r.x + r.width - 1)/_tile_size;
+	int ty0 = r.y/_tile_size, ty1 = (r.y + r.height - 1)/_tile_size;
+	for(int ty=ty0; ty<=ty1; ty++)
+	{
+		for(int tx=tx0; tx<=tx1; tx++)
+		{
+			if(!pending_keys.insert(ty*cols + tx).second)
+				continue;
+			maskTile tile;
+			tile.rect = cv::Rect(tx*_tile_size, ty*_tile_size, _tile_size, _tile_size) & cv::Rect(0, 0, mask.cols, mask.rows);
+			tile.compressed = false;
+			readTile(mask, tile.rect, tile.before);
+			pending.tiles.push_back(std::move(tile));
+		}
+	}
+}
+
+void maskHistory::commit(const cv::Mat& mask)
+{
+	if(!pending_open)
+		return;
+	pending_open = false;
+
+	// I only keep the tiles whose content has changed
+	maskEdit edit;
+	edit.bytes = sizeof(maskEdit);
+	for(auto& tile: pending.tiles)
+	{
+		readTile(mask, tile.rect, tile.after);
+		if(tile.after == tile.before)
+			continue;
+		if(_listener)
+			_listener(tile.rect, tile.before.data(), tile.after.data());
+
+		if(_compress)
+		{
+			std::vector<uchar> before, after;
+			encodeRLE(tile.before, before);
+			encodeRLE(tile.after, after);
+			// I only keep the compressed version if it is smaller
+			if(before.size() + after.size() < tile.before.size() + tile.after.size())
+			{
+				tile.before.swap(before);
+				tile.after.swap(after);
+				tile.before.shrink_to_fit();
+				tile.after.shrink_to_fit();
+				tile.compressed = true;
+			}
+		}
+
+		edit.region = edit.region.empty() ? tile.rect : (edit.region | tile.rect);
+		edit.bytes += tileBytes(tile);
+		edit.tiles.push_back(std::move(tile));
+	}
+	pending.tiles.clear();
+	pending_keys.clear();
+
+	// Nothing has changed, so there is nothing to undo
+	if(edit.tiles.empty())
+		return;
+
+	// A new edit makes the undone ones unreachable
+	for(auto& e: redo_stack)
+		used_bytes -= e.bytes;
+	redo_stack.clear();
+
+	used_bytes += edit.bytes;
+	undo_stack.push_back(std::move(edit));
+	evict();
+}
+
+void maskHistory::restore(const maskEdit& edit, bool before, cv::Mat& mask)
+{
+	std::vector<uchar> raw, current;
+	for(const auto& tile: edit.tiles)
+	{
+		const std::vector<uchar>& stored = before ? tile.before : tile.after;
+		size_t n = static_cast<size_t>(tile.rect.width)*tile.rect.height;
+		const uchar* src = stored.data();
+		if(tile.compressed)
+		{
+			decodeRLE(stored, raw, n);
+			src = raw.data();
+		}
+		// The listener gets the change from the content the mask has now to the restored one
+		if(_listener)
+		{
+			readTile(mask, tile.rect, current);
+			_listener(tile.rect, current.data(), src);
+		}
+		for(int y=0; y<tile.rect.height; y++)
+			std::memcpy(mask.ptr<uchar>(tile.rect.y + y) + tile.rect.x, src + static_cast<size_t>(y)*tile.rect.width, tile.rect.width);
+	}
+}
+
+bool maskHistory::undo(cv::Mat& mask, cv::Rect& changed)
+{
+	if(undo_stack.empty())
+		return false;
+
+	restore(undo_stack.back(), true, mask);
+	changed = undo_stack.back().region;
+	redo_stack.push_back(std::move(undo_stack.back()));
+	undo_stack.pop_back();
+	return true;
+}
+
+bool maskHistory::redo(cv::Mat& mask, cv::Rect& changed)
+{
+	if(redo_stack.empty())
+		return false;
+
+	restore(redo_stack.back(), false, mask);
+	changed = redo_stack.back().region;
+	undo_stack.push_back(std::move(redo_stack.back()));
+	redo_stack.pop_back();
+	return true;
+}
+
+void maskHistory::evict()
+{
+	// I always keep the last edit, even if it does not fit the budget by itself
+	while(used_bytes > _budget && undo_stack.size() > 1)
+	{
+		used_bytes -= undo_stack.front().bytes;
+		undo_stack.pop_front();
+	}
+}
+
+void maskHistory::clear()
+{
+	undo_stack.clear();
+	redo_stack.clear();
+	pending.tiles.clear();
+	pending_keys.clear();
+	pending_open = false;
+	used_bytes = 0;
+}
+
+size_t maskHistory::bytes() const
+{
+	return used_bytes;
+}
+
+size_t maskHistory::undoLevels() const
+{
+	return undo_stack.size();
+}
@@ -0,0 +1,81 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <vector>
+#include <deque>
+#include <set>
+#include <functional>
+#include <cstddef>
+
+#include "opencv2/core/core.hpp"
+
+// Struct that holds one tile of the mask before and after an edit
+struct maskTile
+{
+	cv::Rect rect; // Region of the mask covered by the tile
+	std::vector<uchar> before; // Its content before the edit
+	std::vector<uchar> after; // Its content after the edit
+	bool compressed; // Whether before and after are run-length encoded
+};
+
+// Struct that holds every tile changed by one edit (circle, rectangle, threshold...)
+struct maskEdit
+{
+	std::vector<maskTile> tiles;
+	cv::Rect region; // Bounding box of the tiles
+	size_t bytes; // Memory used by the tiles
+};
+
+// Class that holds a multi-level undo/redo history of the mask. Each edit only
+// stores the tiles it has changed, and the oldest edits get evicted when the
+// history uses more than byte_budget bytes
+class maskHistory
+{
+public:
+	// Function that gets each tile of the mask an edit changes: its region and its content
+	// before and after (contiguous, rect.width pixels per row)
+	typedef std::function<void(const cv::Rect& rect, const uchar* before, const uchar* after)> tileListener;
+
+	maskHistory(size_t byte_budget, int tile_size, bool compress);
+
+	// Sets the function that is called with the tiles that change when an edit is commited,
+	// undone or redone (so as to what depends on the mask can follow it without scanning it)
+	void listen(const tileListener& listener);
+
+	// Saves the tiles of mask that contain region. It must be called before editing them
+	void begin(const cv::Mat& mask, const cv::Rect& region);
+	// Saves the tiles of mask that contain region and have not been saved since begin(), so
+	// as to an edit (a brush stroke) can grow while it is being made. It must be called
+	// before editing them
+	void extend(const cv::Mat& mask, const cv::Rect& region);
+	// Stores the edit started with begin() (only the tiles that have really changed)
+	void commit(const cv::Mat& mask);
+	// Restores the mask before (after) the last undone edit. changed holds the region
+	// of the mask that has been restored. They return false if there is nothing to do
+	bool undo(cv::Mat& mask, cv::Rect& changed);
+	bool redo(cv::Mat& mask, cv::Rect& changed);
+
+	// Forgets every edit (for instance when a new image is read)
+	void clear();
+	size_t bytes() const;
+	size_t undoLevels() const;
+
+private:
+	// Evicts the oldest edits until the history fits its budget
+	void evict();
+	void restore(const maskEdit& edit, bool before, cv::Mat& mask);
+
+	size_t _budget;
+	int _tile_size;
+	bool _compress;
+	size_t used_bytes;
+	tileListener _listener;
+
+	maskEdit pending; // Edit started with begin() that has not been commited yet
+	std::set<long long> pending_keys; // Grid position (ty*cols + tx) of its tiles
+	bool pending_open;
+	std::deque<maskEdit> undo_stack; // Oldest edit at the front
+	std::vector<maskEdit> redo_stack;
+};
+
+#endif
@@ -0,0 +1,89 @@
+#include "imagecache.h"
+
+#include "trace.h"
+
+imageCache::imageCache(const std::string& path, const decodeOptions& options, int keep)
+	: _path(path), _options(options), _keep(keep), decodes(0), hits(0)
+{
+}
+
+std::shared_ptr<const decodedImage> imageCache::acquire(const std::string& image)
+{
+	TRACE_SCOPE("imageCache/acquire");
+	std::unique_lock<std::mutex> lock(_mutex);
+	cacheEntry& entry = entries[image];
+	decoded_cv.wait(lock, [&]{ return !entry.decoding; });
+
+	std::shared_ptr<const decodedImage> shared = entry.image.lock();
+	if(!shared)
+	{
+		// Nobody holds it, so I decode it (outside the lock, the other images can still
+		// be acquired meanwhile)
+		entry.decoding = true;
+		lock.unlock();
+		std::shared_ptr<decodedImage> decoded = std::make_shared<decodedImage>();
+		decoded->index = -1;
+		bool ok = decodeImage(_path + image, *decoded, _options);
+		lock.lock();
+
+		entry.decoding = false;
+		decodes++;
+		if(ok)
+		{
+			shared = decoded;
+			entry.image = shared;
+		}
+		decoded_cv.notify_all();
+		if(!shared)
+			return shared;
+	}
+	else
+		hits++;
+
+	// The image becomes the newest of the kept ones
+	for(auto it = recent.begin(); it != recent.end(); it++)
+	{
+		if(it->first == image)
+		{
+			recent.erase(it);
+			break;
+		}
+	}
+	recent.emplace_back(image, shared);
+	while(static_cast<int>(recent.size()) > _keep)
+		recent.pop_front();
+	return shared;
+}
+
+imageCache::cacheStats imageCache::stats() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	cacheStats s{decodes, hits, 0, 0};
+	for(const auto& e: entries)
+	{
+		std::shared_ptr<const decodedImage> image = e.second.image.lock();
+		if(image)
+		{
+			s.live++;
+			s.bytes += decodedBytes(*image);
+		}
+	}
+	return s;
+}
+
+size_t decodedBytes(const decodedImage& decoded)
+{
+	size_t bytes = 0;
+	for(const auto& level: decoded.pyramid.levels())
+		bytes += level.total()*level.elemSize();
+	for(const auto& pyramid: decoded.channel_pyramids)
+		for(const auto& level: pyramid.levels())
+			bytes += level.total()*level.elemSize();
+	// The channels are the level 0 of their pyramids, and the image the one of its pyramid
+	if(decoded.pyramid.empty())
+		bytes += decoded.image.total()*decoded.image.elemSize();
+	// The planes that have been converted (shared by every session too)
+	if(decoded.planes)
+		bytes += decoded.planes->bytes();
+	return bytes;
+}
@@ -0,0 +1,63 @@
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <string>
+#include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+#include "prefetch.h"
+
+// Class that holds the decoded images (and their channels and pyramids) shared by every
+// session of the server. Each image is decoded once while some session has it open (or
+// it is among the last keep images that have been opened), so the memory and the decode
+// cost depend on the number of different images, not on the number of sessions. It can
+// be called from any thread
+class imageCache
+{
+public:
+	// path is the directory of the images, options how they get decoded (the pyramids are
+	// warmed for the display size, so the sessions never have to build a shared level)
+	// and keep the number of released images that are kept in case they are opened again
+	imageCache(const std::string& path, const decodeOptions& options, int keep);
+
+	// Returns the decoded image (null if it can not be read). If another session is
+	// decoding it, it waits for it instead of decoding it again. The image must not be
+	// modified (its mats are shared with the other sessions)
+	std::shared_ptr<const decodedImage> acquire(const std::string& image);
+
+	struct cacheStats
+	{
+		long long decodes; // Images that have been decoded
+		long long hits; // Times an image was already decoded
+		int live; // Images held by some session (or kept)
+		size_t bytes; // Memory used by the live images
+	};
+	cacheStats stats() const;
+
+private:
+	struct cacheEntry
+	{
+		std::weak_ptr<const decodedImage> image; // Expires when no session holds it
+		bool decoding = false;
+	};
+
+	std::string _path;
+	decodeOptions _options;
+	int _keep;
+
+	std::map<std::string, cacheEntry> entries;
+	std::deque<std::pair<std::string, std::shared_ptr<const decodedImage>>> recent; // Last opened images, the newest at the back
+	long long decodes;
+	long long hits;
+
+	mutable std::mutex _mutex;
+	std::condition_variable decoded_cv; // acquire() waits here for the image another session is decoding
+};
+
+// Memory used by the mats of decoded (every level of its pyramids and its converted planes included)
+size_t decodedBytes(const decodedImage& decoded);
+
+#endif
@@ -0,0 +1,328 @@
+#include "journal.h"
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+#include <chrono>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "writer.h"
+
+namespace
+{
+	// Every record is (little endian):
+	//     uint8 type, uint32 seq, uint16 n_args, uint32 n_bytes, int32 args[n_args],
+	//     bytes[n_bytes], uint32 checksum (FNV-1a of everything before it)
+	const size_t RECORD_HEADER = 1 + 4 + 2 + 4;
+	const size_t MAX_ARGS = 2 + 3*256;
+
+	template<typename T>
+	void put(std::vector<uchar>& out, T v)
+	{
+		size_t o = out.size();
+		out.resize(o + sizeof(T));
+		std::memcpy(&out[o], &v, sizeof(T));
+	}
+
+	template<typename T>
+	T get(const uchar* p)
+	{
+		T v;
+		std::memcpy(&v, p, sizeof(T));
+		return v;
+	}
+
+	void encodeRecord(const journalRecord& record, std::vector<uchar>& out)
+	{
+		size_t start = out.size();
+		put<uint8_t>(out, static_cast<uint8_t>(record.type));
+		put<uint32_t>(out, record.seq);
+		put<uint16_t>(out, static_cast<uint16_t>(record.args.size()));
+		put<uint32_t>(out, static_cast<uint32_t>(record.bytes.size()));
+		for(int a: record.args)
+			put<int32_t>(out, a);
+		out.insert(out.end(), record.bytes.begin(), record.bytes.end());
+		put<uint32_t>(out, fnv1a(&out[start], out.size() - start));
+	}
+}
+
+journalRecord tileRecord(const cv::Rect& rect, const uchar* content)
+{
+	journalRecord record;
+	record.type = journalRecord::TILE;
+	record.args = {rect.x, rect.y, rect.width, rect.height};
+	// Runs of (value, varint length), as the rows of the .lbl masks
+	size_t n = static_cast<size_t>(rect.width)*rect.height;
+	size_t i = 0;
+	while(i < n)
+	{
+		uchar v = content[i];
+		size_t run = 1;
+		while(i + run < n && content[i + run] == v)
+			run++;
+		record.bytes.push_back(v);
+		for(size_t len = run; ; len >>= 7)
+		{
+			record.bytes.push_back(static_cast<uchar>((len & 0x7f) | (len >= 0x80 ? 0x80 : 0)));
+			if(len < 0x80)
+				break;
+		}
+		i += run;
+	}
+	return record;
+}
+
+bool applyTileRecord(const journalRecord& record, cv::Mat& mask)
+{
+	if(record.type != journalRecord::TILE || record.args.size() != 4)
+		return false;
+	cv::Rect rect(record.args[0], record.args[1], record.args[2], record.args[3]);
+	if(rect.width <= 0 || rect.height <= 0 || (rect & cv::Rect(0, 0, mask.cols, mask.rows)) != rect)
+		return false;
+
+	// I decode the runs first, so as to a wrong record does not leave the tile half written
+	size_t n = static_cast<size_t>(rect.width)*rect.height;
+	std::vector<uchar> content;
+	content.reserve(n);
+	const std::vector<uchar>& b = record.bytes;
+	size_t i = 0;
+	while(i < b.size())
+	{
+		uchar v = b[i++];
+		size_t len = 0;
+		int shift = 0;
+		while(true)
+		{
+			if(i >= b.size() || shift > 35)
+				return false;
+			uchar c = b[i++];
+			len |= static_cast<size_t>(c & 0x7f) << shift;
+			shift += 7;
+			if(!(c & 0x80))
+				break;
+		}
+		if(content.size() + len > n)
+			return false;
+		content.insert(content.end(), len, v);
+	}
+	if(content.size() != n)
+		return false;
+
+	for(int y=0; y<rect.height; y++)
+		std::memcpy(mask.ptr<uchar>(rect.y + y) + rect.x, &content[static_cast<size_t>(y)*rect.width], rect.width);
+	return true;
+}
+
+bool readJournal(const std::string& file, std::vector<journalRecord>& records, size_t* length)
+{
+	records.clear();
+	if(length)
+		*length = 0;
+	std::ifstream in(file, std::ios::binary);
+	if(!in)
+		return false;
+	std::vector<uchar> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+	size_t o = 0;
+	while(o + RECORD_HEADER <= data.size())
+	{
+		const uchar* p = &data[o];
+		uint8_t type = get<uint8_t>(p);
+		uint16_t n_args = get<uint16_t>(p + 5);
+		uint32_t n_bytes = get<uint32_t>(p + 7);
+		if(type > journalRecord::TILE || n_args > MAX_ARGS)
+			break;
+		size_t size = RECORD_HEADER + 4*static_cast<size_t>(n_args) + n_bytes + 4;
+		if(size > data.size() - o || get<uint32_t>(p + size - 4) != fnv1a(p, size - 4))
+			break;
+
+		journalRecord record;
+		record.type = static_cast<journalRecord::recordType>(type);
+		record.seq = get<uint32_t>(p + 1);
+		for(int a=0; a<n_args; a++)
+			record.args.push_back(get<int32_t>(p + RECORD_HEADER + 4*a));
+		const uchar* bytes = p + RECORD_HEADER + 4*static_cast<size_t>(n_args);
+		record.bytes.assign(bytes, bytes + n_bytes);
+		records.push_back(std::move(record));
+		o += size;
+	}
+	if(length)
+		*length = o;
+	return true;
+}
+
+editJournal::editJournal(int sync_ms)
+	: _sync_ms(sync_ms), fd(-1), last_seq(0), stop(false)
+{
+	thread = std::thread(&editJournal::worker, this);
+}
+
+editJournal::~editJournal()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		stop = true;
+	}
+	work_cv.notify_all();
+	thread.join();
+	close();
+}
+
+bool editJournal::open(const std::string& file)
+{
+	close();
+	std::lock_guard<std::mutex> io(io_mutex);
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(file).parent_path(), ec);
+
+	// The half written record a crash may have left is cut, so as to the new ones follow
+	// the last valid one
+	std::vector<journalRecord> records;
+	size_t length = 0;
+	if(readJournal(file, records, &length))
+		std::filesystem::resize_file(file, length, ec);
+
+	int f = ::open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if(f < 0)
+		return false;
+	std::lock_guard<std::mutex> lock(_mutex);
+	fd = f;
+	_file = file;
+	last_seq = records.empty() ? 0 : records.back().seq;
+	return true;
+}
+
+void editJournal::close()
+{
+	std::lock_guard<std::mutex> io(io_mutex);
+	writePending();
+	std::lock_guard<std::mutex> lock(_mutex);
+	if(fd >= 0)
+		::close(fd);
+	fd = -1;
+	_file.clear();
+}
+
+std::string editJournal::file() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _file;
+}
+
+void editJournal::append(journalRecord record)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if(_file.empty())
+			return;
+		record.seq = ++last_seq;
+		encodeRecord(record, pending);
+	}
+	work_cv.notify_one();
+}
+
+uint32_t editJournal::mark() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return last_seq;
+}
+
+void editJournal::compact(const std::string& file, uint32_t mark)
+{
+	std::lock_guard<std::mutex> io(io_mutex);
+	bool current;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		current = file == _file;
+	}
+	// The file has to hold every record before I rewrite it
+	if(current)
+		writePending();
+
+	std::vector<journalRecord> records;
+	if(!readJournal(file, records))
+		return;
+	std::vector<uchar> kept;
+	for(const auto& r: records)
+		if(r.seq > mark)
+			encodeRecord(r, kept);
+	std::error_code ec;
+	if(kept.empty() && !current)
+	{
+		std::filesystem::remove(file, ec);
+		syncFolder(file);
+		return;
+	}
+
+	// The new journal is synced before it replaces the old one, so a crash leaves one of them
+	std::string tmp = file + ".tmp";
+	int f = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(f < 0)
+		return;
+	bool ok = writeAll(f, kept.data(), kept.size()) && ::fsync(f) == 0;
+	::close(f);
+	if(!ok)
+	{
+		std::filesystem::remove(tmp, ec);
+		return;
+	}
+	std::filesystem::rename(tmp, file, ec);
+	if(ec)
+		return;
+	if(!syncFolder(file))
+		std::cerr << "Could not sync the folder of " << file << std::endl;
+
+	// The records are now appended to the new file
+	if(current)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if(fd >= 0)
+			::close(fd);
+		fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	}
+}
+
+void editJournal::flush()
+{
+	std::lock_guard<std::mutex> io(io_mutex);
+	writePending();
+}
+
+void editJournal::writePending()
+{
+	std::vector<uchar> data;
+	int f;
+	std::string file;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		data.swap(pending);
+		f = fd;
+		file = _file;
+	}
+	if(data.empty() || f < 0)
+		return;
+	// fdatasync is enough: the size of the file is part of its data
+	if(!writeAll(f, data.data(), data.size()) || ::fdatasync(f) != 0)
+		std::cerr << "Could not write the journal " << file << std::endl;
+}
+
+void editJournal::worker()
+{
+	while(true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			work_cv.wait(lock, [&]{ return stop || !pending.empty(); });
+			// I wait a bit more, so as to the records of the next edits share the sync
+			if(!stop)
+				work_cv.wait_for(lock, std::chrono::milliseconds(_sync_ms), [&]{ return stop; });
+			if(stop && pending.empty())
+				return;
+		}
+		std::lock_guard<std::mutex> io(io_mutex);
+		writePending();
+	}
+}
@@ -0,0 +1,102 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#include "opencv2/core/core.hpp"
+
+// Struct that holds one edit (or part of one) of the journal. The edits that can be
+// repeated from their parameters take a few bytes, and the rest (region fills, cleanups,
+// undo and redo) store the tiles they have changed. The args are:
+//     BEGIN, END                       the records between them are one edit (a stroke...)
+//     CIRCLE x y r value
+//     RECTANGLE x1 y1 x2 y2 value
+//     SEGMENT x1 y1 x2 y2 r value      capsule of a brush stroke
+//     THRESHOLD plane th inv value     APPLY THRESHOLD (the pixels that are 0 get value)
+//     RANGE inv value [plane lo hi]... APPLY THRESHOLD in range mode
+//     TILE x y w h                     bytes holds the runs of the tile after the edit
+struct journalRecord
+{
+	enum recordType { BEGIN, END, CIRCLE, RECTANGLE, SEGMENT, THRESHOLD, RANGE, TILE };
+
+	journalRecord(recordType type = BEGIN, std::vector<int> args = {})
+		: type(type), args(std::move(args))
+	{
+	}
+
+	recordType type;
+	std::vector<int> args;
+	std::vector<uchar> bytes;
+	uint32_t seq = 0; // Position in the journal (set when it is appended)
+};
+
+// Record of the content (rect.width pixels per row) of a tile of the mask
+journalRecord tileRecord(const cv::Rect& rect, const uchar* content);
+// Writes the content of a TILE record to mask. Returns false if it does not fit it
+bool applyTileRecord(const journalRecord& record, cv::Mat& mask);
+
+// Reads the records of a journal file. A crash may leave the last record half written, so
+// it stops at the first record that is not complete (or whose checksum is wrong). length
+// gets the bytes of the valid records (if not null). Returns false if it can not be read
+bool readJournal(const std::string& file, std::vector<journalRecord>& records, size_t* length = nullptr);
+
+// Class that appends the edits of the current image to its journal, so as to the work that
+// has not been saved survives a crash (or NEXT IMAGE) without writing the whole mask. The
+// records are queued in memory and written (and synced) by a background thread every
+// sync_ms, so many edits share one fsync. When a mask gets saved, the records it contains
+// are removed from the journal (compact), so it only grows with the unsaved work. It can
+// be called from any thread
+class editJournal
+{
+public:
+	explicit editJournal(int sync_ms);
+	// Writes every pending record before returning
+	~editJournal();
+
+	// Starts journaling to file (its valid records are kept, they are the ones that have
+	// been recovered). Returns false if it can not be opened
+	bool open(const std::string& file);
+	// Writes the pending records and stops journaling
+	void close();
+	// File being journaled (empty if none)
+	std::string file() const;
+
+	// Queues a record (nothing is done if no file is open)
+	void append(journalRecord record);
+	// Sequence number of the last appended record (a save contains the records up to it)
+	uint32_t mark() const;
+	// Removes from file the records up to mark (the saved mask contains them). The file is
+	// removed if no record is left and it is not being journaled
+	void compact(const std::string& file, uint32_t mark);
+	// Writes and syncs the pending records now
+	void flush();
+
+	editJournal(const editJournal&) = delete;
+	editJournal& operator=(const editJournal&) = delete;
+
+private:
+	// Inf. loop run by the sync thread
+	void worker();
+	// Writes the pending records (io_mutex must be held)
+	void writePending();
+
+	int _sync_ms;
+	std::string _file;
+	int fd;
+	std::vector<uchar> pending; // Encoded records waiting to be written
+	uint32_t last_seq;
+
+	mutable std::mutex _mutex; // Protects the state
+	std::mutex io_mutex; // Serializes the writes to the file (taken before _mutex)
+	std::condition_variable work_cv;
+	bool stop;
+	std::thread thread;
+};
+
+#endif
@@ -0,0 +1,453 @@
+#include "labelmask.h"
+
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+
+#include "opencv2/imgcodecs/imgcodecs.hpp"
+
+#include "writer.h"
+
+namespace
+{
+	const char label_magic[8] = {'M','C','L','A','B','E','L','1'};
+
+	// End of the run of value v that starts at x. I compare 8 pixels at once (the first
+	// differing byte of the xor is the end of the run)
+	int runEnd(const uchar* row, int x, int cols, uchar v)
+	{
+		const uint64_t pattern = 0x0101010101010101ULL*v;
+		while(x + 8 <= cols)
+		{
+			uint64_t word;
+			std::memcpy(&word, row + x, 8);
+			uint64_t diff = word ^ pattern;
+			if(diff)
+			{
+#if defined(__GNUC__)
+				return x + __builtin_ctzll(diff)/8;
+#else
+				while(row[x] == v)
+					x++;
+				return x;
+#endif
+			}
+			x += 8;
+		}
+		while(x < cols && row[x] == v)
+			x++;
+		return x;
+	}
+
+	void putVarint(std::vector<uchar>& out, uint32_t value)
+	{
+		while(value >= 0x80)
+		{
+			out.push_back(static_cast<uchar>(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back(static_cast<uchar>(value));
+	}
+
+	bool getVarint(const uchar*& p, const uchar* end, uint32_t& value)
+	{
+		value = 0;
+		for(int shift=0; shift<35 && p<end; shift+=7)
+		{
+			uchar b = *p++;
+			value |= static_cast<uint32_t>(b & 0x7f) << shift;
+			if(!(b & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	// Decodes the runs [p, end) of a row of cols pixels into dst
+	bool decodeRow(const uchar* p, const uchar* end, int cols, uchar* dst)
+	{
+		int x = 0;
+		while(p < end)
+		{
+			uchar label = *p++;
+			uint32_t length;
+			if(!getVarint(p, end, length) || length > static_cast<uint32_t>(cols - x))
+				return false;
+			std::memset(dst + x, label, length);
+			x += length;
+		}
+		return x == cols;
+	}
+
+	bool readHeader(const uchar* buffer, size_t size, labelHeader& header)
+	{
+		if(size < sizeof(labelHeader))
+			return false;
+		std::memcpy(&header, buffer, sizeof(labelHeader));
+		if(std::memcmp(header.magic, label_magic, sizeof(label_magic)) != 0)
+			return false;
+		uint64_t index_end = header.index_offset + (static_cast<uint64_t>(header.rows) + 1)*sizeof(uint64_t);
+		return header.index_offset >= sizeof(labelHeader) && index_end <= size && header.data_offset >= index_end
+			   && header.data_offset <= size && header.cols > 0 && header.rows > 0;
+	}
+
+	bool readFile(const std::string& file, std::vector<uchar>& buffer)
+	{
+		std::ifstream in(file, std::ios::binary | std::ios::ate);
+		if(!in)
+			return false;
+		std::streamsize size = in.tellg();
+		in.seekg(0);
+		buffer.resize(static_cast<size_t>(size));
+		return static_cast<bool>(in.read(reinterpret_cast<char*>(buffer.data()), size));
+	}
+
+	std::string extensionOf(const std::string& file)
+	{
+		return std::filesystem::path(file).extension().string();
+	}
+
+	// Finds the end of the json value (object, array or string) that starts at i
+	size_t jsonValueEnd(const std::string& s, size_t i)
+	{
+		int depth = 0;
+		bool in_string = false;
+		for(; i<s.size(); i++)
+		{
+			char c = s[i];
+			if(in_string)
+			{
+				if(c == '\\')
+					i++;
+				else if(c == '"')
+				{
+					in_string = false;
+					if(depth == 0)
+						return i + 1;
+				}
+			}
+			else if(c == '"')
+				in_string = true;
+			else if(c == '{' || c == '[')
+				depth++;
+			else if(c == '}' || c == ']')
+			{
+				if(--depth == 0)
+					return i + 1;
+			}
+		}
+		return std::string::npos;
+	}
+
+	// Position right after "key": inside [begin, end), or npos
+	size_t jsonFind(const std::string& s, const std::string& key, size_t begin, size_t end)
+	{
+		size_t k = s.find("\"" + key + "\"", begin);
+		if(k == std::string::npos || k >= end)
+			return std::string::npos;
+		k = s.find(':', k);
+		if(k == std::string::npos || k >= end)
+			return std::string::npos;
+		return s.find_first_not_of(" \t\r\n", k + 1);
+	}
+
+	// Escapes the quotes and backslashes (of a Windows path, for instance) of a string
+	std::string jsonString(const std::string& s)
+	{
+		std::string out = "\"";
+		for(char c: s)
+		{
+			if(c == '"' || c == '\\')
+				out += '\\';
+			out += c;
+		}
+		return out + "\"";
+	}
+}
+
+void encodeLabelMask(const cv::Mat& mask, std::vector<uchar>& buffer)
+{
+	CV_Assert(mask.type() == CV_8UC1);
+
+	labelHeader header;
+	std::memcpy(header.magic, label_magic, sizeof(label_magic));
+	header.rows = mask.rows;
+	header.cols = mask.cols;
+	header.index_offset = sizeof(labelHeader);
+	header.data_offset = header.index_offset + (static_cast<uint64_t>(mask.rows) + 1)*sizeof(uint64_t);
+
+	std::vector<uint64_t> index(mask.rows + 1);
+	std::vector<uchar> runs;
+	runs.reserve(static_cast<size_t>(mask.rows)*4);
+	for(int y=0; y<mask.rows; y++)
+	{
+		index[y] = runs.size();
+		const uchar* row = mask.ptr<uchar>(y);
+		int x = 0;
+		while(x < mask.cols)
+		{
+			int end = runEnd(row, x, mask.cols, row[x]);
+			runs.push_back(row[x]);
+			putVarint(runs, static_cast<uint32_t>(end - x));
+			x = end;
+		}
+	}
+	index[mask.rows] = runs.size();
+
+	buffer.resize(header.data_offset + runs.size());
+	std::memcpy(buffer.data(), &header, sizeof(header));
+	std::memcpy(buffer.data() + header.index_offset, index.data(), index.size()*sizeof(uint64_t));
+	if(!runs.empty())
+		std::memcpy(buffer.data() + header.data_offset, runs.data(), runs.size());
+}
+
+bool decodeLabelMask(const uchar* buffer, size_t size, cv::Mat& mask)
+{
+	labelHeader header;
+	if(!readHeader(buffer, size, header))
+		return false;
+
+	std::vector<uint64_t> index(header.rows + 1);
+	std::memcpy(index.data(), buffer + header.index_offset, index.size()*sizeof(uint64_t));
+	const uchar* data = buffer + header.data_offset;
+	uint64_t data_size = size - header.data_offset;
+
+	if(mask.rows != static_cast<int>(header.rows) || mask.cols != static_cast<int>(header.cols) || mask.type() != CV_8UC1)
+		mask.create(header.rows, header.cols, CV_8UC1);
+	for(uint32_t y=0; y<header.rows; y++)
+	{
+		if(index[y] > index[y + 1] || index[y + 1] > data_size)
+			return false;
+		if(!decodeRow(data + index[y], data + index[y + 1], header.cols, mask.ptr<uchar>(y)))
+			return false;
+	}
+	return true;
+}
+
+bool readLabelMask(const std::string& file, cv::Mat& mask)
+{
+	std::vector<uchar> buffer;
+	return readFile(file, buffer) && decodeLabelMask(buffer.data(), buffer.size(), mask);
+}
+
+bool readLabelRows(const std::string& file, int first_row, int n_rows, cv::Mat& rows)
+{
+	std::ifstream in(file, std::ios::binary);
+	labelHeader header;
+	if(!in.read(reinterpret_cast<char*>(&header), sizeof(header)))
+		return false;
+	if(std::memcmp(header.magic, label_magic, sizeof(label_magic)) != 0 || first_row < 0 || n_rows <= 0
+	   || static_cast<uint64_t>(first_row) + n_rows > header.rows)
+		return false;
+
+	// I only read the offsets of the rows and their runs
+	std::vector<uint64_t> index(n_rows + 1);
+	in.seekg(header.index_offset + static_cast<uint64_t>(first_row)*sizeof(uint64_t));
+	if(!in.read(reinterpret_cast<char*>(index.data()), index.size()*sizeof(uint64_t)) || index[0] > index[n_rows])
+		return false;
+	std::vector<uchar> runs(index[n_rows] - index[0]);
+	in.seekg(header.data_offset + index[0]);
+	if(!in.read(reinterpret_cast<char*>(runs.data()), runs.size()))
+		return false;
+
+	rows.create(n_rows, header.cols, CV_8UC1);
+	for(int y=0; y<n_rows; y++)
+	{
+		if(index[y] > index[y + 1] || index[y + 1] > index[n_rows])
+			return false;
+		if(!decodeRow(runs.data() + (index[y] - index[0]), runs.data() + (index[y + 1] - index[0]), header.cols, rows.ptr<uchar>(y)))
+			return false;
+	}
+	return true;
+}
+
+std::vector<uint32_t> cocoCounts(const cv::Mat& t, int label)
+{
+	// COCO goes down the columns, so I run along the rows of the transposed mask
+	std::vector<uint32_t> counts;
+	bool inside = false;
+	uint32_t run = 0;
+	for(int y=0; y<t.rows; y++)
+	{
+		const uchar* row = t.ptr<uchar>(y);
+		for(int x=0; x<t.cols; x++)
+		{
+			if((row[x] == label) != inside)
+			{
+				counts.push_back(run);
+				run = 0;
+				inside = !inside;
+			}
+			run++;
+		}
+	}
+	counts.push_back(run);
+	return counts;
+}
+
+void applyCocoCounts(const std::vector<uint32_t>& counts, int label, cv::Mat& mask)
+{
+	// Pixel i (column-major) is (i % rows, i / rows)
+	size_t total = mask.total();
+	size_t i = 0;
+	for(size_t k=0; k<counts.size() && i<total; k++)
+	{
+		size_t end = std::min(total, i + counts[k]);
+		if(k % 2 == 1)
+		{
+			for(size_t j=i; j<end; j++)
+				mask.at<uchar>(static_cast<int>(j % mask.rows), static_cast<int>(j / mask.rows)) = static_cast<uchar>(label);
+		}
+		i = end;
+	}
+}
+
+std::string cocoCountsToString(const std::vector<uint32_t>& counts)
+{
+	// The same as pycocotools: each count (the difference with the one two places before
+	// from the third on) is written in 5 bit chunks, offset by 48
+	std::string s;
+	for(size_t i=0; i<counts.size(); i++)
+	{
+		long long x = counts[i];
+		if(i > 2)
+			x -= counts[i - 2];
+		bool more = true;
+		while(more)
+		{
+			char c = static_cast<char>(x & 0x1f);
+			x >>= 5;
+			more = (c & 0x10) ? x != -1 : x != 0;
+			if(more)
+				c |= 0x20;
+			s += static_cast<char>(c + 48);
+		}
+	}
+	return s;
+}
+
+std::vector<uint32_t> cocoStringToCounts(const std::string& s)
+{
+	std::vector<uint32_t> counts;
+	size_t p = 0;
+	while(p < s.size())
+	{
+		long long x = 0;
+		int k = 0;
+		bool more = true;
+		while(more && p < s.size())
+		{
+			int c = s[p] - 48;
+			x |= static_cast<long long>(c & 0x1f) << (5*k);
+			more = (c & 0x20) != 0;
+			p++;
+			k++;
+			if(!more && (c & 0x10))
+				x |= static_cast<long long>(~0ULL << (5*k));
+		}
+		if(counts.size() > 2)
+			x += counts[counts.size() - 2];
+		counts.push_back(static_cast<uint32_t>(x));
+	}
+	return counts;
+}
+
+bool writeCocoMask(const std::string& file, const std::string& image, const cv::Mat& mask)
+{
+	cv::Mat transposed;
+	cv::transpose(mask, transposed);
+	// A gigapixel mask has more pixels of a label than an int holds
+	long long histogram[256] = {0};
+	for(int y=0; y<mask.rows; y++)
+	{
+		const uchar* row = mask.ptr<uchar>(y);
+		for(int x=0; x<mask.cols; x++)
+			histogram[row[x]]++;
+	}
+
+	std::ostringstream out;
+	out << "{\"images\":[{\"id\":1,\"file_name\":" << jsonString(image) << ",\"height\":" << mask.rows
+		<< ",\"width\":" << mask.cols << "}],\n\"annotations\":[";
+	bool first = true;
+	for(int label=1; label<256; label++)
+	{
+		if(histogram[label] == 0)
+			continue;
+		out << (first ? "\n" : ",\n") << "{\"id\":" << label << ",\"image_id\":1,\"category_id\":" << label
+			<< ",\"iscrowd\":1,\"area\":" << histogram[label] << ",\"segmentation\":{\"size\":[" << mask.rows
+			<< "," << mask.cols << "],\"counts\":\"" << cocoCountsToString(cocoCounts(transposed, label)) << "\"}}";
+		first = false;
+	}
+	out << "]}\n";
+
+	std::string json = out.str();
+	return writeFileAtomic(file, std::vector<uchar>(json.begin(), json.end()));
+}
+
+bool readCocoMask(const std::string& file, cv::Mat& mask)
+{
+	std::vector<uchar> buffer;
+	if(!readFile(file, buffer))
+		return false;
+	std::string s(buffer.begin(), buffer.end());
+
+	size_t annotations = jsonFind(s, "annotations", 0, s.size());
+	if(annotations == std::string::npos || s[annotations] != '[')
+		return false;
+	size_t annotations_end = jsonValueEnd(s, annotations);
+	if(annotations_end == std::string::npos)
+		return false;
+
+	mask.release();
+	size_t p = s.find('{', annotations);
+	while(p != std::string::npos && p < annotations_end)
+	{
+		size_t end = jsonValueEnd(s, p);
+		if(end == std::string::npos)
+			return false;
+
+		size_t category = jsonFind(s, "category_id", p, end);
+		size_t size = jsonFind(s, "size", p, end);
+		size_t counts = jsonFind(s, "counts", p, end);
+		if(category == std::string::npos || size == std::string::npos || counts == std::string::npos || s[counts] != '"')
+			return false;
+
+		int label = std::atoi(s.c_str() + category);
+		int rows = 0, cols = 0;
+		if(std::sscanf(s.c_str() + size, "[%d ,%d]", &rows, &cols) != 2 || rows <= 0 || cols <= 0 || label < 0 || label > 255)
+			return false;
+		if(mask.empty())
+			mask = cv::Mat::zeros(rows, cols, CV_8UC1);
+		else if(mask.rows != rows || mask.cols != cols)
+			return false;
+
+		size_t counts_end = s.find('"', counts + 1);
+		applyCocoCounts(cocoStringToCounts(s.substr(counts + 1, counts_end - counts - 1)), label, mask);
+		p = s.find('{', end);
+	}
+	return !mask.empty();
+}
+
+bool readMask(const std::string& file, cv::Mat& mask)
+{
+	std::string ext = extensionOf(file);
+	if(ext == LABEL_MASK_EXTENSION)
+		return readLabelMask(file, mask);
+	if(ext == ".json")
+		return readCocoMask(file, mask);
+	mask = cv::imread(file, cv::IMREAD_GRAYSCALE);
+	return !mask.empty();
+}
+
+bool convertMask(const std::string& in, const std::string& out)
+{
+	cv::Mat mask;
+	if(!readMask(in, mask))
+		return false;
+	if(extensionOf(out) == ".json")
+		return writeCocoMask(out, std::filesystem::path(in).filename().string(), mask);
+	return writeMaskAtomic(out, mask, std::vector<int>());
+}
@@ -0,0 +1,59 @@
+#ifndef LABELMASK_H
+#define LABELMASK_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "opencv2/core/core.hpp"
+
+// Native format of the masks (.lbl). Each row is stored as runs of (label byte, length
+// varint), so a mostly background mask takes a few bytes per row. Little endian:
+//     header (labelHeader)
+//     row index: rows+1 uint64 offsets of each row, relative to data_offset
+//     data: the runs of every row
+#define LABEL_MASK_EXTENSION ".lbl"
+
+struct labelHeader
+{
+	char magic[8]; // "MCLABEL1"
+	uint32_t rows;
+	uint32_t cols;
+	uint64_t index_offset; // Where the row index starts
+	uint64_t data_offset; // Where the runs start
+};
+
+// Encodes mask (CV_8UC1) to buffer in the .lbl format
+void encodeLabelMask(const cv::Mat& mask, std::vector<uchar>& buffer);
+// Decodes a .lbl buffer. If mask already has its size and type, it gets decoded in place
+// (so as to a mapped mask stays mapped). Returns false if the buffer is not valid
+bool decodeLabelMask(const uchar* buffer, size_t size, cv::Mat& mask);
+
+// Reads a whole .lbl file. Returns false if it does not exist or it is not valid
+bool readLabelMask(const std::string& file, cv::Mat& mask);
+// Reads only the rows [first_row, first_row+n_rows) of a .lbl file (thanks to the row index
+// only their runs are read). Returns false if it is not valid or the rows are outside it
+bool readLabelRows(const std::string& file, int first_row, int n_rows, cv::Mat& rows);
+
+// COCO-style RLE of the pixels of a mask with the given label: alternate counts of other and
+// label pixels, in column-major order, starting with the other ones. It takes the transposed
+// mask (cv::transpose), whose rows are the columns of the mask, so as to a mask with many
+// labels is only transposed once
+std::vector<uint32_t> cocoCounts(const cv::Mat& transposed, int label);
+// Sets to label the pixels of mask (with the size the counts were made for) they cover
+void applyCocoCounts(const std::vector<uint32_t>& counts, int label, cv::Mat& mask);
+// Compressed string of the counts (the one used in the COCO json files) and back
+std::string cocoCountsToString(const std::vector<uint32_t>& counts);
+std::vector<uint32_t> cocoStringToCounts(const std::string& s);
+
+// Writes a COCO-style json with one annotation (compressed RLE) per label of mask but the
+// background, and reads it back. They return false on failure
+bool writeCocoMask(const std::string& file, const std::string& image, const cv::Mat& mask);
+bool readCocoMask(const std::string& file, cv::Mat& mask);
+
+// Reads a mask in any of the supported formats (.lbl, .json or any image cv::imread reads)
+bool readMask(const std::string& file, cv::Mat& mask);
+// Converts a mask between formats (given by the extensions of in and out)
+bool convertMask(const std::string& in, const std::string& out);
+
+#endif
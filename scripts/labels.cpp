@@ -0,0 +1,246 @@
+#include "labels.h"
+
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+
+labelSet defaultLabelSet()
+{
+	labelSet set;
+	set.labels = {{"background", cv::Scalar(255,0,0), true},
+				  {"label 1", cv::Scalar(0,255,0), true},
+				  {"label 2", cv::Scalar(0,0,255), true}};
+	return set;
+}
+
+bool loadLabelSet(const std::string& file, labelSet& set, std::string& error)
+{
+	set.labels.clear();
+	std::ifstream in(file);
+	if(!in)
+	{
+		error = "can not open " + file;
+		return false;
+	}
+
+	std::string line;
+	int n = 0;
+	while(std::getline(in, line))
+	{
+		n++;
+		std::istringstream ss(line);
+		std::string first;
+		if(!(ss >> first) || first[0] == '#')
+			continue;
+
+		int id, r, g, b;
+		std::string name;
+		std::istringstream fields(line);
+		if(!(fields >> id >> r >> g >> b) || id < 0 || id > 255 || std::min({r, g, b}) < 0 || std::max({r, g, b}) > 255)
+		{
+			error = "line " + std::to_string(n) + ": expected <id 0-255> <r> <g> <b> <name>";
+			return false;
+		}
+		std::getline(fields >> std::ws, name);
+		if(static_cast<int>(set.labels.size()) <= id)
+		{
+			size_t old = set.labels.size();
+			set.labels.resize(id + 1);
+			for(size_t i=old; i<set.labels.size(); i++)
+				set.labels[i] = {"label " + std::to_string(i), cv::Scalar(), false};
+		}
+		if(set.labels[id].used)
+		{
+			error = "line " + std::to_string(n) + ": label " + std::to_string(id) + " is defined twice";
+			return false;
+		}
+		set.labels[id] = {name.empty() ? "label " + std::to_string(id) : name, cv::Scalar(b, g, r), true};
+	}
+
+	if(set.labels.size() < 2)
+	{
+		error = file + " has no label";
+		return false;
+	}
+	// The background always exists, even if it is not drawn
+	if(!set.labels[0].used)
+		set.labels[0] = {"background", cv::Scalar(), true};
+	return true;
+}
+
+std::string labelName(const labelSet& set, int id)
+{
+	if(id >= 0 && id < static_cast<int>(set.labels.size()) && set.labels[id].used)
+		return set.labels[id].name;
+	return "label " + std::to_string(id);
+}
+
+void paletteFromLabels(const labelSet& set, int alpha, bool background, labelPalette& palette)
+{
+	clearPalette(palette);
+	for(size_t i=0; i<set.labels.size(); i++)
+		if(set.labels[i].used && (i > 0 || background))
+			setPaletteLabel(palette, static_cast<int>(i), set.labels[i].color, alpha);
+}
+
+labelStats::labelStats()
+{
+	std::fill(counts, counts + 256, 0LL);
+}
+
+void labelStats::reset(const cv::Mat& mask)
+{
+	CV_Assert(mask.type() == CV_8UC1);
+	_size = mask.size();
+	std::fill(counts, counts + 256, 0LL);
+	for(int l=0; l<256; l++)
+	{
+		rows[l].clear();
+		cols[l].clear();
+	}
+
+	// The mask is walked in runs of the same label: each run adds its length to its row,
+	// and +1/-1 at its ends to the column differences, which get summed at the end
+	std::vector<int> col_diff[256];
+	for(int y=0; y<mask.rows; y++)
+	{
+		const uchar* row = mask.ptr<uchar>(y);
+		int x0 = 0;
+		while(x0 < mask.cols)
+		{
+			uchar l = row[x0];
+			int x1 = x0 + 1;
+			while(x1 < mask.cols && row[x1] == l)
+				x1++;
+			if(rows[l].empty())
+			{
+				rows[l].assign(mask.rows, 0);
+				col_diff[l].assign(mask.cols + 1, 0);
+			}
+			counts[l] += x1 - x0;
+			rows[l][y] += x1 - x0;
+			col_diff[l][x0]++;
+			col_diff[l][x1]--;
+			x0 = x1;
+		}
+	}
+
+	for(int l=0; l<256; l++)
+	{
+		if(col_diff[l].empty())
+			continue;
+		cols[l].resize(mask.cols);
+		int sum = 0;
+		for(int x=0; x<mask.cols; x++)
+			cols[l][x] = sum += col_diff[l][x];
+	}
+}
+
+void labelStats::resetEmpty(const cv::Size& size)
+{
+	_size = size;
+	std::fill(counts, counts + 256, 0LL);
+	for(int l=0; l<256; l++)
+	{
+		rows[l].clear();
+		cols[l].clear();
+	}
+	counts[0] = static_cast<long long>(size.width)*size.height;
+	rows[0].assign(size.height, size.width);
+	cols[0].assign(size.width, size.height);
+}
+
+void labelStats::add(int label, int x, int y, int n)
+{
+	if(rows[label].empty())
+	{
+		rows[label].assign(_size.height, 0);
+		cols[label].assign(_size.width, 0);
+	}
+	counts[label] += n;
+	rows[label][y] += n;
+	cols[label][x] += n;
+}
+
+void labelStats::update(const cv::Rect& rect, const uchar* before, const uchar* after)
+{
+	for(int y=0; y<rect.height; y++)
+	{
+		const uchar* b = before + static_cast<size_t>(y)*rect.width;
+		const uchar* a = after + static_cast<size_t>(y)*rect.width;
+		// Most rows of a changed tile are only partly changed (or not at all)
+		if(std::memcmp(a, b, rect.width) == 0)
+			continue;
+		for(int x=0; x<rect.width; x++)
+		{
+			if(a[x] == b[x])
+				continue;
+			add(b[x], rect.x + x, rect.y + y, -1);
+			add(a[x], rect.x + x, rect.y + y, 1);
+		}
+	}
+}
+
+long long labelStats::pixels(int label) const
+{
+	return label >= 0 && label < 256 ? counts[label] : 0;
+}
+
+cv::Rect labelStats::bounds(int label) const
+{
+	if(pixels(label) <= 0)
+		return cv::Rect();
+	const std::vector<int>& r = rows[label];
+	const std::vector<int>& c = cols[label];
+	int y0 = 0, y1 = static_cast<int>(r.size()) - 1, x0 = 0, x1 = static_cast<int>(c.size()) - 1;
+	while(y0 < y1 && r[y0] == 0)
+		y0++;
+	while(y1 > y0 && r[y1] == 0)
+		y1--;
+	while(x0 < x1 && c[x0] == 0)
+		x0++;
+	while(x1 > x0 && c[x1] == 0)
+		x1--;
+	return cv::Rect(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
+namespace
+{
+	// Escapes the quotes and backslashes of a name
+	std::string jsonString(const std::string& s)
+	{
+		std::string out = "\"";
+		for(char c: s)
+		{
+			if(c == '"' || c == '\\')
+				out += '\\';
+			out += c;
+		}
+		return out + "\"";
+	}
+}
+
+std::string labelStatsJson(const labelStats& stats, const labelSet& set)
+{
+	std::ostringstream out;
+	out << "{\"labels\":[";
+	bool first = true;
+	for(int l=0; l<256; l++)
+	{
+		long long n = stats.pixels(l);
+		if(n <= 0)
+			continue;
+		cv::Rect box = stats.bounds(l);
+		out << (first ? "\n" : ",\n") << "{\"id\":" << l << ",\"name\":" << jsonString(labelName(set, l))
+			<< ",\"pixels\":" << n << ",\"bbox\":[" << box.x << "," << box.y << "," << box.width << "," << box.height << "]}";
+		first = false;
+	}
+	out << "\n]}\n";
+	return out.str();
+}
+
+std::string labelStatsPath(const std::string& mask_file)
+{
+	return mask_file + ".stats.json";
+}
@@ -0,0 +1,76 @@
+#ifndef LABELS_H
+#define LABELS_H
+
+#include <string>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+#include "overlay.h"
+
+// Struct that holds the name and the color (BGR) of one label
+struct labelInfo
+{
+	std::string name;
+	cv::Scalar color;
+	bool used; // Whether the label set defines it (the ids it skips are not drawn)
+};
+
+// Struct that holds the labels the mask can have: labels[id], with id from 0 (background)
+// to 255 at most
+struct labelSet
+{
+	std::vector<labelInfo> labels;
+};
+
+// The labels of the app when no label set is given: background (blue), 1 (green) and 2 (red)
+labelSet defaultLabelSet();
+// Reads a label set. Each line holds one label, and empty lines and lines starting with #
+// are ignored:
+//     <id 0-255> <r> <g> <b> <name>
+// Returns false (and the reason in error) if it is not valid
+bool loadLabelSet(const std::string& file, labelSet& set, std::string& error);
+// Name of a label ("label <id>" if the set does not define it)
+std::string labelName(const labelSet& set, int id);
+// Fills the palette with the colors of the set and alpha (the background is only drawn if
+// background is true, and the ids the set does not define are not drawn)
+void paletteFromLabels(const labelSet& set, int alpha, bool background, labelPalette& palette);
+
+// Class that holds the pixel count and the bounding box of every label of a mask. It keeps
+// the pixels of each label in each row and column, so the edits update it from the pixels
+// they change (the tiles of the history) instead of scanning the whole mask, and the
+// bounding boxes can shrink when a label gets erased. The counts of a label are only
+// allocated when it appears in the mask
+class labelStats
+{
+public:
+	labelStats();
+
+	// Counts every pixel of mask (CV_8UC1)
+	void reset(const cv::Mat& mask);
+	// The same, for a mask of size that is all background
+	void resetEmpty(const cv::Size& size);
+	// Updates the counts with a region of the mask that has changed from before to after
+	// (contiguous buffers of rect.width pixels per row)
+	void update(const cv::Rect& rect, const uchar* before, const uchar* after);
+
+	// Pixels of label
+	long long pixels(int label) const;
+	// Bounding box of label (empty if it has no pixels)
+	cv::Rect bounds(int label) const;
+
+private:
+	void add(int label, int x, int y, int n);
+
+	cv::Size _size;
+	long long counts[256];
+	std::vector<int> rows[256]; // rows[l][y]: pixels of l in the row y
+	std::vector<int> cols[256]; // cols[l][x]: pixels of l in the column x
+};
+
+// Pixels and bounding box of every label the mask has, with its name, as json
+std::string labelStatsJson(const labelStats& stats, const labelSet& set);
+// File where the stats of the mask file are written (next to it)
+std::string labelStatsPath(const std::string& mask_file);
+
+#endif
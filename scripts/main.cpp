@@ -2,27 +2,104 @@
 #include <thread>
 #include <mutex>
 #include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
 
 #include "opencv2/core/core.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
-
-#include "utils.h"
-
-// Size to which the image will be resized so as to be displayed. This size
-// should be multiple of the real image dimmentions, so as to reconstruct the
-// mask from the resized image with more precision
-#define DISPLAY_SIZE_H 800
-#define DISPLAY_SIZE_W 800
+#include "opencv2/imgcodecs/imgcodecs.hpp"
+
+#include "editor.h"
+#include "batch.h"
+#include "labelmask.h"
+#include "trace.h"
+#include "replay.h"
+#include "server.h"
+#include "dataset.h"
+
+// Maximum time (ms) the display_thread waits for a new frame before processing
+// the window events again
+#define DISPLAY_WAIT_MS 10
 // Name of the window
 #define W_NAME "Mask Creator"
 // Macro to change whether we want the 0 (background) label to be seen
 // when view mask button gets pressed
 #define PRINT_BACKGROUND_LABEL false
+// Opacity (0 to 255) with which the labels and the threshold are drawn over the image
+#define OVERLAY_ALPHA 255
 // To add a new button just add its label to buttonsNames below and set the macro
 // N_OF_BUTTONS below to the new quantity of buttons. To add it's functionablily, 
 // just add the function to the switch statement in onMouseClickled function
-#define N_OF_BUTTONS 9
+#define N_OF_BUTTONS 10
+// Number of images that get decoded ahead of the current one, and number of
+// threads that decode them
+#define PREFETCH_DEPTH 3
+#define PREFETCH_WORKERS 2
+// Maximum memory used by the undo/redo history (the oldest edits get forgotten
+// when it is exceeded), side of the tiles in which it splits the mask and whether
+// it compresses them
+#define HISTORY_BUDGET_BYTES (256*1024*1024)
+#define HISTORY_TILE_SIZE 64
+#define HISTORY_COMPRESS true
+// Images with at least these pixels are cached (decoded, with their channels and
+// pyramids) in the CACHE_DIR folder of the path and mapped from there, so as to
+// only the displayed part of them stays in memory
+#define MAPPED_IMAGE_PIXELS (64LL*1024*1024)
+#define CACHE_DIR ".cache/"
+// Zoom factor applied by each step of the mouse wheel
+#define ZOOM_STEP 1.25
+// Number of threads that scan the folders of the path (0 means one per core) and
+// file (inside CACHE_DIR) where the listing of each folder is remembered, so as to
+// the folders that have not changed are not listed again
+#define SCAN_THREADS 0
+#define SCAN_MANIFEST "manifest"
+// Format of the saved masks: LABEL_MASK_EXTENSION (run-length encoded labels, see
+// labelmask.h) or an image extension (such as ".tif", with the original mask_ names).
+// The masks saved as images before (mask_<image>) are still read while there is no
+// mask with this extension, and --convert turns them into one
+#define MASK_EXTENSION LABEL_MASK_EXTENSION
+// Compression with which image masks are written (TIFF: 1 none, 5 LZW, 8 deflate) and
+// number of saved masks that can be waiting to be written before SAVE MASK blocks
+#define MASK_COMPRESSION 5
+#define MASK_WRITE_QUEUE 4
+// Side (in pixels of the level it is built from) of the regions in which each image gets
+// over-segmented for click-to-label, maximum pixels of that level (bigger images use a
+// reduced one, so their regions have blocky borders) and number of indexes kept in memory
+// (they are cached in CACHE_DIR too)
+#define REGION_SIZE 24
+#define REGION_MAX_PIXELS (4LL*1024*1024)
+#define REGION_KEEP 4
+// Number of images the server keeps decoded after every session has left them (the
+// ones some session has open are always kept, and shared)
+#define SERVER_KEEP_IMAGES 8
+// File of the path with the names and colors of the labels (see loadLabelSet). Without it
+// (nor --labels) there are the background and the labels 1 (green) and 2 (red)
+#define LABELS_FILE "labels.txt"
+// The edits of the current image are journaled next to its mask (with this extension)
+// until it gets saved, so as to they are recovered after a crash or when the image is
+// opened again. The journal gets synced at most every JOURNAL_SYNC_MS
+#define JOURNAL_EXTENSION ".journal"
+#define JOURNAL_SYNC_MS 250
+// Memory that the images that have been visited (decoded, with their planes and pyramids)
+// and the masks they were left with can use, so as to going back to them is instant (the
+// least recently visited ones are forgotten first)
+#define NAVIGATION_CACHE_BYTES (1024LL*1024*1024)
+// File of the path with the cleanup of each label (see loadCleanups), which C applies to
+// the current label. The labels it does not have get an opening and a closing of
+// CLEANUP_RADIUS, their holes filled and their components under CLEANUP_MIN_AREA removed
+#define CLEANUP_FILE "cleanup.txt"
+#define CLEANUP_RADIUS 1
+#define CLEANUP_FILL_HOLES true
+#define CLEANUP_MIN_AREA 64
+// Side of the tiles of an exported dataset (--export), format of its image tiles, size at
+// which a new shard file is started and bytes of encoded tiles that can wait to be written
+#define EXPORT_TILE 512
+#define EXPORT_IMAGE_EXTENSION ".png"
+#define EXPORT_SHARD_BYTES (1LL*1024*1024*1024)
+#define EXPORT_PENDING_BYTES (256LL*1024*1024)
 
 const utils::stringvec buttonsNames = {
 	"VIEW MASK",
@@ -31,72 +108,59 @@ const utils::stringvec buttonsNames = {
 	"DELETE",
 	"ADD",
 	"GO BACK",
+	"REDO",
 	"NEXT IMAGE",
 	"SAVE MASK",
 	"EXIT"};
 
-// Struct that holds all the features we need to
-// create a button
-struct rectanglesButtons
-{
-	cv::Rect _rect;
-	std::string _name;
-	cv::Scalar _color;
-};
-
-// Struct that holds data that we might want to use in mouse and 
-// slider callbacks
-struct data
-{
-	cv::Mat read_image;	// The image that has been read from the specified directory
-	cv::Mat imagePlusControls; // a image containing the resized read image + buttons
-	cv::Mat mask; // Te current created mask
-	cv::Mat previous_mask; // Memory of the previous mask so as to going back
-	cv::Mat threshold_mask; // A cv::Mat that holds the threshold
-	utils::stringvec Images; // vector of strings that contain the image files in the directory
-	std::vector<cv::Mat> channels; // vector of cv::Mat that contains the different channels
-	int mask_id; // The id of the mask with which we're working (0 (background) to n_of_masks-1)
-	int actual_channel; // The idx of the channel which is being displayed (0 means color image)
-	int th_value; // Current value of the threshold (trackbar)
-	int n_of_images; // Number of images found at the directory
-	int current_image; // idx of the current image
-	int radiusClick; // Radius of the circle displayed when doubleclicked the image
-	rectanglesButtons* buttons; // Array of rectanglesButtons
-	bool mask_view_on; // boolean that holds whether we want to see the mask or not
-	bool add_on; // true when add is ON, false when delete is ON
-	bool th_on;   // boolean that enables the threshold mode (so as to not trying to do a threshold to a 3-channel image)
-	bool th_inv; // boolean that holds whether the threshold mode is inverted or not
-	cv::Point2d rect_p1; // Coordinates of the point 1 (when displaying the rectangle)
-	cv::Point2d rect_p2; // Coordinates of the point 2 (when displaying the rectangle)
-	std::chrono::time_point<std::chrono::system_clock> m_StartTime; // Start time of the rectangle display is clicked
-	std::chrono::time_point<std::chrono::system_clock> m_EndTime;  // End time when rectangle is finished
-
-};
-
-// Global cv::Mat to which the image we want to display will be copied
-// so as to the display_thread reads it
-cv::Mat globalImageToDisplayThread;
-// Mutex variable for reading the matrix above in both threads
-std::mutex globalImageToDisplayThread_mutex;
-// Boolean used to kill the display_thread and as a result, to exit
-bool killThread = false;
+// Names of the trackbars (the recorded sessions refer to them by name)
+const std::string maskTrackbar = "Mask label";
+const std::string channelTrackbar = "Channel";
+const std::string thresholdTrackbar = "Threshold";
+const std::string thresholdMaxTrackbar = "Threshold max";
+const std::string radiusTrackbar = "Radius of clicked point";
+const std::string imageTrackbar = "Image";
+
+// Global presenter to which the image we want to display will be submitted so as to
+// the display_thread shows it. Shutting it down kills the display_thread and as a
+// result, exits
+framePresenter presenter;
 // Path that contains the images we want to label
 const std::string path = "/home/inaki/Desktop/cv/cropedSticks/";
 // Extension of the images
 const std::string _extension = ".tif";
 // Declaration of the extern extension variable (utils.h)
 std::string extension;
-
-// Function that reads all the images with the specified extension in the specifies path
-void readImage(const std::string& _path, data& globalData);
-// Functions that copies the corresponding image (masks, thresholds and so on to the global image)
-void display_img(data& globalData, bool displayMask);
-// Inf. loop that prints the global image continously that is called in the display_thread
-void displayImage();
+// Labels the masks are made of (given by --labels or LABELS_FILE)
+labelSet labels = defaultLabelSet();
+// Cleanup of each label (given by --cleanup or CLEANUP_FILE)
+std::vector<labelCleanup> cleanups;
+// Whether the window (and its trackbars) has been created (replays have none)
+bool windowCreated = false;
+
+// Function that applies a recipe to every image without opening any window
+int runBatchMode(const std::string& recipe, int n_threads, bool overwrite);
+// Function that exports every labelled image (with its mask) as tiles to shards in out_dir
+int runExportMode(const std::string& out_dir, const exportOptions& options);
+// Function that replays a recorded session without opening any window (as fast as possible
+// or with the recorded timing) and checks that the masks are the same. Returns the number
+// of masks that are not
+int runReplayMode(const std::string& session, bool realtime);
+// Function that serves labelling sessions over a local socket (see server.h) until one of
+// them sends shutdown
+int runServeMode(const std::string& socket_path);
+// Loop that shows every new frame of the presenter that is called in the display_thread
+void displayImage(data& globalData);
+// Function that writes the trace (if it has been enabled) and prints its summary
+void finishTrace(const std::string& trace_file);
+// Function that setups the state of the sliders and the displayed image
+void setupState(data& globalData);
 // Function that setups all trackbars and mouse events
 void setup(data& globalData);
 // Funtion that setups the buttons
 void setupButtons(data& globalData);
+// Function that setups the colors of the labels and of the threshold
+void setupPalettes(data& globalData);
 // Function that displays a button on the screen
 void displayButton(rectanglesButtons rectangle, cv::Mat& imagePlusControls);
 
@@ -107,184 +171,776 @@ void onButtonThresholdInvClicked(data& globalData);
 void onButtonDeleteClicked(data& globalData);
 void onButtonAddClicked(data& globalData);
 void onButtonGoBackClicked(data& globalData);
+void onButtonRedoClicked(data& globalData);
 void onButtonSaveMaskClicked(data& globalData);
 
+// Navigation (they return false if no image has been opened). The image that is left keeps
+// its mask (with the edits that have not been saved) in the navigation cache, and the
+// images that have been visited are opened from there without decoding them again
+// Function that opens the image idx
+bool goToImage(data& globalData, int idx);
+// NEXT IMAGE (and N) opens the next image that can be decoded, and P the previous one
+bool onButtonNextImageClicked(data& globalData);
+bool previousImage(data& globalData);
+// U opens the first image (but the current one) that has no saved mask nor unsaved edits
+bool firstUnlabeledImage(data& globalData);
+// Function that moves the Image slider to the current image (and its maximum to the last one found)
+void showImagePosition(data& globalData);
+
 // Slider events
 void nMaskChanged(int pos, void* param);
 void channelChanged(int pos, void* param);
 void thresholdValueChanged(int pos, void* param);
+void thresholdMaxChanged(int pos, void* param);
 void radiousValueChanged(int pos, void* param);
+bool imageJumped(int pos, void* param);
+
+// Key events
+// R switches between the single threshold and the range one. In range mode the Threshold
+// and Threshold max sliders set the bounds [Threshold, Threshold max] of the displayed
+// channel, the bounds of the other channels are kept, and the preview (and APPLY THRESHOLD)
+// is the pixels that are inside the bounds of every channel (H in [a,b] and S > c...)
+void rangeModeToggled(data& globalData);
+// C cleans up the current label (with its cleanup, or the default one) as one edit
+void cleanupRequested(data& globalData);
+// Function that puts the current label (with its stats), the displayed channel and the bounds
+// of the range mode in the window title
+void showTitle(data& globalData);
 
 // Mouse event
 void onMouseClickled(int event, int x, int y, int flags, void* userdata);
 
-int main()
+// HighGUI callbacks: they log the event (if the session is being recorded) and handle it
+void onMouseEvent(int event, int x, int y, int flags, void* userdata);
+void onMaskTrackbar(int pos, void* param);
+void onChannelTrackbar(int pos, void* param);
+void onThresholdTrackbar(int pos, void* param);
+void onThresholdMaxTrackbar(int pos, void* param);
+void onRadiusTrackbar(int pos, void* param);
+void onImageTrackbar(int pos, void* param);
+// Function that handles a recorded event (the same way the HighGUI callbacks do)
+void handleEvent(data& globalData, const sessionEvent& e);
+// Function that logs the digest of the current mask (tag is "open" or "close")
+void noteMask(data& globalData, const char* tag);
+// Function that journals the edits of the current image to its journal. If recover is true,
+// the edits it holds (the ones that had not been saved) are repeated on the mask first
+void openJournal(data& globalData, bool recover);
+
+int main(int argc, char** argv)
 {
+	// In batch mode (--batch recipe [--threads n] [--overwrite]) no window is opened: the
+	// recipe is applied to every image and the masks get saved (the images that already
+	// have a saved mask are skipped, unless --overwrite is given). --convert in out converts a
+	// mask between formats (.lbl, .json COCO RLE or an image such as .png), for instance a
+	// masks/mask_<image> saved as an image to the masks/mask_<name>.lbl that is read first
+	// (the old one is only read while there is none). --trace file records
+	// the latency of every interaction to a Chrome trace (and prints a summary on exit).
+	// --record file logs every event of the session (and the masks the images are opened
+	// with to file.masks), and --replay file [--realtime] replays it without window and
+	// checks that the masks are the same. --serve socket hosts many
+	// labelling sessions (one per connection to the socket) that share the decoded images.
+	// --labels file reads the label set from file instead of LABELS_FILE, and --cleanup file
+	// the cleanups from file instead of CLEANUP_FILE. --export dir [--tile n] [--stride n]
+	// [--keep-empty] [--threads n] writes the labelled images as a dataset of tiles to dir
+	std::string recipe;
+	std::string export_dir;
+	exportOptions export_options;
+	export_options.tile = EXPORT_TILE;
+	std::string labels_file;
+	std::string cleanup_file;
+	std::string trace_file;
+	std::string record_file;
+	std::string replay_file;
+	std::string socket_path;
+	bool realtime = false;
+	bool overwrite = false;
+	int batch_threads = 0;
+	for(int i=1; i<argc; i++)
+	{
+		std::string arg = argv[i];
+		if(arg == "--batch" && i + 1 < argc)
+			recipe = argv[++i];
+		else if(arg == "--threads" && i + 1 < argc)
+			batch_threads = std::atoi(argv[++i]);
+		else if(arg == "--overwrite")
+			overwrite = true;
+		else if(arg == "--trace" && i + 1 < argc)
+			trace_file = argv[++i];
+		else if(arg == "--record" && i + 1 < argc)
+			record_file = argv[++i];
+		else if(arg == "--replay" && i + 1 < argc)
+			replay_file = argv[++i];
+		else if(arg == "--realtime")
+			realtime = true;
+		else if(arg == "--serve" && i + 1 < argc)
+			socket_path = argv[++i];
+		else if(arg == "--labels" && i + 1 < argc)
+			labels_file = argv[++i];
+		else if(arg == "--cleanup" && i + 1 < argc)
+			cleanup_file = argv[++i];
+		else if(arg == "--export" && i + 1 < argc)
+			export_dir = argv[++i];
+		else if(arg == "--tile" && i + 1 < argc)
+			export_options.tile = std::atoi(argv[++i]);
+		else if(arg == "--stride" && i + 1 < argc)
+			export_options.stride = std::atoi(argv[++i]);
+		else if(arg == "--keep-empty")
+			export_options.keep_empty = true;
+		else if(arg == "--convert" && i + 2 < argc)
+		{
+			if(convertMask(argv[i + 1], argv[i + 2]))
+				return 0;
+			std::cerr << "Could not convert " << argv[i + 1] << " to " << argv[i + 2] << std::endl;
+			return 1;
+		}
+	}
+	std::error_code ec;
+	if(labels_file.empty() && std::filesystem::exists(path + LABELS_FILE, ec))
+		labels_file = path + LABELS_FILE;
+	if(!labels_file.empty())
+	{
+		std::string error;
+		if(!loadLabelSet(labels_file, labels, error))
+		{
+			std::cerr << "Wrong label set: " << error << std::endl;
+			return 1;
+		}
+	}
+	if(cleanup_file.empty() && std::filesystem::exists(path + CLEANUP_FILE, ec))
+		cleanup_file = path + CLEANUP_FILE;
+	if(!cleanup_file.empty())
+	{
+		std::string error;
+		if(!loadCleanups(cleanup_file, cleanups, error))
+		{
+			std::cerr << "Wrong cleanup: " << error << std::endl;
+			return 1;
+		}
+	}
+	if(!trace_file.empty())
+		traceEnable();
+	if(!recipe.empty())
+		return runBatchMode(recipe, batch_threads, overwrite);
+	if(!export_dir.empty())
+	{
+		export_options.n_threads = batch_threads;
+		return runExportMode(export_dir, export_options);
+	}
+	if(!replay_file.empty())
+	{
+		int mismatches = runReplayMode(replay_file, realtime);
+		finishTrace(trace_file);
+		return mismatches != 0 ? 4 : 0;
+	}
+	if(!socket_path.empty())
+	{
+		int code = runServeMode(socket_path);
+		finishTrace(trace_file);
+		return code;
+	}
+
 	// I create a instance of data struct that will hold all the information
 	data globalData;
 
-	// I call both setups
+	// I call the setups
 	setup(globalData);
 	setupButtons(globalData);
+	setupPalettes(globalData);
 
-	// I read images from the specified path with the specified extension
+	// I scan the specified path for images with the specified extension in background, so
+	// as to start labelling as soon as the first one is found
 	extension = _extension;
-	utils::read_directory(path, globalData.Images);
+	std::thread scanner([&globalData]
+	{
+		utils::scan_directory(path, path + CACHE_DIR + SCAN_MANIFEST, SCAN_THREADS,
+							  [&globalData](const std::string& image){ globalData.Images.push_back(image); });
+		globalData.Images.set_complete();
+	});
 
 	// I the program has not found any image quits
-	if(globalData.Images.empty())
+	if(globalData.Images.wait_for_more(0) == 0)
+	{
+		scanner.join();
 		return 2;
+	}
 
-	// I initialize some variables explained above
-	globalData.n_of_images = globalData.Images.size();
-	globalData.current_image = 0;
+	// No image is open yet
+	globalData.current_image = -1;
+
+	// I open the first image and I display it, while the next ones get decoded in background
+	globalData.history = new maskHistory(HISTORY_BUDGET_BYTES, HISTORY_TILE_SIZE, HISTORY_COMPRESS);
+	globalData.decode_options.warm_size = cv::Size(DISPLAY_SIZE_W, DISPLAY_SIZE_H);
+	globalData.decode_options.cache_dir = path + CACHE_DIR;
+	globalData.decode_options.map_min_pixels = MAPPED_IMAGE_PIXELS;
+	globalData.writer = new maskWriter({cv::IMWRITE_TIFF_COMPRESSION, MASK_COMPRESSION}, MASK_WRITE_QUEUE);
+	globalData.prefetcher = new imagePrefetcher(path, globalData.Images, PREFETCH_DEPTH, PREFETCH_WORKERS,
+												globalData.decode_options);
+	globalData.prefetcher->prefetchFrom(0);
+	globalData.navigation = new navigationCache(NAVIGATION_CACHE_BYTES);
+	globalData.presenter = &presenter;
+	globalData.regions = new regionIndexer(REGION_SIZE, REGION_MAX_PIXELS, path + CACHE_DIR, REGION_KEEP);
+	globalData.journal = new editJournal(JOURNAL_SYNC_MS);
+	if(!record_file.empty())
+	{
+		globalData.recorder = new sessionRecorder(record_file, path);
+		if(!globalData.recorder->ok())
+			std::cerr << "Could not record the session to " << record_file << std::endl;
+	}
+	// If no image can be decoded there is nothing to label
+	if(onButtonNextImageClicked(globalData))
+	{
+		showTitle(globalData);
 
-	// I read the first image and I display it
-	readImage(path + globalData.Images.at(globalData.current_image), globalData);
-	display_img(globalData, false);
+		// I create and start the display_thread
+		std::thread display_thread(displayImage, std::ref(globalData));
+		display_thread.join();
+		noteMask(globalData, "close");
 
-	// I create and start the display_thread
-	std::thread display_thread(displayImage);
-	display_thread.join();
+		navigationCache::navigationStats nav = globalData.navigation->stats();
+		std::cout << nav.image_hits << " of " << nav.image_hits + nav.image_misses << " images and " << nav.mask_hits
+				  << " of " << nav.mask_hits + nav.mask_misses << " masks opened from the navigation cache" << std::endl;
+	}
+	scanner.join();
+
+	// EXIT (or ESC) has been pressed, so I wait for the masks that are still being written
+	// (and for the journal, which they compact)
+	globalData.writer->flush();
+	delete globalData.writer;
+	delete globalData.journal;
+	delete globalData.prefetcher;
+	delete globalData.navigation;
+	delete globalData.regions;
+	delete globalData.history;
+	delete globalData.recorder;
+
+	finishTrace(trace_file);
 	
-	return 0;
+	return globalData.current_image < 0 ? 2 : 0;
 }
 
-void readImage(const std::string& _path, data& globalData)
+int runBatchMode(const std::string& recipe, int n_threads, bool overwrite)
 {
-	cv::Mat image = cv::imread(_path);
-	// If I have read an image
-	if(image.cols > 0)
+	std::vector<recipeOp> ops;
+	std::string error;
+	if(!loadRecipe(recipe, ops, error))
 	{
-		cv::Mat mask = cv::Mat::zeros(image.rows, image.cols, CV_8UC1); // Mask initialization to 0
-		// I get the RGB channels
-		std::vector<cv::Mat> rgbChannels, cmykChannels;
-		cv::Mat aux;
-		cv::cvtColor(image, aux, cv::COLOR_BGR2RGB);
-		cv::split(aux, rgbChannels);
+		std::cerr << "Wrong recipe: " << error << std::endl;
+		return 1;
+	}
 
-		// I store the info in my globalData struct
-		globalData.read_image = image;
-		globalData.mask = mask;
-		globalData.channels = rgbChannels;
+	// I read images from the specified path with the specified extension
+	extension = _extension;
+	utils::stringvec images;
+	utils::read_directory(path, images);
+	if(images.empty())
+		return 2;
+
+	batchStats stats = runBatch(path, images, ops, MASK_EXTENSION, {cv::IMWRITE_TIFF_COMPRESSION, MASK_COMPRESSION}, labels,
+								n_threads, overwrite, JOURNAL_EXTENSION);
+	std::cout << stats.processed << " masks written, " << stats.skipped << " skipped (already saved), "
+			  << stats.failed << " failed in "
+			  << stats.seconds << " s (" << (stats.seconds > 0 ? stats.processed/stats.seconds : 0)
+			  << " images/s)" << std::endl;
+	return stats.failed > 0 ? 3 : 0;
+}
+
+int runExportMode(const std::string& out_dir, const exportOptions& options)
+{
+	if(options.tile <= 0 || options.stride < 0)
+	{
+		std::cerr << "Wrong tile or stride" << std::endl;
+		return 1;
 	}
-	// CMYK
+	extension = _extension;
+	utils::stringvec images;
+	utils::read_directory(path, images);
+	if(images.empty())
+		return 2;
+
+	exportOptions o = options;
+	o.image_ext = EXPORT_IMAGE_EXTENSION;
+	o.mask_ext = MASK_EXTENSION;
+	o.shard_bytes = EXPORT_SHARD_BYTES;
+	o.max_pending = EXPORT_PENDING_BYTES;
+	exportStats stats = exportDataset(path, images, out_dir, o);
+	std::cout << stats.tiles << " tiles of " << stats.images << " images (" << stats.skipped << " without mask, "
+			  << stats.empty << " empty tiles left out) written to " << stats.shards << " shards in " << stats.seconds
+			  << " s (" << (stats.seconds > 0 ? stats.bytes/stats.seconds/(1024*1024) : 0) << " MB/s)" << std::endl;
+	return stats.ok ? 0 : 3;
 }
 
-void displayImage()
+int runReplayMode(const std::string& session, bool realtime)
 {
-	// While the thread is running
-	while(!killThread)
-	{
-		globalImageToDisplayThread_mutex.lock();
-		// If the image is not empty
-		if(globalImageToDisplayThread.rows == DISPLAY_SIZE_H)
-			// I plot it
-			cv::imshow(W_NAME, globalImageToDisplayThread);
-		globalImageToDisplayThread_mutex.unlock();
-		// Refresh rate of 100ms
-		char c = cv::waitKey(100);
-		// I also can quit the program by pressing the ESC key
-		if((int)c == 27)
+	std::vector<sessionEvent> events;
+	std::string session_path, error;
+	if(!loadSession(session, events, session_path, error))
+	{
+		std::cerr << "Wrong session: " << error << std::endl;
+		return 1;
+	}
+	if(session_path != path)
+		std::cerr << "The session was recorded at " << session_path << ", replaying it at " << path << std::endl;
+
+	// The images are the ones the session opened, in the same order (so as to NEXT IMAGE
+	// opens the same one even if the folder has changed). Every navigation of the session
+	// (previous, jumps...) opened one of them, so when replayed they open the next one, with
+	// the mask it was opened with (the saved masks and journals are not read, as the session
+	// itself has changed them)
+	data globalData;
+	for(const auto& e: events)
+		if(e.type == sessionEvent::MASK && e.name == "open")
+			globalData.Images.push_back(e.image);
+	globalData.Images.set_complete();
+	if(globalData.Images.empty())
+	{
+		std::cerr << "The session has not opened any image" << std::endl;
+		return 1;
+	}
+
+	// The same state the app has, but without window. The masks are not saved
+	extension = _extension;
+	setupState(globalData);
+	setupButtons(globalData);
+	setupPalettes(globalData);
+	globalData.current_image = -1;
+	globalData.history = new maskHistory(HISTORY_BUDGET_BYTES, HISTORY_TILE_SIZE, HISTORY_COMPRESS);
+	globalData.decode_options.warm_size = cv::Size(DISPLAY_SIZE_W, DISPLAY_SIZE_H);
+	globalData.decode_options.cache_dir = path + CACHE_DIR;
+	globalData.decode_options.map_min_pixels = MAPPED_IMAGE_PIXELS;
+	globalData.prefetcher = new imagePrefetcher(path, globalData.Images, PREFETCH_DEPTH, PREFETCH_WORKERS,
+												globalData.decode_options);
+	globalData.prefetcher->prefetchFrom(0);
+	globalData.navigation = new navigationCache(NAVIGATION_CACHE_BYTES);
+	globalData.presenter = &presenter;
+	globalData.regions = new regionIndexer(REGION_SIZE, REGION_MAX_PIXELS, path + CACHE_DIR, REGION_KEEP);
+	globalData.recorder = new sessionRecorder("", path);
+	globalData.replay_session = session;
+
+	auto start = std::chrono::steady_clock::now();
+	auto epoch = std::chrono::system_clock::now();
+	onButtonNextImageClicked(globalData);
+
+	unsigned long version = 0;
+	size_t replayed = 0;
+	for(const auto& e: events)
+	{
+		if(e.type == sessionEvent::MASK)
+			continue;
+		if(realtime)
+			std::this_thread::sleep_until(start + std::chrono::milliseconds(e.t_ms));
+
+		// The handlers see the recorded time (the rectangles depend on it)
+		globalData.event_time = epoch + std::chrono::milliseconds(e.t_ms);
+		handleEvent(globalData, e);
+		replayed++;
+
+		// There is no display_thread, so I take the frame as if it had been shown
+		cv::Mat frame;
+		if(presenter.acquire(version, 0, frame))
+		{
+			traceFrameShown(presenter.interaction());
+			presenter.release();
+		}
+		if(presenter.stopped())
 			break;
 	}
+	if(globalData.current_image >= 0)
+		noteMask(globalData, "close");
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	int mismatches = compareMasks(events, globalData.recorder->events());
+	std::cout << replayed << " events replayed in " << seconds << " s (" << (seconds > 0 ? replayed/seconds : 0)
+			  << " events/s), " << mismatches << " masks differ" << std::endl;
+
+	delete globalData.prefetcher;
+	delete globalData.navigation;
+	delete globalData.regions;
+	delete globalData.history;
+	delete globalData.recorder;
+	delete[] globalData.buttons;
+	return mismatches;
 }
 
-void display_img(data& globalData, bool displayMask)
+int runServeMode(const std::string& socket_path)
 {
-	cv::Mat display_image;
-	cv::Mat img;
+	// The images are scanned once for every session, in background
+	extension = _extension;
+	utils::imageList images;
+	std::thread scanner([&images]
+	{
+		utils::scan_directory(path, path + CACHE_DIR + SCAN_MANIFEST, SCAN_THREADS,
+							  [&images](const std::string& image){ images.push_back(image); });
+		images.set_complete();
+	});
+
+	// The sessions are set up as the app (the palettes are the ones of setupPalettes)
+	data defaults;
+	setupPalettes(defaults);
+	sessionOptions options;
+	options.history_budget = HISTORY_BUDGET_BYTES;
+	options.history_tile = HISTORY_TILE_SIZE;
+	options.history_compress = HISTORY_COMPRESS;
+	options.mask_extension = MASK_EXTENSION;
+	options.mask_palette = defaults.mask_palette;
+	options.threshold_palette = defaults.threshold_palette;
+	options.label_set = defaults.label_set;
+	options.region_size = REGION_SIZE;
+	options.region_max_pixels = REGION_MAX_PIXELS;
+
+	decodeOptions decode;
+	decode.warm_size = cv::Size(DISPLAY_SIZE_W, DISPLAY_SIZE_H);
+	decode.cache_dir = path + CACHE_DIR;
+	decode.map_min_pixels = MAPPED_IMAGE_PIXELS;
+
+	int code = 0;
+	{
+		labelServer server(path, images, decode, SERVER_KEEP_IMAGES, options,
+						   {cv::IMWRITE_TIFF_COMPRESSION, MASK_COMPRESSION}, MASK_WRITE_QUEUE);
+		std::string error;
+		if(server.listen(socket_path, error))
+		{
+			std::cout << "Serving " << path << " at " << socket_path << std::endl;
+			int sessions = server.run();
+			imageCache::cacheStats stats = server.cache().stats();
+			std::cout << sessions << " sessions served, " << stats.decodes << " images decoded, "
+					  << stats.hits << " shared" << std::endl;
+		}
+		else
+		{
+			std::cerr << "Could not serve: " << error << std::endl;
+			code = 1;
+		}
+		// I wait for the masks the sessions have saved
+		server.writer().flush();
+		if(server.writer().failed() > 0)
+			code = 3;
+	}
+	scanner.join();
+	return code;
+}
 
-	// If I wanna plot the color image
-	if(globalData.actual_channel == 0)
-		globalData.read_image.copyTo(img);
-	else
+void finishTrace(const std::string& trace_file)
+{
+	if(trace_file.empty())
+		return;
+	if(!traceWrite(trace_file))
+		std::cerr << "Could not write the trace " << trace_file << std::endl;
+	tracePrintSummary(std::cerr);
+}
+
+void handleEvent(data& globalData, const sessionEvent& e)
+{
+	switch(e.type)
 	{
-		// Else I want to plot a certain channel
-		globalData.channels.at(globalData.actual_channel-1).copyTo(img);
-		cv::cvtColor(img, img, cv::COLOR_GRAY2BGR);
+		case sessionEvent::MOUSE:
+			onMouseClickled(e.event, e.x, e.y, e.flags, (void*) &globalData);
+			break;
+		case sessionEvent::TRACKBAR:
+			if(e.name == maskTrackbar)
+				nMaskChanged(e.x, (void*) &globalData);
+			else if(e.name == channelTrackbar)
+				channelChanged(e.x, (void*) &globalData);
+			else if(e.name == thresholdTrackbar)
+				thresholdValueChanged(e.x, (void*) &globalData);
+			else if(e.name == thresholdMaxTrackbar)
+				thresholdMaxChanged(e.x, (void*) &globalData);
+			else if(e.name == radiusTrackbar)
+				radiousValueChanged(e.x, (void*) &globalData);
+			else if(e.name == imageTrackbar)
+				onButtonNextImageClicked(globalData);
+			break;
+		case sessionEvent::KEY:
+			// ESC quits and R toggles the range threshold. The navigations open the next
+			// image the session opened (see runReplayMode)
+			if(e.event == 27)
+				presenter.shutdown();
+			else if(e.event == 'r')
+				rangeModeToggled(globalData);
+			else if(e.event == 'c')
+				cleanupRequested(globalData);
+			else if(e.event == 'n' || e.event == 'p' || e.event == 'u')
+				onButtonNextImageClicked(globalData);
+			break;
+		case sessionEvent::MASK:
+			break;
 	}
+}
+
+void noteMask(data& globalData, const char* tag)
+{
+	if(globalData.recorder)
+		globalData.recorder->recordMask(tag, globalData.Images.at(globalData.current_image), globalData.mask);
+}
 
-	// If I want to display the mask
-	if(displayMask)
+void openJournal(data& globalData, bool recover)
+{
+	// Replays do not journal anything
+	if(!globalData.journal)
+		return;
+	std::string file = utils::mask_path(path, globalData.Images.at(globalData.current_image), MASK_EXTENSION) + JOURNAL_EXTENSION;
+	globalData.journal->close();
+	std::vector<journalRecord> records;
+	if(recover && readJournal(file, records) && !records.empty())
 	{
-		// I only print the 0 label if the macro is set to true above (blue)
-		if(PRINT_BACKGROUND_LABEL)
-			img.setTo(cv::Scalar(255,0,0), globalData.mask==0);
-		// Label 1 green 
-		img.setTo(cv::Scalar(0,255,0), globalData.mask==1);
-		// Label 2 red
-		img.setTo(cv::Scalar(0,0,255), globalData.mask==2);
+		int edits = replayJournal(globalData, records);
+		std::cout << "Recovered " << edits << " unsaved edits of " << globalData.Images.at(globalData.current_image) << std::endl;
 	}
-	else if(globalData.th_on)
-		// Else I don't want to display the mask
-		img.setTo(cv::Scalar(0,255,255), globalData.threshold_mask==0);
+	if(!globalData.journal->open(file))
+		std::cerr << "Could not journal the edits to " << file << std::endl;
+}
 
-	// I resize the image to de desired size
-	cv::resize(img, display_image, cv::Size(DISPLAY_SIZE_H, DISPLAY_SIZE_W));
+void onMouseEvent(int event, int x, int y, int flags, void* userdata)
+{
+	data *globalData = (data*)userdata;
+	// Plain mouse moves do nothing, so they are not logged
+	if(globalData->recorder && (event != cv::EVENT_MOUSEMOVE || flags != 0))
+		globalData->recorder->recordMouse(event, x, y, flags);
+	globalData->event_time = std::chrono::system_clock::now();
+	onMouseClickled(event, x, y, flags, userdata);
+	// Any click may have edited the mask (or opened the next image), so the stats of the
+	// title are updated
+	if(event != cv::EVENT_MOUSEMOVE)
+		showTitle(*globalData);
+}
 
-	// I join it to the buttons image
-	display_image.copyTo(globalData.imagePlusControls.colRange(0, DISPLAY_SIZE_W));
-	// I copy it to the global cv::Mat (the display_thread will display it)
-	globalImageToDisplayThread_mutex.lock();
-	globalData.imagePlusControls.copyTo(globalImageToDisplayThread);
-	globalImageToDisplayThread_mutex.unlock();
+void onMaskTrackbar(int pos, void* param)
+{
+	data *globalData = (data*)param;
+	if(globalData->recorder)
+		globalData->recorder->recordTrackbar(maskTrackbar, pos);
+	globalData->event_time = std::chrono::system_clock::now();
+	nMaskChanged(pos, param);
+	showTitle(*globalData);
 }
 
-void setup(data& globalData)
+void onChannelTrackbar(int pos, void* param)
 {
-	// I create the window 
-	cv::namedWindow(W_NAME, cv::WINDOW_AUTOSIZE);
+	data *globalData = (data*)param;
+	if(globalData->recorder)
+		globalData->recorder->recordTrackbar(channelTrackbar, pos);
+	globalData->event_time = std::chrono::system_clock::now();
+	channelChanged(pos, param);
+	showTitle(*globalData);
+}
+
+void onThresholdTrackbar(int pos, void* param)
+{
+	data *globalData = (data*)param;
+	if(globalData->recorder)
+		globalData->recorder->recordTrackbar(thresholdTrackbar, pos);
+	globalData->event_time = std::chrono::system_clock::now();
+	thresholdValueChanged(pos, param);
+	if(globalData->th_range_on)
+		showTitle(*globalData);
+}
 
+void onThresholdMaxTrackbar(int pos, void* param)
+{
+	data *globalData = (data*)param;
+	if(globalData->recorder)
+		globalData->recorder->recordTrackbar(thresholdMaxTrackbar, pos);
+	globalData->event_time = std::chrono::system_clock::now();
+	thresholdMaxChanged(pos, param);
+	if(globalData->th_range_on)
+		showTitle(*globalData);
+}
+
+void showTitle(data& globalData)
+{
+	// The trackbars only show numbers, so the title tells which label it is (with its
+	// pixels and bounding box), which plane is displayed and which bounds the range
+	// threshold has
+	std::string title = std::string(W_NAME) + " - " + labelName(globalData.label_set, globalData.mask_id);
+	long long pixels = globalData.label_stats.pixels(globalData.mask_id);
+	title += ": " + std::to_string(pixels) + " px";
+	if(pixels > 0)
+	{
+		cv::Rect box = globalData.label_stats.bounds(globalData.mask_id);
+		title += " in " + std::to_string(box.width) + "x" + std::to_string(box.height) + " at ("
+			+ std::to_string(box.x) + "," + std::to_string(box.y) + ")";
+	}
+	if(globalData.actual_channel > 0)
+		title += std::string(" - ") + planeName(globalData.actual_channel - 1);
+	if(globalData.th_range_on)
+	{
+		title += " (range";
+		for(const auto& r: globalData.th_ranges)
+			title += std::string(" ") + planeName(r.plane) + " " + std::to_string(r.lo) + "-" + std::to_string(r.hi);
+		title += ")";
+	}
+	cv::setWindowTitle(W_NAME, title);
+}
+
+void onRadiusTrackbar(int pos, void* param)
+{
+	data *globalData = (data*)param;
+	if(globalData->recorder)
+		globalData->recorder->recordTrackbar(radiusTrackbar, pos);
+	globalData->event_time = std::chrono::system_clock::now();
+	radiousValueChanged(pos, param);
+}
+
+void onImageTrackbar(int pos, void* param)
+{
+	data *globalData = (data*)param;
+	// showImagePosition moves the slider to the image that is already open, which is not a
+	// jump. Only the jumps that open an image are logged (a replay opens the next image the
+	// session opened on each of them)
+	if(pos == globalData->current_image)
+		return;
+	globalData->event_time = std::chrono::system_clock::now();
+	if(imageJumped(pos, param) && globalData->recorder)
+		globalData->recorder->recordTrackbar(imageTrackbar, pos);
+	showTitle(*globalData);
+}
+
+void displayImage(data& globalData)
+{
+	unsigned long version = 0;
+	// While the thread is running
+	while(!presenter.stopped())
+	{
+		cv::Mat frame;
+		// I wait for a new frame and I plot it as soon as it gets submitted
+		if(presenter.acquire(version, DISPLAY_WAIT_MS, frame))
+		{
+			{
+				TRACE_SCOPE("imshow");
+				cv::imshow(W_NAME, frame);
+			}
+			traceFrameShown(presenter.interaction());
+			presenter.release();
+		}
+		// I process the window events (the callbacks get called from here, so the
+		// frames they submit are shown in the next iteration)
+		char c;
+		{
+			TRACE_SCOPE("waitKey");
+			c = cv::waitKey(1);
+		}
+		// I also can quit the program by pressing the ESC key
+		if((int)c == 27)
+		{
+			if(globalData.recorder)
+				globalData.recorder->recordKey(27);
+			presenter.shutdown();
+		}
+		else if(c == 'r')
+		{
+			if(globalData.recorder)
+				globalData.recorder->recordKey('r');
+			rangeModeToggled(globalData);
+			showTitle(globalData);
+		}
+		else if(c == 'c')
+		{
+			if(globalData.recorder)
+				globalData.recorder->recordKey('c');
+			globalData.event_time = std::chrono::system_clock::now();
+			cleanupRequested(globalData);
+			showTitle(globalData);
+		}
+		// N and P open the next and the previous image and U the first one without label
+		// (they are only logged if they have opened one)
+		else if(c == 'n' || c == 'p' || c == 'u')
+		{
+			globalData.event_time = std::chrono::system_clock::now();
+			bool opened;
+			if(c == 'n')
+				opened = onButtonNextImageClicked(globalData);
+			else if(c == 'p')
+				opened = previousImage(globalData);
+			else
+				opened = firstUnlabeledImage(globalData);
+			if(opened && globalData.recorder)
+				globalData.recorder->recordKey(c);
+			showTitle(globalData);
+		}
+	}
+}
+
+void setupState(data& globalData)
+{
 	// I create the image where the buttons will be displayed
 	globalData.imagePlusControls = cv::Mat::zeros(DISPLAY_SIZE_H,
 								   static_cast<int>(1.5f*DISPLAY_SIZE_W), CV_8UC3);
 
-	// I create each slider with its event function initialized at 0
+	// Every slider starts at 0
+	globalData.mask_id = 0;
+	globalData.actual_channel = 0;
+	globalData.th_value = 0;
+	globalData.th_max = 255;
+	globalData.radiusClick = 0;
+}
+
+void setup(data& globalData)
+{
+	// I create the window 
+	cv::namedWindow(W_NAME, cv::WINDOW_AUTOSIZE);
+	windowCreated = true;
+	setupState(globalData);
+
+	// I create each slider with its event function initialized at 0 (the events are
+	// logged before being handled, in case the session is being recorded)
 	int slider1pos = 0;
-	globalData.mask_id = slider1pos;
-	int nOfMasks = 3;
+	int nOfMasks = static_cast<int>(labels.labels.size()); // Background + the labels of the label set
 	cv::createTrackbar(
-		"Mask label",
+		maskTrackbar,
 		W_NAME,
 		&slider1pos,
 		nOfMasks-1,
-		nMaskChanged,
+		onMaskTrackbar,
 		(void*) &globalData);
 
 	int slider2pos = 0;
-	globalData.actual_channel = slider2pos;
-	int nOfChannels = 4; // Color R G B C M Y BK
+	int nOfChannels = 1 + N_PLANES; // Color, then R G B H S V L a b C M Y K Gray (see channelPlane)
 	cv::createTrackbar(
-		"Channel",
+		channelTrackbar,
 		W_NAME,
 		&slider2pos,
 		nOfChannels-1,
-		channelChanged,
+		onChannelTrackbar,
 		(void*) &globalData);
 
 	int slider3pos = 0;
-	globalData.th_value = slider3pos;
 	cv::createTrackbar(
-		"Threshold",
+		thresholdTrackbar,
 		W_NAME,
 		&slider3pos,
 		255,
-		thresholdValueChanged,
+		onThresholdTrackbar,
+		(void*) &globalData);
+
+	int slider5pos = 255;
+	cv::createTrackbar(
+		thresholdMaxTrackbar,
+		W_NAME,
+		&slider5pos,
+		255,
+		onThresholdMaxTrackbar,
 		(void*) &globalData);
 
 	int slider4pos = 0;
-	globalData.radiusClick = slider4pos;
 	cv::createTrackbar(
-		"Radius of clicked point",
+		radiusTrackbar,
 		W_NAME,
 		&slider4pos,
 		100,
-		radiousValueChanged,
+		onRadiusTrackbar,
 		(void*) &globalData);
 
-	// I set mouse callbacks to the onMouseClickled function
-	cv::setMouseCallback(W_NAME, onMouseClickled, (void*) &globalData);
+	// The images are still being found, so its maximum grows with them (see showImagePosition)
+	int slider6pos = 0;
+	cv::createTrackbar(
+		imageTrackbar,
+		W_NAME,
+		&slider6pos,
+		1,
+		onImageTrackbar,
+		(void*) &globalData);
+
+	// I set mouse callbacks to the onMouseEvent function
+	cv::setMouseCallback(W_NAME, onMouseEvent, (void*) &globalData);
 }
 
 void setupButtons(data& globalData)
@@ -316,6 +972,18 @@ void setupButtons(data& globalData)
 	}
 }
 
+void setupPalettes(data& globalData)
+{
+	// Each label is drawn with the color of the label set, and I only print the 0 label if
+	// the macro is set to true above
+	globalData.label_set = labels;
+	paletteFromLabels(labels, OVERLAY_ALPHA, PRINT_BACKGROUND_LABEL, globalData.mask_palette);
+
+	// The pixels that are 0 in the threshold mask are displayed yellow
+	clearPalette(globalData.threshold_palette);
+	setPaletteLabel(globalData.threshold_palette, 0, cv::Scalar(0,255,255), OVERLAY_ALPHA);
+}
+
 void displayButton(rectanglesButtons button, cv::Mat& imagePlusControls)
 {
 	// I erode the real reactangle just for appearence
@@ -361,16 +1029,9 @@ void onButtonViewMaskClicked(data& globalData)
 
 void onButtonApllyThresholdClicked(data& globalData)
 {
-	// If the threshold mask is created
-	if(globalData.threshold_mask.cols > 0)
-	{
-		// I apply the threshold to the mask (with the mask_id label)
-		globalData.mask.copyTo(globalData.previous_mask);
-		globalData.mask.setTo(cv::Scalar(globalData.mask_id), globalData.threshold_mask==0);
-		globalData.th_on = false;
-		display_img(globalData, globalData.mask_view_on);
-	}
-	
+	// If I am working with a threshold
+	if(globalData.th_on && globalData.actual_channel > 0)
+		applyThreshold(globalData);
 }
 
 void onButtonThresholdInvClicked(data& globalData)
@@ -390,8 +1051,18 @@ void onButtonThresholdInvClicked(data& globalData)
 		displayButton(globalData.buttons[2], globalData.imagePlusControls);
 		globalData.th_inv = true;
 	}
-	// I calculate the new threshold mask with the new inversion mode
-	thresholdValueChanged(globalData.th_value, (void*) &globalData);
+	// I calculate the new threshold mask with the new inversion mode (in range mode the
+	// bounds stay as they are)
+	if(globalData.th_range_on)
+	{
+		globalData.buttons[0]._color = cv::Scalar(0,0,255);
+		displayButton(globalData.buttons[0], globalData.imagePlusControls);
+		previewRange(globalData);
+	}
+	else
+		thresholdValueChanged(globalData.th_value, (void*) &globalData);
+	// The preview may only have submitted the image, so I submit the button too
+	publishDisplay(globalData, globalData.buttons[2]._rect);
 }
 
 void onButtonDeleteClicked(data& globalData)
@@ -426,43 +1097,142 @@ void onButtonAddClicked(data& globalData)
 
 void onButtonGoBackClicked(data& globalData)
 {
-	// When go back is pressed, I just copy the previous mask to the
-	// mask and I display the result
-	if(globalData.previous_mask.cols > 0)
+	// When go back is pressed, I restore the tiles changed by the last edit
+	undoEdit(globalData);
+}
+
+void onButtonRedoClicked(data& globalData)
+{
+	// When redo is pressed, I apply again the last undone edit
+	redoEdit(globalData);
+}
+
+bool goToImage(data& globalData, int idx)
+{
+	TRACE_SCOPE("goToImage");
+	if(idx < 0 || idx == globalData.current_image || idx >= static_cast<int>(globalData.Images.wait_for_more(idx)))
+		return false;
+	std::string name = globalData.Images.at(idx);
+
+	// An image that has been visited is in the navigation cache (decoded, and with the planes
+	// that were converted), and the rest come from the prefetcher (it has most likely
+	// decoded the next ones already)
+	decodedImage decoded;
+	std::shared_ptr<const decodedImage> cached = globalData.navigation ? globalData.navigation->image(name) : nullptr;
+	if(cached)
+		decoded = *cached;
+	else if(globalData.prefetcher->take(idx, decoded))
 	{
-		globalData.previous_mask.copyTo(globalData.mask);
-		display_img(globalData, globalData.mask_view_on);
+		if(globalData.navigation)
+			globalData.navigation->putImage(name, decoded);
 	}
+	else
+		return false;
+	globalData.prefetcher->prefetchFrom(idx + 1);
+
+	// The image I leave keeps its mask as it is, so as to coming back does not read it again
+	// nor replay its journal
+	if(globalData.current_image >= 0)
+	{
+		noteMask(globalData, "close");
+		if(globalData.navigation)
+			globalData.navigation->putMask(globalData.Images.at(globalData.current_image),
+										   {globalData.mask, globalData.mask_backing, globalData.label_stats});
+	}
+	openMask restored;
+	bool replaying = !globalData.replay_session.empty();
+	bool kept = !replaying && globalData.navigation && globalData.navigation->takeMask(name, restored);
+	installImage(decoded, globalData, kept ? &restored : nullptr);
+	globalData.current_image = idx;
+	if(replaying)
+		loadSavedMask(sessionMaskFile(globalData.replay_session, idx), globalData);
+	else if(!kept)
+	{
+		// If the mask of the image had already been saved, I keep working on it. A save of it
+		// may still be queued, and its journal gets compacted once it is written, so I wait
+		// for it so as to read both of them as they are (a mask saved as an image before
+		// MASK_EXTENSION was used is read if there is no other)
+		std::string file = utils::mask_path(path, name, MASK_EXTENSION);
+		if(globalData.writer)
+			globalData.writer->flush(file);
+		loadSavedMask(utils::saved_mask_path(path, name, MASK_EXTENSION), globalData);
+	}
+	openJournal(globalData, !kept);
+	noteMask(globalData, "open");
+	display_img(globalData, false);
+	showImagePosition(globalData);
+	return true;
 }
 
-void onButtonNextImageClicked(data& globalData)
+bool onButtonNextImageClicked(data& globalData)
 {
-	// When next image is pressed, the current image counter gets increased and
-	// if it was not the last image, I read the next one and I display it
-	globalData.current_image++;
-	if(globalData.current_image < globalData.n_of_images)
+	// When next image is pressed, I open the next image. Images that can not be decoded are
+	// skipped. If the directory is still being scanned, I wait for the next image to be found
+	for(int idx = globalData.current_image + 1; idx < static_cast<int>(globalData.Images.wait_for_more(idx)); idx++)
 	{
-		readImage(path + globalData.Images.at(globalData.current_image), globalData);
-		display_img(globalData, false);
+		if(goToImage(globalData, idx))
+			return true;
+		std::cerr << "Skipping " << globalData.Images.at(idx) << std::endl;
 	}
+	return false;
 }
 
-void onButtonSaveMaskClicked(data& globalData)
+bool previousImage(data& globalData)
 {
-	// When save mask is pressed, I save it to the masks folder in the above given path
-	std::string maskName = "mask_" + globalData.Images.at(globalData.current_image);
-	bool exists_mask_folder = std::filesystem::exists(std::filesystem::path(path + "/masks"));
+	TRACE_INTERACTION("previous");
+	for(int idx = globalData.current_image - 1; idx >= 0; idx--)
+	{
+		if(goToImage(globalData, idx))
+			return true;
+		std::cerr << "Skipping " << globalData.Images.at(idx) << std::endl;
+	}
+	return false;
+}
+
+bool firstUnlabeledImage(data& globalData)
+{
+	TRACE_INTERACTION("unlabeled");
+	// The journal of every visited image exists, but it is only empty while the image has
+	// no unsaved edit (the left ones get written when the journal is closed)
+	std::error_code ec;
+	for(int idx = 0; idx < static_cast<int>(globalData.Images.wait_for_more(idx)); idx++)
+	{
+		if(idx == globalData.current_image)
+			continue;
+		std::string file = utils::mask_path(path, globalData.Images.at(idx), MASK_EXTENSION);
+		if(std::filesystem::exists(utils::saved_mask_path(path, globalData.Images.at(idx), MASK_EXTENSION), ec))
+			continue;
+		auto journal_size = std::filesystem::file_size(file + JOURNAL_EXTENSION, ec);
+		if(!ec && journal_size > 0)
+			continue;
+		if(goToImage(globalData, idx))
+			return true;
+	}
+	return false;
+}
 
-	// If masks do not exist, the program creates it
-	if(!exists_mask_folder)
-		std::filesystem::create_directory(path + "/masks");
+void showImagePosition(data& globalData)
+{
+	if(!windowCreated)
+		return;
+	cv::setTrackbarMax(imageTrackbar, W_NAME, std::max(1, static_cast<int>(globalData.Images.size()) - 1));
+	cv::setTrackbarPos(imageTrackbar, W_NAME, globalData.current_image);
+}
 
-	cv::imwrite(path + "masks/" + maskName, globalData.mask);
+void onButtonSaveMaskClicked(data& globalData)
+{
+	// When save mask is pressed, I queue a copy of it to be written to the masks folder in
+	// the above given path (the writer creates it if it does not exist) in background.
+	// Replays do not save anything
+	if(!globalData.writer)
+		return;
+	saveMask(utils::mask_path(path, globalData.Images.at(globalData.current_image), MASK_EXTENSION), globalData);
 }
 
 void nMaskChanged(int pos, void* param)
 {
 	// I update the mask_id value when the correspondent slider gets moved
+	TRACE_INTERACTION(maskTrackbar.c_str());
 	data *globalData = (data*)param;
 	globalData->mask_id = pos;
 }
@@ -471,48 +1241,121 @@ void channelChanged(int pos, void* param)
 {
 	// I update the actual_channel value when the correspondent slider gets moved
 	// And I display it
+	TRACE_INTERACTION(channelTrackbar.c_str());
 	data *globalData = (data*)param;
 	globalData->actual_channel = pos;
+
+	// The threshold preview belongs to the previous channel, so I compute the one of the
+	// new channel (the color image can not be thresholded). The range preview stays the
+	// same, only the channel it is drawn over changes
+	if(globalData->th_on)
+	{
+		globalData->th_on = false;
+		if(pos > 0 && globalData->th_range_on)
+		{
+			previewRange(*globalData);
+			return;
+		}
+		if(pos > 0)
+		{
+			thresholdValueChanged(globalData->th_value, param);
+			return;
+		}
+	}
 	display_img(*globalData, globalData->mask_view_on);
 }
 
 void thresholdValueChanged(int pos, void* param)
 {
-
+	TRACE_INTERACTION(thresholdTrackbar.c_str());
 	data *globalData = (data*)param;
 
 	// When I change the threshold value and I'm not working with the color image
 	if(globalData->actual_channel > 0)
 	{
-		// I save the slider's pos at th_value
-		globalData->th_value = pos;
-		// I set mask_view_on to false because I wanna see the threshold and I set
-		// its buttons color to red
-		globalData->mask_view_on = false;
+		// The mask stops being displayed, so I set its buttons color to red
 		globalData->buttons[0]._color = cv::Scalar(0,0,255);
 		displayButton(globalData->buttons[0], globalData->imagePlusControls);
-		// I activate th_on becasue I'm working with the threshold
-		globalData->th_on = true;
-
-		// I set the threshold time according to the value of th_inv
-		int thType;
-		if(globalData->th_inv)
-			thType = cv::THRESH_BINARY_INV;
+		// In range mode the slider is the lower bound of the displayed channel
+		if(globalData->th_range_on)
+		{
+			globalData->th_value = pos;
+			setRangeBounds(*globalData, globalData->actual_channel - 1, pos, globalData->th_max);
+			previewRange(*globalData);
+		}
 		else
-			thType = cv::THRESH_BINARY;
-
-		// I do the threshold and I store it on threshold_mask
-		cv::threshold(globalData->channels.at(globalData->actual_channel-1),
-					  globalData->threshold_mask, pos, 255, thType);
+			previewThreshold(*globalData, pos);
+		return;
 	}
 
-	// Finally, I display it
 	display_img(*globalData, globalData->mask_view_on);
 }
 
+void thresholdMaxChanged(int pos, void* param)
+{
+	TRACE_INTERACTION(thresholdMaxTrackbar.c_str());
+	data *globalData = (data*)param;
+	globalData->th_max = pos;
+
+	// The upper bound is only used by the range threshold
+	if(globalData->th_range_on && globalData->actual_channel > 0)
+	{
+		globalData->buttons[0]._color = cv::Scalar(0,0,255);
+		displayButton(globalData->buttons[0], globalData->imagePlusControls);
+		setRangeBounds(*globalData, globalData->actual_channel - 1, globalData->th_value, pos);
+		previewRange(*globalData);
+	}
+}
+
+void rangeModeToggled(data& globalData)
+{
+	TRACE_INTERACTION("range");
+	// Each mode starts without bounds, and if a threshold was being previewed I preview
+	// the one of the new mode (from the sliders of the displayed channel)
+	globalData.th_range_on = !globalData.th_range_on;
+	globalData.th_ranges.clear();
+	if(globalData.th_on)
+	{
+		globalData.th_on = false;
+		thresholdValueChanged(globalData.th_value, (void*) &globalData);
+		return;
+	}
+	display_img(globalData, globalData.mask_view_on);
+}
+
+bool imageJumped(int pos, void* param)
+{
+	// Jumps to the image of the slider (it goes back to the current one if it can not be opened)
+	TRACE_INTERACTION(imageTrackbar.c_str());
+	data *globalData = (data*)param;
+	if(goToImage(*globalData, pos))
+		return true;
+	showImagePosition(*globalData);
+	return false;
+}
+
+void cleanupRequested(data& globalData)
+{
+	TRACE_INTERACTION("cleanup");
+	// The background is what the labels leave, so it is not cleaned up
+	if(globalData.mask_id < 1)
+		return;
+	labelCleanup step;
+	step.label = globalData.mask_id;
+	step.open_radius = CLEANUP_RADIUS;
+	step.close_radius = CLEANUP_RADIUS;
+	step.fill_holes = CLEANUP_FILL_HOLES;
+	step.min_area = CLEANUP_MIN_AREA;
+	for(const auto& c: cleanups)
+		if(c.label == globalData.mask_id)
+			step = c;
+	applyCleanup(globalData, step);
+}
+
 void radiousValueChanged(int pos, void* param)
 {
 	// I update the radius value when the slider gets moved
+	TRACE_INTERACTION(radiusTrackbar.c_str());
 	data *globalData = (data*)param;
 	globalData->radiusClick = pos;
 }
@@ -526,28 +1369,79 @@ void onMouseClickled(int event, int x, int y, int flags, void* userdata)
 	// I store the clicked point
 	cv::Point2d p(x, y);
 
-	// I scale it to it's corresponding point in the original image
-	int h_scaling_factor = globalData->read_image.cols/DISPLAY_SIZE_H;
-	int w_scaling_factor = globalData->read_image.rows/DISPLAY_SIZE_W;
+	// I get it's corresponding point in the original image (according to the zoom and pan)
+	cv::Point2d p_real_d = globalData->view.displayToImage(cv::Point(x, y));
+	cv::Point2d p_real(cvRound(p_real_d.x), cvRound(p_real_d.y));
 
-	cv::Point2d p_real(h_scaling_factor*x, w_scaling_factor*y);
+	// The mouse wheel zooms around the pointed point
+	if  ( event == cv::EVENT_MOUSEWHEEL && x < DISPLAY_SIZE_W )
+	{
+		TRACE_INTERACTION("zoom");
+		double factor = cv::getMouseWheelDelta(flags) > 0 ? ZOOM_STEP : 1.0/ZOOM_STEP;
+		globalData->view.zoomAt(cv::Point(x, y), factor);
+		display_img(*globalData, globalData->mask_view_on);
+		return;
+	}
 
-	if  ( event == cv::EVENT_LBUTTONDBLCLK && x < DISPLAY_SIZE_W )
+	// Dragging with the right button pans the displayed region
+	if  ( event == cv::EVENT_RBUTTONDOWN && x < DISPLAY_SIZE_W )
+		globalData->pan_start = cv::Point(x, y);
+
+	if  ( event == cv::EVENT_MOUSEMOVE && (flags & cv::EVENT_FLAG_RBUTTON) && globalData->view.zoom() > 1.0 )
 	{
-		// If double click -> I create a circle of radius radiusClick at the clicked pos
-		globalData->mask.copyTo(globalData->previous_mask);
+		TRACE_INTERACTION("pan");
+		globalData->view.pan(x - globalData->pan_start.x, y - globalData->pan_start.y);
+		globalData->pan_start = cv::Point(x, y);
+		display_img(*globalData, globalData->mask_view_on);
+		return;
+	}
 
-		cv::Scalar c;
+	// Dragging with the left button while shift is held paints a brush stroke
+	if  ( event == cv::EVENT_MOUSEMOVE && globalData->stroking )
+	{
+		TRACE_INTERACTION("brush");
+		continueStroke(*globalData, cv::Point(p_real));
+		return;
+	}
 
-		// I delete is enabled im deleting -> mask 0 (background), else I use mask_id
-		if(globalData->add_on)
-			c = cv::Scalar(globalData->mask_id);
-		else
-			c = cv::Scalar(0);
+	if  ( event == cv::EVENT_LBUTTONUP && globalData->stroking )
+	{
+		TRACE_INTERACTION("brush");
+		globalData->click_handled = false;
+		endStroke(*globalData);
+		return;
+	}
 
-		// I create the circle
-		cv::circle(globalData->mask, p_real, globalData->radiusClick, c, cv::FILLED);
-		display_img(*globalData, globalData->mask_view_on);
+	// Ctrl + click labels the whole region (of the over-segmentation) under the pointer
+	if  ( event == cv::EVENT_LBUTTONDOWN && (flags & cv::EVENT_FLAG_CTRLKEY) && x < DISPLAY_SIZE_W )
+	{
+		TRACE_INTERACTION("region");
+		globalData->click_handled = true;
+		fillRegion(*globalData, cv::Point(p_real));
+		return;
+	}
+
+	// The release of that click (or of a stroke that another edit has ended) is not the end
+	// of a rectangle (rect_p1 has not been set)
+	if  ( event == cv::EVENT_LBUTTONUP && globalData->click_handled )
+	{
+		globalData->click_handled = false;
+		return;
+	}
+
+	if  ( event == cv::EVENT_LBUTTONDOWN && (flags & cv::EVENT_FLAG_SHIFTKEY) && x < DISPLAY_SIZE_W )
+	{
+		TRACE_INTERACTION("brush");
+		globalData->click_handled = true;
+		beginStroke(*globalData, cv::Point(p_real));
+		return;
+	}
+
+	if  ( event == cv::EVENT_LBUTTONDBLCLK && x < DISPLAY_SIZE_W )
+	{
+		// If double click -> I create a circle of radius radiusClick at the clicked pos
+		TRACE_INTERACTION("circle");
+		drawCircle(*globalData, cv::Point(p_real));
 	}
 
 	if  ( event == cv::EVENT_LBUTTONUP && x < DISPLAY_SIZE_W )
@@ -555,25 +1449,14 @@ void onMouseClickled(int event, int x, int y, int flags, void* userdata)
 		//  Press down + press up -> rectangle
 
 		// I store the time that has needed the user to create the rectangle
-		globalData->m_EndTime = std::chrono::system_clock::now();
+		globalData->m_EndTime = globalData->event_time;
 
 		// I only display the rectangle if it has been more than 250ms, if not, it has been a double click so I don't wanna print a rectangle
 		if(std::chrono::duration_cast<std::chrono::milliseconds>(globalData->m_EndTime - globalData->m_StartTime).count() > 250)
 		{
-			// The same as explained with circles
+			TRACE_INTERACTION("rectangle");
 			globalData->rect_p2 = p_real;
-
-			globalData->mask.copyTo(globalData->previous_mask);
-
-			cv::Scalar c;
-
-			if(globalData->add_on)
-				c = cv::Scalar(globalData->mask_id);
-			else
-				c = cv::Scalar(0);
-
-			cv::rectangle(globalData->mask, globalData->rect_p1, globalData->rect_p2, c, cv::FILLED);
-			display_img(*globalData, globalData->mask_view_on);
+			drawRectangle(*globalData, cv::Point(globalData->rect_p1), cv::Point(globalData->rect_p2));
 		}
 	}
 
@@ -584,7 +1467,7 @@ void onMouseClickled(int event, int x, int y, int flags, void* userdata)
 		{
 			// When I do a single click, I store system time (as explained above) and I store
 			// the clicked point so as to create the rectangle
-			globalData->m_StartTime = std::chrono::system_clock::now();
+			globalData->m_StartTime = globalData->event_time;
 			globalData->rect_p1 = p_real;
 		}
 		else
@@ -603,6 +1486,9 @@ void onMouseClickled(int event, int x, int y, int flags, void* userdata)
 			}
 
 			// And I call its function
+			if(button_idx < 0)
+				return;
+			TRACE_INTERACTION(buttonsNames.at(button_idx).c_str());
 			switch(button_idx)
 			{
 				case 0:
@@ -624,14 +1510,17 @@ void onMouseClickled(int event, int x, int y, int flags, void* userdata)
 			  		onButtonGoBackClicked(*globalData);
 			  		break;
 				case 6:
-			  		onButtonNextImageClicked(*globalData);
+			  		onButtonRedoClicked(*globalData);
 			  		break;
 				case 7:
+			  		onButtonNextImageClicked(*globalData);
+			  		break;
+				case 8:
 					onButtonSaveMaskClicked(*globalData);
 					break;
-				case 8:
+				case 9:
 					// To quit the program just kill the displaying thread
-					killThread = true;
+					presenter.shutdown();
 		  			break;
 				default:
 					break;
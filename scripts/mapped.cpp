@@ -0,0 +1,236 @@
+#include "mapped.h"
+
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace
+{
+	const char mapped_magic[8] = {'M', 'C', 'M', 'A', 'P', '0', '0', '1'};
+
+	// Header of a cache file. It is followed by n_planes planeHeader and then by the planes
+	struct fileHeader
+	{
+		char magic[8];
+		int64_t source_size;
+		int64_t source_mtime;
+		int32_t n_planes;
+		int32_t reserved;
+	};
+
+	struct planeHeader
+	{
+		int32_t group;
+		int32_t level;
+		int32_t rows;
+		int32_t cols;
+		int32_t type;
+		int32_t reserved;
+		int64_t offset; // From the start of the file (page aligned)
+	};
+
+	const size_t page = 4096;
+
+	size_t alignPage(size_t n)
+	{
+		return (n + page - 1)/page*page;
+	}
+
+	// Gets the size and the modification time that identify a source file
+	bool sourceStamp(const std::string& source, int64_t& size, int64_t& mtime)
+	{
+		std::error_code ec;
+		auto s = std::filesystem::file_size(source, ec);
+		if(ec)
+			return false;
+		auto t = std::filesystem::last_write_time(source, ec);
+		if(ec)
+			return false;
+		size = static_cast<int64_t>(s);
+		mtime = static_cast<int64_t>(t.time_since_epoch().count());
+		return true;
+	}
+}
+
+mappedFile::mappedFile()
+	: _data(nullptr), _size(0), fd(-1)
+{
+}
+
+mappedFile::~mappedFile()
+{
+	if(_data != nullptr)
+		munmap(_data, _size);
+	if(fd >= 0)
+		close(fd);
+}
+
+std::shared_ptr<mappedFile> mappedFile::open(const std::string& path, bool writable)
+{
+	int f = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+	if(f < 0)
+		return nullptr;
+
+	struct stat st;
+	if(fstat(f, &st) != 0 || st.st_size <= 0)
+	{
+		close(f);
+		return nullptr;
+	}
+
+	void* p = mmap(nullptr, st.st_size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, f, 0);
+	if(p == MAP_FAILED)
+	{
+		close(f);
+		return nullptr;
+	}
+
+	std::shared_ptr<mappedFile> file(new mappedFile());
+	file->_data = static_cast<uchar*>(p);
+	file->_size = st.st_size;
+	file->fd = f;
+	return file;
+}
+
+std::shared_ptr<mappedFile> mappedFile::create(const std::string& path, size_t size)
+{
+	int f = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(f < 0)
+		return nullptr;
+
+	// The file is sparse: the pages that are never written do not use disk nor memory
+	if(ftruncate(f, size) != 0)
+	{
+		close(f);
+		return nullptr;
+	}
+
+	void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+	if(p == MAP_FAILED)
+	{
+		close(f);
+		return nullptr;
+	}
+
+	std::shared_ptr<mappedFile> file(new mappedFile());
+	file->_data = static_cast<uchar*>(p);
+	file->_size = size;
+	file->fd = f;
+	return file;
+}
+
+uchar* mappedFile::data()
+{
+	return _data;
+}
+
+size_t mappedFile::size() const
+{
+	return _size;
+}
+
+bool writeMappedPlanes(const std::string& path, const std::string& source, const std::vector<mappedPlane>& planes)
+{
+	fileHeader header;
+	std::memcpy(header.magic, mapped_magic, sizeof(mapped_magic));
+	if(!sourceStamp(source, header.source_size, header.source_mtime))
+		return false;
+	header.n_planes = static_cast<int32_t>(planes.size());
+	header.reserved = 0;
+
+	// I lay the planes out one after the other, each one starting at a page
+	std::vector<planeHeader> headers(planes.size());
+	size_t offset = alignPage(sizeof(fileHeader) + planes.size()*sizeof(planeHeader));
+	for(size_t i=0; i<planes.size(); i++)
+	{
+		const cv::Mat& m = planes[i].mat;
+		headers[i].group = planes[i].group;
+		headers[i].level = planes[i].level;
+		headers[i].rows = m.rows;
+		headers[i].cols = m.cols;
+		headers[i].type = m.type();
+		headers[i].reserved = 0;
+		headers[i].offset = static_cast<int64_t>(offset);
+		offset = alignPage(offset + static_cast<size_t>(m.cols)*m.rows*m.elemSize());
+	}
+
+	// I write to a temporary file that gets renamed at the end, so as to a half written
+	// cache is never mapped
+	std::string tmp = path + ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+		if(!out)
+			return false;
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(headers.data()), headers.size()*sizeof(planeHeader));
+		for(size_t i=0; i<planes.size(); i++)
+		{
+			const cv::Mat& m = planes[i].mat;
+			out.seekp(headers[i].offset);
+			size_t row = static_cast<size_t>(m.cols)*m.elemSize();
+			for(int y=0; y<m.rows; y++)
+				out.write(reinterpret_cast<const char*>(m.ptr(y)), row);
+		}
+		// I pad the last plane up to the page
+		out.seekp(offset - 1);
+		out.put(0);
+		if(!out)
+			return false;
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tmp, path, ec);
+	return !ec;
+}
+
+bool mapPlanes(const std::string& path, const std::string& source, std::vector<mappedPlane>& planes,
+			   std::shared_ptr<mappedFile>& file)
+{
+	planes.clear();
+	std::shared_ptr<mappedFile> f = mappedFile::open(path, false);
+	if(!f || f->size() < sizeof(fileHeader))
+		return false;
+
+	fileHeader header;
+	std::memcpy(&header, f->data(), sizeof(header));
+	int64_t size, mtime;
+	if(std::memcmp(header.magic, mapped_magic, sizeof(mapped_magic)) != 0 || header.n_planes < 0
+	   || !sourceStamp(source, size, mtime) || size != header.source_size || mtime != header.source_mtime)
+		return false;
+
+	if(sizeof(fileHeader) + header.n_planes*sizeof(planeHeader) > f->size())
+		return false;
+	const planeHeader* headers = reinterpret_cast<const planeHeader*>(f->data() + sizeof(fileHeader));
+
+	for(int i=0; i<header.n_planes; i++)
+	{
+		const planeHeader& h = headers[i];
+		mappedPlane plane;
+		plane.group = h.group;
+		plane.level = h.level;
+		plane.mat = cv::Mat(h.rows, h.cols, h.type, f->data() + h.offset);
+		if(static_cast<size_t>(h.offset) + plane.mat.total()*plane.mat.elemSize() > f->size())
+		{
+			planes.clear();
+			return false;
+		}
+		planes.push_back(plane);
+	}
+
+	file = f;
+	return true;
+}
+
+cv::Mat createMappedMask(const std::string& path, const cv::Size& size, std::shared_ptr<mappedFile>& file)
+{
+	file = mappedFile::create(path, static_cast<size_t>(size.width)*size.height);
+	if(!file)
+		return cv::Mat::zeros(size, CV_8UC1);
+	return cv::Mat(size, CV_8UC1, file->data());
+}
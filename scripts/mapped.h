@@ -0,0 +1,54 @@
+#ifndef MAPPED_H
+#define MAPPED_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "opencv2/core/core.hpp"
+
+// Class that holds a memory mapped file. Every cv::Mat that points to its memory must
+// keep a shared_ptr to it, as the memory gets unmapped when the object is destroyed.
+// Only the pages that are read (or written) are loaded by the OS, so the memory used
+// depends on the displayed region and not on the size of the file
+class mappedFile
+{
+public:
+	// Maps an existing file. Returns nullptr if it can not be opened
+	static std::shared_ptr<mappedFile> open(const std::string& path, bool writable);
+	// Creates (or truncates) a file of size bytes filled with zeros and maps it read-write
+	static std::shared_ptr<mappedFile> create(const std::string& path, size_t size);
+	~mappedFile();
+
+	uchar* data();
+	size_t size() const;
+
+private:
+	mappedFile();
+
+	uchar* _data;
+	size_t _size;
+	int fd;
+};
+
+// Struct that holds one plane of a cache file: the group it belongs to (for instance 0 for
+// the image and 1+i for the channel i) and its pyramid level
+struct mappedPlane
+{
+	int group;
+	int level;
+	cv::Mat mat; // Points to the mapped memory
+};
+
+// Writes the planes to path, with a header that identifies the source file (its size and
+// modification time) so as to stale caches are detected. Returns false on error
+bool writeMappedPlanes(const std::string& path, const std::string& source, const std::vector<mappedPlane>& planes);
+// Maps a file written by writeMappedPlanes. Returns false if it does not exist or if the
+// source has changed since it was written. The mats of planes point to file
+bool mapPlanes(const std::string& path, const std::string& source, std::vector<mappedPlane>& planes,
+			   std::shared_ptr<mappedFile>& file);
+
+// Creates a mask of the given size backed by a zero filled mapped file
+cv::Mat createMappedMask(const std::string& path, const cv::Size& size, std::shared_ptr<mappedFile>& file);
+
+#endif
@@ -0,0 +1,371 @@
+#include "morphology.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <numeric>
+#include <mutex>
+#include <cstring>
+
+namespace
+{
+	// Rows of each of the bands in which the image is split (they are processed in parallel)
+	const int BAND_ROWS = 64;
+
+	// Calls f(y0, y1) for every band of [0, rows), in parallel
+	template<typename F>
+	void forBands(int rows, F f)
+	{
+		int n = (rows + BAND_ROWS - 1)/BAND_ROWS;
+		cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range)
+		{
+			for(int b=range.start; b<range.end; b++)
+				f(b*BAND_ROWS, std::min(rows, (b + 1)*BAND_ROWS));
+		});
+	}
+
+	// Sets out[p] (p < n*len) to the min (max) of the w values in[p], in[p + len]...
+	// in[p + (w-1)*len], being in n + w - 1 items of len values. The window is built by
+	// doubling (each pass takes the extreme of two windows of half its size), so every pass
+	// is a loop over contiguous values and it takes log2(w) of them. in and tmp (of the same
+	// size) are used as scratch
+	template<bool MAX>
+	void slidingExtreme(uchar* in, uchar* tmp, size_t n, size_t len, int w, uchar* out)
+	{
+		uchar* a = in;
+		uchar* b = tmp;
+		size_t items = n + w - 1;
+		size_t k = 1;
+		for(; 2*k <= static_cast<size_t>(w); k *= 2)
+		{
+			size_t m = (items - k)*len, d = k*len;
+			for(size_t p=0; p<m; p++)
+				b[p] = MAX ? std::max(a[p], a[p + d]) : std::min(a[p], a[p + d]);
+			items -= k;
+			std::swap(a, b);
+		}
+		// a[i] is the extreme of the k items from i, and the window is two of them that overlap
+		size_t d = (w - k)*len;
+		for(size_t p=0; p<n*len; p++)
+			out[p] = MAX ? std::max(a[p], a[p + d]) : std::min(a[p], a[p + d]);
+	}
+
+	// dst gets the erosion (dilation if MAX) of src with a square of side 2r+1, as a pass
+	// over the rows and another one over the columns. The pixels out of src repeat the ones
+	// of its border, so the border does not erode
+	template<bool MAX>
+	void squareFilter(const cv::Mat& src, int r, cv::Mat& dst)
+	{
+		int rows = src.rows, cols = src.cols, w = 2*r + 1;
+		dst.create(src.size(), CV_8UC1);
+		CV_Assert(dst.isContinuous() && dst.data != src.data);
+		cv::Mat horizontal(src.size(), CV_8UC1);
+
+		// Each row is padded with r copies of its ends
+		forBands(rows, [&](int y0, int y1)
+		{
+			std::vector<uchar> pad(cols + 2*r), tmp(cols + 2*r);
+			for(int y=y0; y<y1; y++)
+			{
+				const uchar* s = src.ptr<uchar>(y);
+				std::memset(pad.data(), s[0], r);
+				std::memcpy(pad.data() + r, s, cols);
+				std::memset(pad.data() + r + cols, s[cols - 1], r);
+				slidingExtreme<MAX>(pad.data(), tmp.data(), cols, 1, w, horizontal.ptr<uchar>(y));
+			}
+		});
+
+		// Each band takes its rows and r more above and below, and the items are whole rows
+		forBands(rows, [&](int y0, int y1)
+		{
+			size_t items = static_cast<size_t>(y1 - y0 + 2*r);
+			std::vector<uchar> band(items*cols), tmp(items*cols);
+			for(size_t i=0; i<items; i++)
+			{
+				int y = std::min(std::max(y0 - r + static_cast<int>(i), 0), rows - 1);
+				std::memcpy(&band[i*cols], horizontal.ptr<uchar>(y), cols);
+			}
+			slidingExtreme<MAX>(band.data(), tmp.data(), y1 - y0, cols, w, dst.ptr<uchar>(y0));
+		});
+	}
+
+	// Pixels [x0, x1) of the row y
+	struct pixelRun
+	{
+		int y;
+		int x0;
+		int x1;
+	};
+
+	// Finds the runs of the pixels of bin that are set (or that are 0, if set is false), row
+	// by row. first[y] gets the index of the first run of the row y (first[rows] the number
+	// of runs)
+	void findRuns(const cv::Mat& bin, bool set, std::vector<pixelRun>& runs, std::vector<size_t>& first)
+	{
+		std::vector<std::vector<pixelRun>> band_runs((bin.rows + BAND_ROWS - 1)/BAND_ROWS);
+		forBands(bin.rows, [&](int y0, int y1)
+		{
+			std::vector<pixelRun>& out = band_runs[y0/BAND_ROWS];
+			for(int y=y0; y<y1; y++)
+			{
+				const uchar* row = bin.ptr<uchar>(y);
+				int x = 0;
+				while(x < bin.cols)
+				{
+					while(x < bin.cols && (row[x] != 0) != set)
+						x++;
+					int x0 = x;
+					while(x < bin.cols && (row[x] != 0) == set)
+						x++;
+					if(x > x0)
+						out.push_back({y, x0, x});
+				}
+			}
+		});
+
+		runs.clear();
+		first.assign(bin.rows + 1, 0);
+		for(const auto& band: band_runs)
+			runs.insert(runs.end(), band.begin(), band.end());
+		for(const auto& r: runs)
+			first[r.y + 1]++;
+		for(int y=0; y<bin.rows; y++)
+			first[y + 1] += first[y];
+	}
+
+	int findRoot(std::vector<int>& parent, int i)
+	{
+		while(parent[i] != i)
+		{
+			parent[i] = parent[parent[i]];
+			i = parent[i];
+		}
+		return i;
+	}
+
+	// Joins the runs of consecutive rows that touch (diagonally too if diagonal) into
+	// components. root[i] gets the component of the run i (the index of one of its runs)
+	void connectRuns(const std::vector<pixelRun>& runs, const std::vector<size_t>& first, bool diagonal, std::vector<int>& root)
+	{
+		std::vector<int> parent(runs.size());
+		std::iota(parent.begin(), parent.end(), 0);
+		int d = diagonal ? 1 : 0;
+		for(size_t y=1; y+1<first.size(); y++)
+		{
+			size_t i = first[y - 1], j = first[y];
+			while(i < first[y] && j < first[y + 1])
+			{
+				const pixelRun& a = runs[i];
+				const pixelRun& b = runs[j];
+				if(a.x0 < b.x1 + d && b.x0 < a.x1 + d)
+				{
+					int ra = findRoot(parent, static_cast<int>(i)), rb = findRoot(parent, static_cast<int>(j));
+					if(ra != rb)
+						parent[std::max(ra, rb)] = std::min(ra, rb);
+				}
+				// The run that ends first can not touch the next ones of the other row
+				if(a.x1 < b.x1)
+					i++;
+				else
+					j++;
+			}
+		}
+		root.resize(runs.size());
+		for(size_t i=0; i<runs.size(); i++)
+			root[i] = findRoot(parent, static_cast<int>(i));
+	}
+
+	// Bounding box of the pixels of mask that are label (empty if there is none)
+	cv::Rect labelBounds(const cv::Mat& mask, uchar label)
+	{
+		std::mutex m;
+		int x0 = mask.cols, x1 = -1, y0 = mask.rows, y1 = -1;
+		forBands(mask.rows, [&](int b0, int b1)
+		{
+			int bx0 = mask.cols, bx1 = -1, by0 = mask.rows, by1 = -1;
+			for(int y=b0; y<b1; y++)
+			{
+				const uchar* row = mask.ptr<uchar>(y);
+				const uchar* f = std::find(row, row + mask.cols, label);
+				if(f == row + mask.cols)
+					continue;
+				const uchar* l = std::find(std::reverse_iterator<const uchar*>(row + mask.cols),
+										   std::reverse_iterator<const uchar*>(row), label).base() - 1;
+				bx0 = std::min(bx0, static_cast<int>(f - row));
+				bx1 = std::max(bx1, static_cast<int>(l - row));
+				by0 = std::min(by0, y);
+				by1 = y;
+			}
+			std::lock_guard<std::mutex> lock(m);
+			x0 = std::min(x0, bx0);
+			x1 = std::max(x1, bx1);
+			y0 = std::min(y0, by0);
+			y1 = std::max(y1, by1);
+		});
+		if(x1 < 0)
+			return cv::Rect();
+		return cv::Rect(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+	}
+}
+
+bool parseCleanup(std::istream& in, labelCleanup& step)
+{
+	int fill;
+	if(!(in >> step.label >> step.open_radius >> step.close_radius >> fill >> step.min_area))
+		return false;
+	step.fill_holes = fill != 0;
+	// The background is what the other labels leave, so it is not cleaned up
+	return step.label >= 1 && step.label <= 255 && step.open_radius >= 0 && step.close_radius >= 0 && step.min_area >= 0;
+}
+
+bool loadCleanups(const std::string& file, std::vector<labelCleanup>& steps, std::string& error)
+{
+	steps.clear();
+	std::ifstream in(file);
+	if(!in)
+	{
+		error = "can not open " + file;
+		return false;
+	}
+
+	std::string line;
+	int n = 0;
+	while(std::getline(in, line))
+	{
+		n++;
+		std::istringstream ss(line);
+		std::string first;
+		if(!(ss >> first) || first[0] == '#')
+			continue;
+
+		labelCleanup step;
+		std::istringstream fields(line);
+		if(!parseCleanup(fields, step))
+		{
+			error = "line " + std::to_string(n) + ": expected <label 1-255> <open_radius> <close_radius> <fill_holes 0|1> <min_area>";
+			return false;
+		}
+		steps.push_back(step);
+	}
+	return true;
+}
+
+cv::Rect cleanLabel(const cv::Mat& mask, const labelCleanup& step, const cv::Rect& bounds, cv::Mat& cleaned)
+{
+	CV_Assert(mask.type() == CV_8UC1);
+	const uchar label = static_cast<uchar>(step.label);
+	cv::Rect whole(0, 0, mask.cols, mask.rows);
+	cv::Rect box = bounds.empty() ? labelBounds(mask, label) : bounds & whole;
+	if(box.empty())
+	{
+		cleaned.release();
+		return cv::Rect();
+	}
+
+	// Nothing is added out of the bounding box, but the closing dilates it 2r before eroding
+	// it back, and the border of the region must be out of both
+	int margin = 2*std::max(step.open_radius, step.close_radius) + 1;
+	cv::Rect roi = cv::Rect(box.x - margin, box.y - margin, box.width + 2*margin, box.height + 2*margin) & whole;
+	mask(roi).copyTo(cleaned);
+	int rows = roi.height, cols = roi.width;
+
+	// bin holds the pixels that have the label (255) while the steps change them
+	cv::Mat bin(roi.size(), CV_8UC1);
+	forBands(rows, [&](int y0, int y1)
+	{
+		for(int y=y0; y<y1; y++)
+		{
+			const uchar* c = cleaned.ptr<uchar>(y);
+			uchar* b = bin.ptr<uchar>(y);
+			for(int x=0; x<cols; x++)
+				b[x] = c[x] == label ? 0xff : 0;
+		}
+	});
+
+	cv::Mat eroded, dilated;
+	if(step.open_radius > 0)
+	{
+		// The opening is inside the label, so the pixels it leaves out become background
+		squareFilter<false>(bin, step.open_radius, eroded);
+		squareFilter<true>(eroded, step.open_radius, dilated);
+		forBands(rows, [&](int y0, int y1)
+		{
+			for(int y=y0; y<y1; y++)
+			{
+				uchar* c = cleaned.ptr<uchar>(y);
+				const uchar* b = bin.ptr<uchar>(y);
+				const uchar* o = dilated.ptr<uchar>(y);
+				for(int x=0; x<cols; x++)
+					c[x] = (b[x] & ~o[x]) ? 0 : c[x];
+			}
+		});
+		std::swap(bin, dilated);
+	}
+
+	if(step.close_radius > 0)
+	{
+		// The closing contains the label, and it only gets the pixels that are background
+		squareFilter<true>(bin, step.close_radius, dilated);
+		squareFilter<false>(dilated, step.close_radius, eroded);
+		forBands(rows, [&](int y0, int y1)
+		{
+			for(int y=y0; y<y1; y++)
+			{
+				uchar* c = cleaned.ptr<uchar>(y);
+				uchar* b = bin.ptr<uchar>(y);
+				const uchar* k = eroded.ptr<uchar>(y);
+				for(int x=0; x<cols; x++)
+				{
+					uchar add = k[x] & ~b[x] & (c[x] == 0 ? 0xff : 0);
+					c[x] = add ? label : c[x];
+					b[x] |= add;
+				}
+			}
+		});
+	}
+
+	std::vector<pixelRun> runs;
+	std::vector<size_t> first;
+	std::vector<int> root;
+	if(step.fill_holes)
+	{
+		// The holes are the (4-connected) components of the rest that do not reach the border
+		// of the region (around the bounding box, the rest is connected to the outside)
+		findRuns(bin, false, runs, first);
+		connectRuns(runs, first, false, root);
+		std::vector<char> outside(runs.size(), 0);
+		for(size_t i=0; i<runs.size(); i++)
+		{
+			const pixelRun& r = runs[i];
+			if(r.y == 0 || r.y == rows - 1 || r.x0 == 0 || r.x1 == cols)
+				outside[root[i]] = 1;
+		}
+		for(size_t i=0; i<runs.size(); i++)
+		{
+			if(outside[root[i]])
+				continue;
+			const pixelRun& r = runs[i];
+			uchar* c = cleaned.ptr<uchar>(r.y);
+			uchar* b = bin.ptr<uchar>(r.y);
+			for(int x=r.x0; x<r.x1; x++)
+			{
+				uchar add = c[x] == 0 ? 0xff : 0;
+				c[x] = add ? label : c[x];
+				b[x] |= add;
+			}
+		}
+	}
+
+	if(step.min_area > 0)
+	{
+		findRuns(bin, true, runs, first);
+		connectRuns(runs, first, true, root);
+		std::vector<long long> area(runs.size(), 0);
+		for(size_t i=0; i<runs.size(); i++)
+			area[root[i]] += runs[i].x1 - runs[i].x0;
+		for(size_t i=0; i<runs.size(); i++)
+			if(area[root[i]] < step.min_area)
+				std::memset(cleaned.ptr<uchar>(runs[i].y) + runs[i].x0, 0, runs[i].x1 - runs[i].x0);
+	}
+	return roi;
+}
@@ -0,0 +1,44 @@
+#ifndef MORPHOLOGY_H
+#define MORPHOLOGY_H
+
+#include <string>
+#include <vector>
+#include <istream>
+
+#include "opencv2/core/core.hpp"
+
+// Struct that holds how the pixels of one label get cleaned up (a threshold leaves them
+// full of specks and pinholes). The steps are applied in this order, and the ones that
+// are 0 (false) are skipped:
+//     open_radius    opening with a square of side 2r+1 (removes the specks and spurs thinner than it)
+//     close_radius   closing with the same square (joins the gaps and pinholes narrower than it)
+//     fill_holes     labels the regions the label encloses
+//     min_area       removes the (8-connected) components of the label with fewer pixels
+// The pixels a step removes become background, and the ones it adds are only taken from
+// the background, so the other labels are never overwritten
+struct labelCleanup
+{
+	int label = 1;
+	int open_radius = 0;
+	int close_radius = 0;
+	bool fill_holes = false;
+	int min_area = 0;
+};
+
+// Reads the fields of a cleanup (as they are written in a cleanup file or a recipe):
+//     <label> <open_radius> <close_radius> <fill_holes 0|1> <min_area>
+// Returns false if they are missing or out of range
+bool parseCleanup(std::istream& in, labelCleanup& step);
+// Reads the cleanup of each label, one per line (empty lines and lines starting with # are
+// ignored). Returns false (and the reason in error) if it is not valid
+bool loadCleanups(const std::string& file, std::vector<labelCleanup>& steps, std::string& error);
+
+// Cleans up the pixels of step.label in mask (CV_8UC1). Only the region around bounds (the
+// bounding box of the label, the whole mask if it is empty) is processed: cleaned gets its
+// new content and the region is returned (empty if the label has no pixels). mask is not
+// changed. The filters are separable passes over contiguous rows, and the image is split
+// in bands of rows that are processed in parallel. The components are found from the runs
+// of the rows, so no per-pixel label image is allocated
+cv::Rect cleanLabel(const cv::Mat& mask, const labelCleanup& step, const cv::Rect& bounds, cv::Mat& cleaned);
+
+#endif
@@ -0,0 +1,108 @@
+#include "navigation.h"
+
+#include "imagecache.h"
+
+navigationCache::navigationCache(size_t byte_budget)
+	: _budget(byte_budget), used(0), counters()
+{
+}
+
+std::shared_ptr<const decodedImage> navigationCache::image(const std::string& name)
+{
+	auto it = entries.find(name);
+	if(it == entries.end() || !it->second.image)
+	{
+		counters.image_misses++;
+		return nullptr;
+	}
+	counters.image_hits++;
+	return touch(name).image;
+}
+
+void navigationCache::putImage(const std::string& name, const decodedImage& decoded)
+{
+	cacheEntry& entry = touch(name);
+	entry.image = std::make_shared<const decodedImage>(decoded);
+	account(entry);
+	evict(name);
+}
+
+bool navigationCache::takeMask(const std::string& name, openMask& mask)
+{
+	auto it = entries.find(name);
+	if(it == entries.end() || !it->second.has_mask)
+	{
+		counters.mask_misses++;
+		return false;
+	}
+	counters.mask_hits++;
+	cacheEntry& entry = touch(name);
+	mask = std::move(entry.mask);
+	entry.mask = openMask();
+	entry.has_mask = false;
+	account(entry);
+	return true;
+}
+
+void navigationCache::putMask(const std::string& name, openMask mask)
+{
+	cacheEntry& entry = touch(name);
+	entry.mask = std::move(mask);
+	entry.has_mask = true;
+	account(entry);
+	evict(name);
+}
+
+navigationCache::navigationStats navigationCache::stats() const
+{
+	navigationStats s = counters;
+	s.images = 0;
+	s.masks = 0;
+	for(const auto& e: entries)
+	{
+		s.images += e.second.image ? 1 : 0;
+		s.masks += e.second.has_mask ? 1 : 0;
+	}
+	s.bytes = used;
+	return s;
+}
+
+navigationCache::cacheEntry& navigationCache::touch(const std::string& name)
+{
+	auto it = entries.find(name);
+	if(it == entries.end())
+	{
+		recent.push_front(name);
+		cacheEntry& entry = entries[name];
+		entry.position = recent.begin();
+		return entry;
+	}
+	recent.splice(recent.begin(), recent, it->second.position);
+	return it->second;
+}
+
+void navigationCache::account(cacheEntry& entry)
+{
+	size_t bytes = entry.image ? decodedBytes(*entry.image) : 0;
+	// A mapped mask lives in the page cache, which the kernel reclaims by itself
+	if(entry.has_mask && !entry.mask.backing)
+		bytes += entry.mask.mask.total();
+	used = used - entry.bytes + bytes;
+	entry.bytes = bytes;
+}
+
+void navigationCache::evict(const std::string& keep)
+{
+	// The entry that has just been used is kept even if it does not fit alone
+	auto it = recent.end();
+	while(used > _budget && it != recent.begin())
+	{
+		--it;
+		if(*it == keep)
+			continue;
+		auto entry = entries.find(*it);
+		used -= entry->second.bytes;
+		entries.erase(entry);
+		it = recent.erase(it);
+	}
+}
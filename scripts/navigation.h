@@ -0,0 +1,82 @@
+#ifndef NAVIGATION_H
+#define NAVIGATION_H
+
+#include <string>
+#include <list>
+#include <map>
+#include <memory>
+
+#include "opencv2/core/core.hpp"
+
+#include "prefetch.h"
+#include "mapped.h"
+#include "labels.h"
+
+// Struct that holds the mask of an image that has been left (with its unsaved edits) and
+// what follows it, so as to it is restored as it was when the image is opened again
+struct openMask
+{
+	cv::Mat mask;
+	std::shared_ptr<mappedFile> backing; // Mapped file of the mask (null if it is in memory)
+	labelStats stats;
+};
+
+// Class that keeps the images that have been visited (decoded, with their channels and
+// pyramids) and the masks they were left with, so as to going back to them (previous,
+// jump...) does not decode nor read anything. The least recently used ones are forgotten
+// when they use more than byte_budget (the unsaved edits of a forgotten mask are still in
+// its journal). It is used by the UI thread only
+class navigationCache
+{
+public:
+	explicit navigationCache(size_t byte_budget);
+
+	// Decoded image (null if it is not cached). It becomes the most recently used
+	std::shared_ptr<const decodedImage> image(const std::string& name);
+	// Keeps a copy of decoded (its mats are shared, not copied)
+	void putImage(const std::string& name, const decodedImage& decoded);
+	// Moves out the mask the image was left with. Returns false if there is none
+	bool takeMask(const std::string& name, openMask& mask);
+	// Keeps the mask an image is left with
+	void putMask(const std::string& name, openMask mask);
+
+	struct navigationStats
+	{
+		long long image_hits; // Images opened without decoding them
+		long long image_misses;
+		long long mask_hits; // Masks restored without reading them
+		long long mask_misses;
+		int images; // Images and masks kept
+		int masks;
+		size_t bytes; // Memory they use
+	};
+	navigationStats stats() const;
+
+	navigationCache(const navigationCache&) = delete;
+	navigationCache& operator=(const navigationCache&) = delete;
+
+private:
+	struct cacheEntry
+	{
+		std::shared_ptr<const decodedImage> image;
+		bool has_mask = false;
+		openMask mask;
+		size_t bytes = 0;
+		std::list<std::string>::iterator position; // In recent
+	};
+
+	// Makes name the most recently used one (creating its entry if needed)
+	cacheEntry& touch(const std::string& name);
+	// Updates the bytes of an entry
+	void account(cacheEntry& entry);
+	// Forgets the least recently used entries (but keep) until they fit the budget
+	void evict(const std::string& keep);
+
+	size_t _budget;
+	size_t used;
+	std::map<std::string, cacheEntry> entries;
+	std::list<std::string> recent; // The most recently used at the front
+	navigationStats counters;
+};
+
+#endif
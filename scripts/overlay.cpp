@@ -0,0 +1,94 @@
+#include "overlay.h"
+
+#include <cstdint>
+
+namespace
+{
+	// Palette in the form the kernel uses: out = (in*inv[l] + premul[l]) >> 8, so as to
+	// every label (transparent, opaque or blended) goes through the same branchless code
+	struct blendTable
+	{
+		uint16_t inv[256];
+		uint16_t premul[256][3];
+	};
+
+	void buildBlendTable(const labelPalette& palette, blendTable& table)
+	{
+		for(int l=0; l<256; l++)
+		{
+			// I scale alpha from [0,255] to [0,256] so as to 255 gives the exact color
+			int a = palette.alpha[l] + (palette.alpha[l] >> 7);
+			table.inv[l] = static_cast<uint16_t>(256 - a);
+			for(int k=0; k<3; k++)
+				table.premul[l][k] = static_cast<uint16_t>(palette.color[l][k]*a + (a < 256 ? 128 : 0));
+		}
+	}
+
+	void overlayRowBGR(const uchar* __restrict src, const uchar* __restrict labels,
+					   uchar* __restrict dst, int width, const blendTable& t)
+	{
+		for(int x=0; x<width; x++)
+		{
+			uchar l = labels[x];
+			uint32_t inv = t.inv[l];
+			dst[3*x]     = static_cast<uchar>((src[3*x]*inv     + t.premul[l][0]) >> 8);
+			dst[3*x + 1] = static_cast<uchar>((src[3*x + 1]*inv + t.premul[l][1]) >> 8);
+			dst[3*x + 2] = static_cast<uchar>((src[3*x + 2]*inv + t.premul[l][2]) >> 8);
+		}
+	}
+
+	void overlayRowGray(const uchar* __restrict src, const uchar* __restrict labels,
+						uchar* __restrict dst, int width, const blendTable& t)
+	{
+		// The gray value is expanded to BGR in the same pass
+		for(int x=0; x<width; x++)
+		{
+			uchar l = labels[x];
+			uint32_t v = src[x]*static_cast<uint32_t>(t.inv[l]);
+			dst[3*x]     = static_cast<uchar>((v + t.premul[l][0]) >> 8);
+			dst[3*x + 1] = static_cast<uchar>((v + t.premul[l][1]) >> 8);
+			dst[3*x + 2] = static_cast<uchar>((v + t.premul[l][2]) >> 8);
+		}
+	}
+}
+
+void clearPalette(labelPalette& palette)
+{
+	for(int l=0; l<256; l++)
+	{
+		palette.color[l] = cv::Vec3b(0, 0, 0);
+		palette.alpha[l] = 0;
+	}
+}
+
+void setPaletteLabel(labelPalette& palette, int label, const cv::Scalar& color, int alpha)
+{
+	palette.color[label] = cv::Vec3b(static_cast<uchar>(color[0]), static_cast<uchar>(color[1]),
+									 static_cast<uchar>(color[2]));
+	palette.alpha[label] = static_cast<uchar>(alpha);
+}
+
+void overlayLabels(const cv::Mat& src, const cv::Mat& labels, const labelPalette& palette, cv::Mat& dst)
+{
+	CV_Assert(labels.type() == CV_8UC1 && src.size() == labels.size());
+	CV_Assert(src.type() == CV_8UC1 || src.type() == CV_8UC3);
+
+	blendTable table;
+	buildBlendTable(palette, table);
+
+	dst.create(src.size(), CV_8UC3);
+	bool gray = src.channels() == 1;
+
+	// The rows are split among the OpenCV threads. Each pixel is read and written once,
+	// and no temporary cv::Mat is created
+	cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range& range)
+	{
+		for(int y=range.start; y<range.end; y++)
+		{
+			if(gray)
+				overlayRowGray(src.ptr<uchar>(y), labels.ptr<uchar>(y), dst.ptr<uchar>(y), src.cols, table);
+			else
+				overlayRowBGR(src.ptr<uchar>(y), labels.ptr<uchar>(y), dst.ptr<uchar>(y), src.cols, table);
+		}
+	});
+}
@@ -0,0 +1,23 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include "opencv2/core/core.hpp"
+
+// Struct that maps each value of a label image to the color it is drawn with and to
+// its opacity (0 means that the label is not drawn, 255 that it replaces the image)
+struct labelPalette
+{
+	cv::Vec3b color[256];
+	uchar alpha[256];
+};
+
+// Sets every label of the palette to transparent
+void clearPalette(labelPalette& palette);
+// Sets the color (BGR) and the opacity of one label
+void setPaletteLabel(labelPalette& palette, int label, const cv::Scalar& color, int alpha);
+
+// Composites src (gray or BGR) with the labels (CV_8UC1, same size) in a single pass:
+// each pixel gets blended with the palette entry of its label. dst is BGR
+void overlayLabels(const cv::Mat& src, const cv::Mat& labels, const labelPalette& palette, cv::Mat& dst);
+
+#endif
@@ -0,0 +1,266 @@
+#include "prefetch.h"
+
+#include <iostream>
+#include <filesystem>
+#include <functional>
+
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/imgcodecs/imgcodecs.hpp"
+
+#include "trace.h"
+
+namespace
+{
+	// Points decoded to the planes of its mapped cache. Returns false if there is no valid cache
+	bool loadMapped(const std::string& _path, decodedImage& decoded)
+	{
+		std::vector<mappedPlane> planes;
+		std::shared_ptr<mappedFile> file;
+		if(!mapPlanes(decoded.cache_base + ".map", _path, planes, file))
+			return false;
+
+		// Group 0 holds the levels of the image and group 1+i the ones of the channel i
+		std::vector<std::vector<cv::Mat>> groups;
+		for(const auto& plane: planes)
+		{
+			if(plane.group < 0 || plane.level < 0)
+				return false;
+			if(static_cast<int>(groups.size()) <= plane.group)
+				groups.resize(plane.group + 1);
+			if(static_cast<int>(groups[plane.group].size()) <= plane.level)
+				groups[plane.group].resize(plane.level + 1);
+			groups[plane.group][plane.level] = plane.mat;
+		}
+		if(groups.size() < 2)
+			return false;
+		for(const auto& levels: groups)
+			for(const auto& level: levels)
+				if(level.empty())
+					return false;
+
+		decoded.image = groups[0][0];
+		decoded.pyramid.adopt(groups[0]);
+		decoded.channels.clear();
+		decoded.channel_pyramids.assign(groups.size() - 1, imagePyramid());
+		for(size_t i=1; i<groups.size(); i++)
+		{
+			decoded.channels.push_back(groups[i][0]);
+			decoded.channel_pyramids[i - 1].adopt(groups[i]);
+		}
+		decoded.backing = file;
+		return true;
+	}
+
+	// Writes the image, its channels and their pyramids to the cache
+	bool storeMapped(const std::string& _path, const decodedImage& decoded)
+	{
+		std::vector<mappedPlane> planes;
+		const std::vector<cv::Mat>& image_levels = decoded.pyramid.levels();
+		for(size_t l=0; l<image_levels.size(); l++)
+			planes.push_back({0, static_cast<int>(l), image_levels[l]});
+		for(size_t i=0; i<decoded.channel_pyramids.size(); i++)
+		{
+			const std::vector<cv::Mat>& levels = decoded.channel_pyramids[i].levels();
+			for(size_t l=0; l<levels.size(); l++)
+				planes.push_back({static_cast<int>(i + 1), static_cast<int>(l), levels[l]});
+		}
+		return writeMappedPlanes(decoded.cache_base + ".map", _path, planes);
+	}
+}
+
+std::string cacheBase(const std::string& cache_dir, const std::string& _path)
+{
+	std::filesystem::path file(_path);
+	return cache_dir + std::to_string(std::hash<std::string>()(file.parent_path().string())) + "_" + file.filename().string();
+}
+
+bool decodeImage(const std::string& _path, decodedImage& decoded, const decodeOptions& options)
+{
+	TRACE_SCOPE("decodeImage");
+	decoded.ok = false;
+	decoded.planes.reset();
+	decoded.backing.reset();
+	decoded.cache_base.clear();
+
+	decoded.file = _path;
+
+	// If there is a valid cache of the image, I map it instead of decoding it
+	if(!options.cache_dir.empty())
+	{
+		decoded.cache_base = cacheBase(options.cache_dir, _path);
+		if(loadMapped(_path, decoded))
+		{
+			decoded.planes = std::make_shared<channelProvider>(decoded.image, decoded.channels, decoded.channel_pyramids,
+															   decoded.backing, options.warm_size);
+			decoded.ok = true;
+			return true;
+		}
+	}
+
+	decoded.image = cv::imread(_path);
+	// If I have not read an image, I leave it as failed
+	if(decoded.image.cols <= 0)
+	{
+		decoded.image.release();
+		decoded.channels.clear();
+		decoded.pyramid.reset(cv::Mat());
+		decoded.channel_pyramids.clear();
+		return false;
+	}
+
+	// I get the RGB channels
+	cv::Mat aux;
+	cv::cvtColor(decoded.image, aux, cv::COLOR_BGR2RGB);
+	cv::split(aux, decoded.channels);
+
+	// I prepare the pyramids (only the levels the display needs are built now)
+	decoded.pyramid.reset(decoded.image);
+	decoded.channel_pyramids.assign(decoded.channels.size(), imagePyramid());
+	for(size_t i=0; i<decoded.channels.size(); i++)
+		decoded.channel_pyramids[i].reset(decoded.channels[i]);
+	if(options.warm_size.width > 0 && options.warm_size.height > 0)
+	{
+		decoded.pyramid.warm(options.warm_size);
+		for(auto& pyramid: decoded.channel_pyramids)
+			pyramid.warm(options.warm_size);
+	}
+
+	// If the image is big, I cache it and I replace the decoded buffers by the mapped ones,
+	// so as to only the displayed part of it stays in memory
+	if(!decoded.cache_base.empty() && static_cast<long long>(decoded.image.total()) >= options.map_min_pixels)
+	{
+		std::error_code ec;
+		std::filesystem::create_directories(options.cache_dir, ec);
+		if(!storeMapped(_path, decoded) || !loadMapped(_path, decoded))
+			std::cerr << "Could not cache " << _path << std::endl;
+	}
+	if(!decoded.backing)
+		decoded.cache_base.clear();
+
+	decoded.planes = std::make_shared<channelProvider>(decoded.image, decoded.channels, decoded.channel_pyramids,
+													   decoded.backing, options.warm_size);
+	decoded.ok = true;
+	return true;
+}
+
+imagePrefetcher::imagePrefetcher(const std::string& path, const utils::imageList& images,
+								 int depth, int n_workers, const decodeOptions& options)
+	: _path(path), _images(images), _depth(depth > 0 ? depth : 1), _options(options), window_start(0), stop(false)
+{
+	if(n_workers < 1)
+		n_workers = 1;
+	for(int i=0; i<n_workers; i++)
+		workers.emplace_back(&imagePrefetcher::worker, this);
+}
+
+imagePrefetcher::~imagePrefetcher()
+{
+	// I wake up every worker and I wait for them to finish their current decode
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		stop = true;
+		pending.clear();
+	}
+	work_cv.notify_all();
+	done_cv.notify_all();
+
+	for(auto& w: workers)
+		w.join();
+}
+
+bool imagePrefetcher::inWindow(int idx) const
+{
+	return idx >= window_start && idx < window_start + _depth;
+}
+
+void imagePrefetcher::prefetchFrom(int idx)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		window_start = idx;
+
+		// I forget the decoded images that are outside the new window
+		for(auto it = ready.begin(); it != ready.end();)
+		{
+			if(!inWindow(it->first))
+				it = ready.erase(it);
+			else
+				it++;
+		}
+
+		// I schedule the ones that are neither decoded nor being decoded
+		pending.clear();
+		int n = static_cast<int>(_images.size());
+		for(int i=idx; i<idx+_depth && i<n; i++)
+		{
+			if(ready.count(i) == 0 && in_flight.count(i) == 0)
+				pending.push_back(i);
+		}
+	}
+	work_cv.notify_all();
+}
+
+bool imagePrefetcher::take(int idx, decodedImage& decoded)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	// If it is being decoded, I wait for the worker
+	done_cv.wait(lock, [&]{ return stop || ready.count(idx) > 0 || in_flight.count(idx) == 0; });
+
+	auto it = ready.find(idx);
+	if(it != ready.end())
+	{
+		decoded = std::move(it->second);
+		ready.erase(it);
+		return decoded.ok;
+	}
+
+	// It had not been scheduled (or it was still waiting in the queue), so I decode it here
+	for(auto p = pending.begin(); p != pending.end(); p++)
+	{
+		if(*p == idx)
+		{
+			pending.erase(p);
+			break;
+		}
+	}
+	std::string file = _path + _images.at(idx);
+	lock.unlock();
+
+	decoded.index = idx;
+	return decodeImage(file, decoded, _options);
+}
+
+void imagePrefetcher::worker()
+{
+	while(true)
+	{
+		int idx;
+		std::string file;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			work_cv.wait(lock, [&]{ return stop || !pending.empty(); });
+			if(stop)
+				return;
+
+			idx = pending.front();
+			pending.pop_front();
+			in_flight.insert(idx);
+			file = _path + _images.at(idx);
+		}
+
+		decodedImage decoded;
+		decoded.index = idx;
+		if(!decodeImage(file, decoded, _options))
+			std::cerr << "Could not decode " << file << std::endl;
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			in_flight.erase(idx);
+			// If the window has moved while I was decoding, I throw the result away
+			if(inWindow(idx))
+				ready[idx] = std::move(decoded);
+		}
+		done_cv.notify_all();
+	}
+}
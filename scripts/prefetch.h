@@ -0,0 +1,97 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "opencv2/core/core.hpp"
+
+#include "utils.h"
+#include "pyramid.h"
+#include "mapped.h"
+#include "channels.h"
+
+// Struct that holds an image that has already been decoded (and whose channels have
+// already been split), so as to swap it in without touching the disk
+struct decodedImage
+{
+	int index; // idx of the image in data::Images
+	bool ok; // false when the image could not be read
+	cv::Mat image; // The decoded BGR image
+	std::vector<cv::Mat> channels; // Its RGB channels
+	imagePyramid pyramid; // Reduced versions of image
+	std::vector<imagePyramid> channel_pyramids; // Reduced versions of each channel
+	std::shared_ptr<channelProvider> planes; // Every plane (RGB and the converted ones) of the image
+	std::shared_ptr<mappedFile> backing; // Mapped cache the mats point to (null if they are in memory)
+	std::string cache_base; // Path (without extension) of the cache files of the image
+	std::string file; // Path of the image
+};
+
+// Struct that holds how the images get decoded
+struct decodeOptions
+{
+	cv::Size warm_size; // Size at which the images will be displayed (the pyramids are built for it)
+	std::string cache_dir; // Directory where big images get cached and mapped (none if empty)
+	long long map_min_pixels = 0; // Images with at least these pixels get mapped instead of kept in memory
+};
+
+// Path (without extension) of the cache files of the image at _path inside cache_dir. The
+// images may be in different subfolders with the same name, so it takes the hash of the
+// whole path too
+std::string cacheBase(const std::string& cache_dir, const std::string& _path);
+
+// Function that reads the image at _path, splits its channels and builds the pyramid
+// levels needed to display them at options.warm_size. Big images are written once to a
+// cache file that gets mapped (the next times the image is not even decoded). Returns
+// false (and leaves decoded.ok to false) if the image could not be read
+bool decodeImage(const std::string& _path, decodedImage& decoded, const decodeOptions& options = decodeOptions());
+
+// Class that decodes the next images of the list on worker threads, so as to the
+// NEXT IMAGE button only has to swap in a buffer that is already prepared
+class imagePrefetcher
+{
+public:
+	// path and images are the same that are used by main.cpp (images may still be growing
+	// while the directory gets scanned), depth is the number of images
+	// decoded ahead of the current one, n_workers the number of decoding threads and
+	// options how they get decoded
+	imagePrefetcher(const std::string& path, const utils::imageList& images, int depth, int n_workers,
+					const decodeOptions& options = decodeOptions());
+	~imagePrefetcher();
+
+	// Schedules the decoding of the images [idx, idx+depth) and forgets the ones outside it
+	void prefetchFrom(int idx);
+	// Gets the image idx, waiting for it if it is being decoded or decoding it right here
+	// if it had not been scheduled. Returns decoded.ok
+	bool take(int idx, decodedImage& decoded);
+
+private:
+	// Inf. loop run by every worker thread
+	void worker();
+	// Whether idx is inside the current prefetch window (the mutex must be held)
+	bool inWindow(int idx) const;
+
+	std::string _path; // Directory of the images
+	const utils::imageList& _images; // Image list (owned by data)
+	int _depth; // Number of images decoded ahead
+	decodeOptions _options; // How the images get decoded
+	int window_start; // First idx of the current prefetch window
+
+	std::deque<int> pending; // Indexes waiting for a worker
+	std::set<int> in_flight; // Indexes that are being decoded right now
+	std::map<int, decodedImage> ready; // Decoded images (they may complete out of order)
+
+	std::mutex _mutex;
+	std::condition_variable work_cv; // Workers wait here for new indexes
+	std::condition_variable done_cv; // take() waits here for a decode to finish
+	bool stop;
+	std::vector<std::thread> workers;
+};
+
+#endif
@@ -0,0 +1,108 @@
+#include "presenter.h"
+
+#include <chrono>
+
+#include "trace.h"
+
+framePresenter::framePresenter()
+	: front(0), frame_version(0), acquired_version(0), in_use(false), shown(0), stop(false)
+{
+	frame_interaction[0] = frame_interaction[1] = 0;
+}
+
+void framePresenter::submit(const cv::Mat& canvas, const cv::Rect& dirty)
+{
+	TRACE_SCOPE("present/submit");
+	unsigned long interaction = traceFrameSubmitted();
+	cv::Rect full(0, 0, canvas.cols, canvas.rows);
+	int back;
+	cv::Rect region;
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		back = 1 - front;
+		// If the display_thread is still showing the back buffer (it was the front one
+		// before the last swap), I wait for it
+		{
+			TRACE_SCOPE("present/wait");
+			free_cv.wait(lock, [&]{ return stop || !in_use || shown != back; });
+		}
+		if(stop)
+			return;
+
+		// If the canvas has changed its size, the whole buffer is out of date
+		if(buffers[back].size() != canvas.size() || buffers[back].type() != canvas.type())
+		{
+			buffers[back].create(canvas.size(), canvas.type());
+			stale[back] = full;
+		}
+		region = (stale[back].empty() ? dirty : (stale[back] | dirty)) & full;
+	}
+
+	// I copy outside the lock, the display_thread never reads the back buffer
+	if(!region.empty())
+		canvas(region).copyTo(buffers[back](region));
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		stale[back] = cv::Rect();
+		// The old front buffer has not got the region that has just been written
+		stale[front] = stale[front].empty() ? (dirty & full) : ((stale[front] | dirty) & full);
+		front = back;
+		frame_interaction[front] = interaction;
+		frame_version++;
+	}
+	frame_cv.notify_all();
+}
+
+bool framePresenter::acquire(unsigned long& version, int timeout_ms, cv::Mat& frame)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	bool fresh = frame_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+								   [&]{ return stop || frame_version != version; });
+	if(!fresh || stop)
+		return false;
+
+	version = frame_version;
+	acquired_version = frame_version;
+	shown = front;
+	in_use = true;
+	frame = buffers[front];
+	return true;
+}
+
+void framePresenter::release()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		in_use = false;
+	}
+	free_cv.notify_all();
+}
+
+unsigned long framePresenter::interaction()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return frame_interaction[shown];
+}
+
+bool framePresenter::waiting()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return frame_version != acquired_version;
+}
+
+void framePresenter::shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		stop = true;
+	}
+	frame_cv.notify_all();
+	free_cv.notify_all();
+}
+
+bool framePresenter::stopped()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return stop;
+}
@@ -0,0 +1,52 @@
+#ifndef PRESENTER_H
+#define PRESENTER_H
+
+#include <mutex>
+#include <condition_variable>
+
+#include "opencv2/core/core.hpp"
+
+// Class that hands the composited frames from the editing code to the display_thread.
+// It holds a front buffer (the one the display_thread shows) and a back buffer (the one
+// that gets written), so as to the display_thread never waits for a copy and the editing
+// code never waits for cv::imshow. Only one thread must call submit()
+class framePresenter
+{
+public:
+	framePresenter();
+
+	// Writes the region dirty of canvas to the back buffer and swaps the buffers. Only the
+	// regions of the back buffer that are out of date get copied
+	void submit(const cv::Mat& canvas, const cv::Rect& dirty);
+	// Waits up to timeout_ms for a frame newer than version. If there is one, frame points
+	// to it (no copy), version gets updated and it returns true. release() must be called
+	// once the frame has been displayed
+	bool acquire(unsigned long& version, int timeout_ms, cv::Mat& frame);
+	void release();
+	// Interaction (trace.h) that submitted the frame returned by the last acquire()
+	unsigned long interaction();
+	// Whether the last submitted frame has not been acquired yet (a new submit would
+	// replace it before it is shown)
+	bool waiting();
+
+	// Wakes up the display_thread and makes stopped() return true
+	void shutdown();
+	bool stopped();
+
+private:
+	cv::Mat buffers[2];
+	cv::Rect stale[2]; // Region of each buffer that has not been updated yet
+	int front; // idx of the front buffer
+	unsigned long frame_version; // Increased with each submitted frame
+	unsigned long acquired_version; // Version returned by the last acquire()
+	unsigned long frame_interaction[2]; // Interaction that submitted each buffer (0 if none or not tracing)
+	bool in_use; // Whether the display_thread is showing buffers[shown]
+	int shown;
+	bool stop;
+
+	std::mutex _mutex;
+	std::condition_variable frame_cv; // The display_thread waits here for new frames
+	std::condition_variable free_cv; // submit() waits here for the display_thread to release a buffer
+};
+
+#endif
@@ -0,0 +1,68 @@
+#include "pyramid.h"
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+imagePyramid::imagePyramid()
+{
+}
+
+void imagePyramid::reset(const cv::Mat& base)
+{
+	_levels.clear();
+	if(!base.empty())
+		_levels.push_back(base);
+}
+
+void imagePyramid::adopt(const std::vector<cv::Mat>& levels)
+{
+	_levels = levels;
+}
+
+const std::vector<cv::Mat>& imagePyramid::levels() const
+{
+	return _levels;
+}
+
+bool imagePyramid::empty() const
+{
+	return _levels.empty();
+}
+
+const cv::Mat& imagePyramid::levelFor(const cv::Size& size)
+{
+	CV_Assert(!_levels.empty());
+
+	size_t k = 0;
+	while(true)
+	{
+		// The next level would be half the current one. If it is smaller than the
+		// requested size, the current level is the one
+		const cv::Mat& current = _levels[k];
+		if((current.cols + 1)/2 < size.width || (current.rows + 1)/2 < size.height)
+			return _levels[k];
+
+		if(k + 1 == _levels.size())
+		{
+			cv::Mat next;
+			cv::pyrDown(current, next);
+			_levels.push_back(next);
+		}
+		k++;
+	}
+}
+
+void imagePyramid::warm(const cv::Size& size)
+{
+	if(!_levels.empty())
+		levelFor(size);
+}
+
+const cv::Mat& imagePyramid::base() const
+{
+	return _levels.front();
+}
+
+int imagePyramid::builtLevels() const
+{
+	return static_cast<int>(_levels.size());
+}
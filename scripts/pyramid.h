@@ -0,0 +1,38 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+// Class that holds an image together with its versions of half, a quarter... of its size.
+// The levels are built lazily (only the ones that get asked for), and the displayed
+// image is resized from the smallest level that is still bigger than the display
+class imagePyramid
+{
+public:
+	imagePyramid();
+
+	// Sets the full resolution image (level 0) and forgets the other levels
+	void reset(const cv::Mat& base);
+	// Sets every level at once (levels[0] is the full resolution image), for instance
+	// when they have been read from a cache
+	void adopt(const std::vector<cv::Mat>& levels);
+	// Every level built so far
+	const std::vector<cv::Mat>& levels() const;
+	bool empty() const;
+
+	// Returns the smallest level whose both sides are at least as big as size (level 0
+	// if the image is smaller), building the levels above it if needed
+	const cv::Mat& levelFor(const cv::Size& size);
+	// Builds in advance the levels that levelFor(size) would need
+	void warm(const cv::Size& size);
+
+	const cv::Mat& base() const;
+	int builtLevels() const;
+
+private:
+	std::vector<cv::Mat> _levels; // _levels[k] has 1/2^k the size of _levels[0]
+};
+
+#endif
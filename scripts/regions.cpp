@@ -0,0 +1,346 @@
+#include "regions.h"
+
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "prefetch.h"
+#include "trace.h"
+
+namespace
+{
+	// Coordinate of the image where the coordinate v of the level starts (the pixels of the
+	// level cover consecutive ranges of the image, without gaps nor overlaps)
+	int toFull(int v, int level_size, int full_size)
+	{
+		return static_cast<int>(static_cast<long long>(v)*full_size/level_size);
+	}
+
+	// Gives the watershed lines (-1) the region of a neighbour
+	void fillBoundaries(cv::Mat& labels)
+	{
+		bool left = true;
+		while(left)
+		{
+			left = false;
+			// Forward pass (left and up neighbours), then backward pass (right and down)
+			for(int y=0; y<labels.rows; y++)
+			{
+				int* row = labels.ptr<int>(y);
+				const int* up = y > 0 ? labels.ptr<int>(y - 1) : nullptr;
+				for(int x=0; x<labels.cols; x++)
+				{
+					if(row[x] > 0)
+						continue;
+					if(x > 0 && row[x - 1] > 0)
+						row[x] = row[x - 1];
+					else if(up && up[x] > 0)
+						row[x] = up[x];
+				}
+			}
+			for(int y=labels.rows-1; y>=0; y--)
+			{
+				int* row = labels.ptr<int>(y);
+				const int* down = y + 1 < labels.rows ? labels.ptr<int>(y + 1) : nullptr;
+				for(int x=labels.cols-1; x>=0; x--)
+				{
+					if(row[x] > 0)
+						continue;
+					if(x + 1 < labels.cols && row[x + 1] > 0)
+						row[x] = row[x + 1];
+					else if(down && down[x] > 0)
+						row[x] = down[x];
+					else
+						left = true;
+				}
+			}
+		}
+	}
+}
+
+int regionIndex::size() const
+{
+	return boxes.rows;
+}
+
+int regionIndex::regionAt(const cv::Point& p) const
+{
+	if(labels.empty() || p.x < 0 || p.y < 0 || p.x >= full.width || p.y >= full.height)
+		return -1;
+	int x = static_cast<int>(static_cast<long long>(p.x)*labels.cols/full.width);
+	int y = static_cast<int>(static_cast<long long>(p.y)*labels.rows/full.height);
+	return labels.at<int>(y, x);
+}
+
+cv::Rect regionIndex::bounds(int region) const
+{
+	if(region < 0 || region >= size())
+		return cv::Rect();
+	const int* b = boxes.ptr<int>(region);
+	return cv::Rect(b[0], b[1], b[2], b[3]);
+}
+
+void regionIndex::paint(int region, cv::Mat& mask, uchar value) const
+{
+	if(region < 0 || region >= size() || mask.size() != full)
+		return;
+	const int* o = offsets.ptr<int>(0);
+	for(int r=o[region]; r<o[region + 1]; r++)
+	{
+		const int* run = runs.ptr<int>(r);
+		int y0 = toFull(run[0], labels.rows, full.height), y1 = toFull(run[0] + 1, labels.rows, full.height);
+		int x0 = toFull(run[1], labels.cols, full.width), x1 = toFull(run[2], labels.cols, full.width);
+		for(int y=y0; y<y1; y++)
+			std::fill(mask.ptr<uchar>(y) + x0, mask.ptr<uchar>(y) + x1, value);
+	}
+}
+
+bool buildRegionIndex(const cv::Mat& level, const cv::Size& full, int region_size, regionIndex& index)
+{
+	TRACE_SCOPE("buildRegionIndex");
+	if(level.empty() || full.width < level.cols || full.height < level.rows)
+		return false;
+	cv::Mat bgr;
+	if(level.type() == CV_8UC3)
+		bgr = level;
+	else if(level.type() == CV_8UC1)
+		cv::cvtColor(level, bgr, cv::COLOR_GRAY2BGR);
+	else
+		return false;
+
+	// I flood the image from a grid of seeds (the watershed needs a border of one pixel,
+	// so tiny images are a single region)
+	cv::Mat labels(bgr.size(), CV_32S, cv::Scalar(1));
+	if(bgr.rows >= 3 && bgr.cols >= 3)
+	{
+		int step = std::max(region_size, 3);
+		labels.setTo(cv::Scalar(0));
+		int n = 0;
+		for(int y=std::min(step/2, bgr.rows - 2); y<bgr.rows-1; y+=step)
+			for(int x=std::min(step/2, bgr.cols - 2); x<bgr.cols-1; x+=step)
+				labels.at<int>(y, x) = ++n;
+		cv::watershed(bgr, labels);
+		fillBoundaries(labels);
+	}
+
+	// The seeds that the watershed has swallowed leave gaps, so I renumber the regions
+	// from 0 and I count the runs of each one
+	std::vector<int> renumber;
+	std::vector<int> n_runs;
+	for(int y=0; y<labels.rows; y++)
+	{
+		int* row = labels.ptr<int>(y);
+		for(int x=0; x<labels.cols; x++)
+		{
+			int l = row[x];
+			if(static_cast<int>(renumber.size()) <= l)
+				renumber.resize(l + 1, -1);
+			if(renumber[l] < 0)
+			{
+				renumber[l] = static_cast<int>(n_runs.size());
+				n_runs.push_back(0);
+			}
+			row[x] = renumber[l];
+			if(x == 0 || row[x] != row[x - 1])
+				n_runs[row[x]]++;
+		}
+	}
+
+	int n = static_cast<int>(n_runs.size());
+	index.labels = labels;
+	index.full = full;
+	index.backing.reset();
+	index.offsets.create(1, n + 1, CV_32S);
+	int* o = index.offsets.ptr<int>(0);
+	o[0] = 0;
+	for(int i=0; i<n; i++)
+		o[i + 1] = o[i] + n_runs[i];
+	index.runs.create(o[n], 3, CV_32S);
+
+	// I store the runs of each region and I grow its bounding box (in level coordinates)
+	std::vector<int> next(o, o + n);
+	std::vector<cv::Rect> level_boxes(n);
+	for(int y=0; y<labels.rows; y++)
+	{
+		const int* row = labels.ptr<int>(y);
+		int x0 = 0;
+		for(int x=1; x<=labels.cols; x++)
+		{
+			if(x < labels.cols && row[x] == row[x0])
+				continue;
+			int l = row[x0];
+			int* run = index.runs.ptr<int>(next[l]++);
+			run[0] = y;
+			run[1] = x0;
+			run[2] = x;
+			cv::Rect r(x0, y, x - x0, 1);
+			level_boxes[l] = level_boxes[l].empty() ? r : (level_boxes[l] | r);
+			x0 = x;
+		}
+	}
+
+	index.boxes.create(n, 4, CV_32S);
+	for(int i=0; i<n; i++)
+	{
+		const cv::Rect& r = level_boxes[i];
+		int x0 = toFull(r.x, labels.cols, full.width), x1 = toFull(r.x + r.width, labels.cols, full.width);
+		int y0 = toFull(r.y, labels.rows, full.height), y1 = toFull(r.y + r.height, labels.rows, full.height);
+		int* b = index.boxes.ptr<int>(i);
+		b[0] = x0;
+		b[1] = y0;
+		b[2] = x1 - x0;
+		b[3] = y1 - y0;
+	}
+	return true;
+}
+
+bool storeRegionIndex(const std::string& file, const std::string& source, const regionIndex& index)
+{
+	cv::Mat full(1, 2, CV_32S);
+	full.at<int>(0, 0) = index.full.height;
+	full.at<int>(0, 1) = index.full.width;
+	std::vector<mappedPlane> planes = {{0, 0, index.labels}, {1, 0, index.offsets}, {2, 0, index.runs},
+									   {3, 0, index.boxes}, {4, 0, full}};
+	return writeMappedPlanes(file, source, planes);
+}
+
+bool loadRegionIndex(const std::string& file, const std::string& source, regionIndex& index)
+{
+	std::vector<mappedPlane> planes;
+	std::shared_ptr<mappedFile> backing;
+	if(!mapPlanes(file, source, planes, backing) || planes.size() != 5)
+		return false;
+	for(size_t i=0; i<planes.size(); i++)
+		if(planes[i].group != static_cast<int>(i) || planes[i].mat.type() != CV_32S)
+			return false;
+
+	const cv::Mat& full = planes[4].mat;
+	const cv::Mat& offsets = planes[1].mat;
+	int n = planes[3].mat.rows;
+	if(full.total() != 2 || offsets.rows != 1 || offsets.cols != n + 1 || planes[2].mat.cols != 3)
+		return false;
+
+	index.labels = planes[0].mat;
+	index.offsets = offsets;
+	index.runs = planes[2].mat;
+	index.boxes = planes[3].mat;
+	index.full = cv::Size(full.at<int>(0, 1), full.at<int>(0, 0));
+	index.backing = backing;
+	return true;
+}
+
+regionIndexer::regionIndexer(int region_size, long long max_pixels, const std::string& cache_dir, int keep)
+	: _region_size(region_size), _max_pixels(max_pixels), _cache_dir(cache_dir), _keep(keep > 0 ? keep : 1), stop(false)
+{
+	thread = std::thread(&regionIndexer::worker, this);
+}
+
+regionIndexer::~regionIndexer()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		stop = true;
+		pending.clear();
+	}
+	work_cv.notify_all();
+	done_cv.notify_all();
+	thread.join();
+}
+
+void regionIndexer::request(const std::string& file, const imagePyramid& pyramid)
+{
+	if(pyramid.empty())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if(scheduled.count(file))
+			return;
+		for(const auto& r: ready)
+			if(r.first == file)
+				return;
+	}
+
+	// I take the biggest level that has been built with at most max_pixels (or the smallest
+	// one). It gets copied, as the pyramid may be mapped from a file that will be unmapped
+	const std::vector<cv::Mat>& levels = pyramid.levels();
+	size_t l = 0;
+	while(l + 1 < levels.size() && static_cast<long long>(levels[l].total()) > _max_pixels)
+		l++;
+	regionRequest r{file, levels[l].clone(), pyramid.base().size()};
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if(!scheduled.insert(file).second)
+			return;
+		pending.push_back(std::move(r));
+	}
+	work_cv.notify_one();
+}
+
+std::shared_ptr<const regionIndex> regionIndexer::get(const std::string& file)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	done_cv.wait(lock, [&]{ return stop || scheduled.count(file) == 0; });
+	for(const auto& r: ready)
+		if(r.first == file)
+			return r.second;
+	return nullptr;
+}
+
+void regionIndexer::keepIndex(const std::string& file, const std::shared_ptr<const regionIndex>& index)
+{
+	for(auto it = ready.begin(); it != ready.end(); it++)
+	{
+		if(it->first == file)
+		{
+			ready.erase(it);
+			break;
+		}
+	}
+	ready.emplace_back(file, index);
+	while(static_cast<int>(ready.size()) > _keep)
+		ready.pop_front();
+}
+
+void regionIndexer::worker()
+{
+	while(true)
+	{
+		regionRequest r;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			work_cv.wait(lock, [&]{ return stop || !pending.empty(); });
+			if(stop)
+				return;
+			r = std::move(pending.front());
+			pending.pop_front();
+		}
+
+		// If the image has been indexed before, its index is mapped from the cache
+		std::shared_ptr<regionIndex> index = std::make_shared<regionIndex>();
+		std::string cache_file;
+		if(!_cache_dir.empty())
+			cache_file = cacheBase(_cache_dir, r.file) + ".regions" + std::to_string(_region_size);
+		bool ok = !cache_file.empty() && loadRegionIndex(cache_file, r.file, *index) && index->full == r.full;
+		if(!ok && buildRegionIndex(r.level, r.full, _region_size, *index))
+		{
+			ok = true;
+			if(!cache_file.empty())
+			{
+				std::error_code ec;
+				std::filesystem::create_directories(_cache_dir, ec);
+				if(!storeRegionIndex(cache_file, r.file, *index))
+					std::cerr << "Could not cache the regions of " << r.file << std::endl;
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			keepIndex(r.file, ok ? index : nullptr);
+			scheduled.erase(r.file);
+		}
+		done_cv.notify_all();
+	}
+}
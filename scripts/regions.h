@@ -0,0 +1,97 @@
+#ifndef REGIONS_H
+#define REGIONS_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "opencv2/core/core.hpp"
+
+#include "pyramid.h"
+#include "mapped.h"
+
+// Struct that holds an over-segmentation of an image (a watershed from a grid of seeds),
+// so as to a click can label a whole region. It is built from a reduced level of the
+// image, and each region is stored as its horizontal runs, so painting it costs the
+// size of the region and not the size of the image
+struct regionIndex
+{
+	cv::Mat labels; // CV_32S region of each pixel, at the resolution of the level it was built from
+	cv::Mat offsets; // CV_32S 1 x (n+1): the runs of region i are the rows [offsets[i], offsets[i+1]) of runs
+	cv::Mat runs; // CV_32S rows of (y, x0, x1) (x1 excluded), at the resolution of labels
+	cv::Mat boxes; // CV_32S n x 4: bounding box (x, y, width, height) of each region in the image
+	cv::Size full; // Size of the image
+	std::shared_ptr<mappedFile> backing; // Mapped file the mats point to (null if they are in memory)
+
+	// Number of regions
+	int size() const;
+	// Region that contains the point p of the image (-1 if it is outside)
+	int regionAt(const cv::Point& p) const;
+	// Bounding box of region in the image
+	cv::Rect bounds(int region) const;
+	// Sets the pixels of region in mask (of the size of the image) to value
+	void paint(int region, cv::Mat& mask, uchar value) const;
+};
+
+// Builds the index of an image from one of its levels (BGR), with regions of around
+// region_size x region_size pixels of the level. full is the size of the image
+bool buildRegionIndex(const cv::Mat& level, const cv::Size& full, int region_size, regionIndex& index);
+// Writes (maps) the index to (from) a cache file that remembers its source image, so as to
+// stale caches are detected. They return false on error (or if there is no valid cache)
+bool storeRegionIndex(const std::string& file, const std::string& source, const regionIndex& index);
+bool loadRegionIndex(const std::string& file, const std::string& source, regionIndex& index);
+
+// Class that builds the region indexes on a background thread, after an image has been
+// read, and caches them on disk (CACHE_DIR) so as to revisited images do not build them
+// again. The last keep indexes are also kept in memory. It can be called from any thread
+class regionIndexer
+{
+public:
+	// region_size as in buildRegionIndex, max_pixels the maximum size of the level the
+	// index is built from and cache_dir where it is cached (not cached if empty)
+	regionIndexer(int region_size, long long max_pixels, const std::string& cache_dir, int keep);
+	// Waits for the index being built
+	~regionIndexer();
+
+	// Schedules the index of the image at file (unless it is already built or scheduled).
+	// pyramid is the one of the image (only its levels that are already built are used)
+	void request(const std::string& file, const imagePyramid& pyramid);
+	// Returns the index of file, waiting for it if it is scheduled. Null if it has not
+	// been requested or it could not be built
+	std::shared_ptr<const regionIndex> get(const std::string& file);
+
+private:
+	struct regionRequest
+	{
+		std::string file;
+		cv::Mat level; // Level the index is built from
+		cv::Size full;
+	};
+
+	// Inf. loop run by the thread
+	void worker();
+	// Keeps index as the newest one in memory (the mutex must be held)
+	void keepIndex(const std::string& file, const std::shared_ptr<const regionIndex>& index);
+
+	int _region_size;
+	long long _max_pixels;
+	std::string _cache_dir;
+	int _keep;
+
+	std::deque<regionRequest> pending; // Requests waiting for the thread
+	std::set<std::string> scheduled; // Files that are pending or being built
+	std::deque<std::pair<std::string, std::shared_ptr<const regionIndex>>> ready; // Newest at the back
+
+	std::mutex _mutex;
+	std::condition_variable work_cv; // The thread waits here for requests
+	std::condition_variable done_cv; // get() waits here for the thread
+	bool stop;
+	std::thread thread;
+};
+
+#endif
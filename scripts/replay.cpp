@@ -0,0 +1,218 @@
+#include "replay.h"
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+
+#include "labelmask.h"
+
+namespace
+{
+	const std::string session_header = "maskCreator-session 1";
+
+	// Line of an event: "t_ms kind fields"
+	std::string formatEvent(const sessionEvent& e)
+	{
+		std::ostringstream ss;
+		ss << e.t_ms << " ";
+		switch(e.type)
+		{
+			case sessionEvent::MOUSE:
+				ss << "mouse " << e.event << " " << e.x << " " << e.y << " " << e.flags;
+				break;
+			case sessionEvent::TRACKBAR:
+				ss << "trackbar " << e.x << " " << e.name;
+				break;
+			case sessionEvent::KEY:
+				ss << "key " << e.event;
+				break;
+			case sessionEvent::MASK:
+				ss << "mask " << e.name << " " << std::hex << e.digest << std::dec << " " << e.image;
+				break;
+		}
+		return ss.str();
+	}
+}
+
+uint64_t maskDigest(const cv::Mat& mask)
+{
+	uint64_t hash = 1469598103934665603ULL;
+	size_t row = static_cast<size_t>(mask.cols)*mask.elemSize();
+	for(int y=0; y<mask.rows; y++)
+	{
+		const uchar* p = mask.ptr<uchar>(y);
+		for(size_t x=0; x<row; x++)
+		{
+			hash ^= p[x];
+			hash *= 1099511628211ULL;
+		}
+	}
+	// The size matters too (an empty mask is not a 0x0 one of other type)
+	hash ^= static_cast<uint64_t>(mask.rows) << 32 | static_cast<uint32_t>(mask.cols);
+	return hash;
+}
+
+sessionRecorder::sessionRecorder(const std::string& file, const std::string& path)
+	: start(std::chrono::steady_clock::now()), _file(file), to_file(!file.empty()), opened(0)
+{
+	if(to_file)
+	{
+		out.open(file, std::ios::trunc);
+		out << session_header << "\n" << "path " << path << std::endl;
+		std::error_code ec;
+		std::filesystem::remove_all(file + ".masks", ec);
+		std::filesystem::create_directories(file + ".masks", ec);
+	}
+}
+
+bool sessionRecorder::ok() const
+{
+	return !to_file || static_cast<bool>(out);
+}
+
+long long sessionRecorder::now() const
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void sessionRecorder::recordMouse(int event, int x, int y, int flags)
+{
+	sessionEvent e{sessionEvent::MOUSE, now(), event, x, y, flags, "", "", 0};
+	record(e);
+}
+
+void sessionRecorder::recordTrackbar(const std::string& name, int pos)
+{
+	sessionEvent e{sessionEvent::TRACKBAR, now(), 0, pos, 0, 0, name, "", 0};
+	record(e);
+}
+
+void sessionRecorder::recordKey(int key)
+{
+	sessionEvent e{sessionEvent::KEY, now(), key, 0, 0, 0, "", "", 0};
+	record(e);
+}
+
+void sessionRecorder::recordMask(const std::string& tag, const std::string& image, const cv::Mat& mask)
+{
+	sessionEvent e{sessionEvent::MASK, now(), 0, 0, 0, 0, tag, image, maskDigest(mask)};
+	if(to_file && tag == "open")
+	{
+		// The .lbl runs take a few bytes per row of an unlabelled mask
+		std::vector<uchar> buffer;
+		encodeLabelMask(mask, buffer);
+		std::lock_guard<std::mutex> lock(_mutex);
+		std::ofstream f(sessionMaskFile(_file, opened++), std::ios::binary | std::ios::trunc);
+		f.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+		if(!f)
+			std::cerr << "Could not record the mask " << image << " is opened with" << std::endl;
+	}
+	record(e);
+}
+
+std::vector<sessionEvent> sessionRecorder::events() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _events;
+}
+
+void sessionRecorder::record(const sessionEvent& e)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_events.push_back(e);
+	if(to_file)
+		out << formatEvent(e) << std::endl;
+}
+
+bool loadSession(const std::string& file, std::vector<sessionEvent>& events, std::string& path, std::string& error)
+{
+	events.clear();
+	std::ifstream in(file);
+	std::string line;
+	if(!std::getline(in, line) || line != session_header)
+	{
+		error = file + " is not a session";
+		return false;
+	}
+
+	int n = 1;
+	while(std::getline(in, line))
+	{
+		n++;
+		if(line.compare(0, 5, "path ") == 0)
+		{
+			path = line.substr(5);
+			continue;
+		}
+
+		std::istringstream ss(line);
+		sessionEvent e{sessionEvent::MOUSE, 0, 0, 0, 0, 0, "", "", 0};
+		std::string kind;
+		bool ok = static_cast<bool>(ss >> e.t_ms >> kind);
+		if(ok && kind == "mouse")
+			ok = static_cast<bool>(ss >> e.event >> e.x >> e.y >> e.flags);
+		else if(ok && kind == "trackbar")
+		{
+			e.type = sessionEvent::TRACKBAR;
+			ok = static_cast<bool>(ss >> e.x);
+			ss.get();
+			std::getline(ss, e.name);
+		}
+		else if(ok && kind == "key")
+		{
+			e.type = sessionEvent::KEY;
+			ok = static_cast<bool>(ss >> e.event);
+		}
+		else if(ok && kind == "mask")
+		{
+			e.type = sessionEvent::MASK;
+			ok = static_cast<bool>(ss >> e.name >> std::hex >> e.digest >> std::dec);
+			ss.get();
+			std::getline(ss, e.image);
+		}
+		else
+			ok = false;
+
+		if(!ok)
+		{
+			error = "line " + std::to_string(n) + ": not a valid event";
+			return false;
+		}
+		events.push_back(e);
+	}
+	return true;
+}
+
+std::string sessionMaskFile(const std::string& session, int n)
+{
+	return session + ".masks/open-" + std::to_string(n) + LABEL_MASK_EXTENSION;
+}
+
+int compareMasks(const std::vector<sessionEvent>& recorded, const std::vector<sessionEvent>& replayed)
+{
+	std::vector<const sessionEvent*> a, b;
+	for(const auto& e: recorded)
+		if(e.type == sessionEvent::MASK)
+			a.push_back(&e);
+	for(const auto& e: replayed)
+		if(e.type == sessionEvent::MASK)
+			b.push_back(&e);
+
+	int mismatches = 0;
+	for(size_t i=0; i<std::max(a.size(), b.size()); i++)
+	{
+		if(i >= a.size() || i >= b.size())
+		{
+			std::cerr << "Mask " << i << ": " << (i >= a.size() ? "not recorded" : "not replayed") << std::endl;
+			mismatches++;
+		}
+		else if(a[i]->image != b[i]->image || a[i]->name != b[i]->name || a[i]->digest != b[i]->digest)
+		{
+			std::cerr << "Mask " << i << ": recorded " << a[i]->name << " " << a[i]->image << " " << std::hex << a[i]->digest
+					  << ", replayed " << b[i]->name << " " << b[i]->image << " " << b[i]->digest << std::dec << std::endl;
+			mismatches++;
+		}
+	}
+	return mismatches;
+}
@@ -0,0 +1,80 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+
+#include "opencv2/core/core.hpp"
+
+// Struct that holds one event of a labelling session: a HighGUI callback (mouse, trackbar
+// or key) or the digest of a mask (when an image is opened or left), which is what the
+// replay checks
+struct sessionEvent
+{
+	enum eventType { MOUSE, TRACKBAR, KEY, MASK };
+
+	eventType type;
+	long long t_ms; // Since the session started
+	int event; // MOUSE: cv::EVENT_*. KEY: key code
+	int x, y; // MOUSE: position. TRACKBAR: x holds its position
+	int flags; // MOUSE: cv::EVENT_FLAG_*
+	std::string name; // TRACKBAR: its name. MASK: "open" or "close"
+	std::string image; // MASK: image of the mask
+	uint64_t digest; // MASK: maskDigest of the mask
+};
+
+// 64 bit FNV-1a hash of the bytes of mask (two masks with the same digest are the same
+// byte for byte, for every practical purpose)
+uint64_t maskDigest(const cv::Mat& mask);
+
+// Class that logs the events of a session, one line per event (to a file, flushed with
+// each line so as to a crash does not lose the session, or only to memory if no file is
+// given). The mask each image is opened with is written next to it too (see
+// sessionMaskFile), as the saved masks and journals it came from change during the
+// session. It can be called from any thread
+class sessionRecorder
+{
+public:
+	// path is the directory of the images of the session
+	sessionRecorder(const std::string& file, const std::string& path);
+
+	bool ok() const;
+	// Time of the session, in ms since it started
+	long long now() const;
+
+	void recordMouse(int event, int x, int y, int flags);
+	void recordTrackbar(const std::string& name, int pos);
+	void recordKey(int key);
+	void recordMask(const std::string& tag, const std::string& image, const cv::Mat& mask);
+
+	// Events recorded so far
+	std::vector<sessionEvent> events() const;
+
+private:
+	void record(const sessionEvent& e);
+
+	std::chrono::steady_clock::time_point start;
+	std::string _file;
+	std::ofstream out;
+	bool to_file;
+	int opened; // Images opened so far
+	std::vector<sessionEvent> _events;
+	mutable std::mutex _mutex;
+};
+
+// Reads a session written by sessionRecorder. Returns false (and the reason in error) if it
+// is not valid
+bool loadSession(const std::string& file, std::vector<sessionEvent>& events, std::string& path, std::string& error);
+
+// File (.lbl) of the mask the n-th image opened in the session was opened with
+std::string sessionMaskFile(const std::string& session, int n);
+
+// Compares the mask events of a replay with the ones of the recorded session. Returns the
+// number of mismatches (and prints them)
+int compareMasks(const std::vector<sessionEvent>& recorded, const std::vector<sessionEvent>& replayed);
+
+#endif
@@ -0,0 +1,218 @@
+#include "server.h"
+
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "trace.h"
+
+namespace
+{
+	// Sends the whole buffer (MSG_NOSIGNAL, so as to a client that has gone does not kill
+	// the server). Returns false if the connection is closed
+	bool sendAll(int fd, const void* buffer, size_t size)
+	{
+		const char* p = static_cast<const char*>(buffer);
+		while(size > 0)
+		{
+			ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				return false;
+			p += n;
+			size -= static_cast<size_t>(n);
+		}
+		return true;
+	}
+}
+
+labelServer::labelServer(const std::string& root, const utils::imageList& images, const decodeOptions& decode, int keep,
+						 const sessionOptions& options, const std::vector<int>& write_params, int max_pending)
+	: _root(root), _images(images), _options(options), _cache(root, decode, keep),
+	  _regions(options.region_size, options.region_max_pixels, decode.cache_dir, keep), _writer(write_params, max_pending),
+	  listen_fd(-1), stopping(false)
+{
+	_options.regions = &_regions;
+}
+
+labelServer::~labelServer()
+{
+	stop();
+	for(auto& c: clients)
+		c.second.join();
+	if(listen_fd >= 0)
+	{
+		::close(listen_fd);
+		::unlink(_socket_path.c_str());
+	}
+}
+
+imageCache& labelServer::cache()
+{
+	return _cache;
+}
+
+maskWriter& labelServer::writer()
+{
+	return _writer;
+}
+
+bool labelServer::listen(const std::string& socket_path, std::string& error)
+{
+	sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(socket_path.size() >= sizeof(addr.sun_path))
+	{
+		error = "the socket path is too long";
+		return false;
+	}
+	std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+	listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listen_fd < 0)
+	{
+		error = std::strerror(errno);
+		return false;
+	}
+	::unlink(socket_path.c_str());
+	if(::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(listen_fd, 16) < 0)
+	{
+		error = socket_path + ": " + std::strerror(errno);
+		::close(listen_fd);
+		listen_fd = -1;
+		return false;
+	}
+	_socket_path = socket_path;
+	return true;
+}
+
+int labelServer::run()
+{
+	int sessions = 0;
+	while(!stopping)
+	{
+		int fd = ::accept(listen_fd, nullptr, nullptr);
+		if(fd < 0)
+		{
+			if(errno == EINTR && !stopping)
+				continue;
+			break;
+		}
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		if(stopping)
+		{
+			::close(fd);
+			break;
+		}
+		// The sessions that have ended are joined here, so a long running server does not
+		// keep a thread for every connection it has had
+		reapClients();
+		int id = ++sessions;
+		client_fds.insert(fd);
+		clients.emplace(id, std::thread(&labelServer::serve, this, fd, id));
+	}
+
+	// I disconnect the sessions that are still open and I wait for them (they take the
+	// mutex to end, so it is not held)
+	stop();
+	for(auto& c: clients)
+		c.second.join();
+	clients.clear();
+	finished.clear();
+	return sessions;
+}
+
+void labelServer::reapClients()
+{
+	// A finished session has released the mutex, so its thread is only closing its socket
+	// and releasing its state
+	for(int id: finished)
+	{
+		auto it = clients.find(id);
+		if(it == clients.end())
+			continue;
+		it->second.join();
+		clients.erase(it);
+	}
+	finished.clear();
+}
+
+void labelServer::stop()
+{
+	if(stopping.exchange(true))
+		return;
+	// Shutting the sockets down wakes up accept() and the recv() of every session
+	std::lock_guard<std::mutex> lock(_mutex);
+	if(listen_fd >= 0)
+		::shutdown(listen_fd, SHUT_RDWR);
+	for(int fd: client_fds)
+		::shutdown(fd, SHUT_RDWR);
+}
+
+void labelServer::serve(int fd, int id)
+{
+	labelSession session(id, _root, _images, _cache, _writer, _options);
+	std::string pending; // Received bytes that do not make a whole line yet
+	std::vector<uchar> payload;
+	char buffer[4096];
+	bool quit = false;
+
+	while(!quit)
+	{
+		ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			break;
+		pending.append(buffer, static_cast<size_t>(n));
+
+		// I handle every whole line received
+		size_t start = 0, end;
+		while(!quit && (end = pending.find('\n', start)) != std::string::npos)
+		{
+			std::string line = pending.substr(start, end - start);
+			start = end + 1;
+			if(!line.empty() && line.back() == '\r')
+				line.pop_back();
+
+			std::string reply;
+			payload.clear();
+			if(line == "stats")
+			{
+				imageCache::cacheStats s = _cache.stats();
+				std::ostringstream ss;
+				ss << "ok decodes " << s.decodes << " hits " << s.hits << " live " << s.live << " bytes " << s.bytes;
+				reply = ss.str();
+			}
+			else if(line == "shutdown")
+			{
+				reply = "ok";
+				quit = true;
+			}
+			else
+				reply = session.handle(line, payload, quit);
+
+			reply += "\n";
+			if(!sendAll(fd, reply.data(), reply.size()) || (!payload.empty() && !sendAll(fd, payload.data(), payload.size())))
+				quit = true;
+			if(line == "shutdown")
+				stop();
+		}
+		pending.erase(0, start);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		client_fds.erase(fd);
+		finished.push_back(id);
+	}
+	::close(fd);
+}
@@ -0,0 +1,69 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#include "session.h"
+#include "imagecache.h"
+#include "writer.h"
+
+// Class that hosts many labelling sessions in one process, one per connection to a local
+// (unix domain) socket. Each connection sends text commands, one per line, and gets one
+// reply line per command (see labelSession::handle). Besides them, "stats" replies with
+// the counters of the shared cache and "shutdown" stops the server. Every session shares
+// the image list, the decoded images and the mask writer
+class labelServer
+{
+public:
+	// root is the directory of the images (images may still be growing while it gets
+	// scanned), decode how they get decoded, keep the number of released images the
+	// cache keeps and write_params the cv::imwrite params of the masks
+	labelServer(const std::string& root, const utils::imageList& images, const decodeOptions& decode, int keep,
+				const sessionOptions& options, const std::vector<int>& write_params, int max_pending);
+	// Stops the server and waits for every session
+	~labelServer();
+
+	// Creates the socket (an old socket file at socket_path gets replaced). Returns false
+	// (and the reason in error) if it can not
+	bool listen(const std::string& socket_path, std::string& error);
+	// Accepts connections until stop() is called, and waits for the sessions. Returns the
+	// number of sessions served
+	int run();
+	// Makes run() return and disconnects every session (it can be called from any thread)
+	void stop();
+
+	imageCache& cache();
+	maskWriter& writer();
+
+	labelServer(const labelServer&) = delete;
+	labelServer& operator=(const labelServer&) = delete;
+
+private:
+	// Reads the commands of a connection until it quits or disconnects (run by its own thread)
+	void serve(int fd, int id);
+	// Joins the threads of the sessions that have ended (the mutex must be held)
+	void reapClients();
+
+	std::string _root;
+	const utils::imageList& _images;
+	sessionOptions _options;
+	imageCache _cache;
+	regionIndexer _regions;
+	maskWriter _writer;
+
+	std::string _socket_path;
+	int listen_fd;
+	std::atomic<bool> stopping;
+	std::mutex _mutex; // Protects clients, finished and client_fds
+	std::map<int, std::thread> clients; // Thread of each session, by id
+	std::vector<int> finished; // Sessions whose thread has ended and has not been joined yet
+	std::set<int> client_fds; // Connections that are still open
+};
+
+#endif
@@ -0,0 +1,284 @@
+#include "session.h"
+
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+
+#include "opencv2/imgcodecs/imgcodecs.hpp"
+
+#include "replay.h"
+#include "trace.h"
+
+labelSession::labelSession(int id, const std::string& root, const utils::imageList& images, imageCache& cache,
+						   maskWriter& writer, const sessionOptions& options)
+	: _id(id), _root(root), _images(images), _cache(cache), _writer(writer), _options(options)
+{
+	// The same initial state as the app (without the buttons, so the view is only the image)
+	state.imagePlusControls = cv::Mat::zeros(DISPLAY_SIZE_H, DISPLAY_SIZE_W, CV_8UC3);
+	state.history = new maskHistory(options.history_budget, options.history_tile, options.history_compress);
+	state.mask_palette = options.mask_palette;
+	state.threshold_palette = options.threshold_palette;
+	state.label_set = options.label_set;
+	state.mask_cache_tag = "_session" + std::to_string(id);
+	state.regions = options.regions;
+	state.writer = &writer;
+	state.mask_id = 0;
+	state.actual_channel = 0;
+	state.th_value = 0;
+	state.th_max = 255;
+	state.radiusClick = 0;
+	state.current_image = -1;
+	state.mask_view_on = false;
+	state.add_on = true;
+	state.th_on = false;
+	state.th_inv = false;
+}
+
+labelSession::~labelSession()
+{
+	delete state.history;
+	// The mask of the session is only a scratch file, it is not kept once it is unmapped
+	state.mask.release();
+	state.mask_backing.reset();
+	std::error_code ec;
+	if(!mask_file.empty())
+		std::filesystem::remove(mask_file, ec);
+}
+
+int labelSession::id() const
+{
+	return _id;
+}
+
+bool labelSession::open(int idx, std::string& error)
+{
+	if(idx < 0 || idx >= static_cast<int>(_images.size()))
+	{
+		error = "no image " + std::to_string(idx);
+		return false;
+	}
+	std::shared_ptr<const decodedImage> shared = _cache.acquire(_images.at(idx));
+	if(!shared)
+	{
+		error = "could not read " + _images.at(idx);
+		return false;
+	}
+
+	// The mats of the copy are the shared ones (only their headers get copied), and the
+	// editor never writes to them
+	decodedImage decoded = *shared;
+	decoded.index = idx;
+	installImage(decoded, state);
+	image = shared;
+	state.current_image = idx;
+	// The mask of the image I leave has been unmapped, so its file is removed (unless it is
+	// the one of this image, which has just been created again)
+	std::string file = state.mask_backing ? decoded.cache_base + state.mask_cache_tag + ".mask" : "";
+	std::error_code ec;
+	if(!mask_file.empty() && mask_file != file)
+		std::filesystem::remove(mask_file, ec);
+	mask_file = file;
+	loadSavedMask(utils::saved_mask_path(_root, _images.at(idx), _options.mask_extension), state);
+	display_img(state, state.mask_view_on);
+	return true;
+}
+
+std::string labelSession::handle(const std::string& line, std::vector<uchar>& payload, bool& quit)
+{
+	TRACE_SCOPE("session/handle");
+	std::istringstream ss(line);
+	std::string cmd;
+	ss >> cmd;
+	payload.clear();
+	quit = false;
+
+	if(cmd.empty())
+		return "error empty command";
+	if(cmd == "quit")
+	{
+		quit = true;
+		return "ok";
+	}
+	if(cmd == "open" || cmd == "next")
+	{
+		int idx = state.current_image + 1;
+		if(cmd == "open" && !(ss >> idx))
+			return "error open <idx>";
+		// If root is still being scanned, next waits for the next image to be found
+		if(cmd == "next")
+			_images.wait_for_more(idx);
+		std::string error;
+		if(!open(idx, error))
+			return "error " + error;
+		return "ok " + std::to_string(idx) + " " + std::to_string(state.read_image.rows) + " "
+			+ std::to_string(state.read_image.cols) + " " + _images.at(idx);
+	}
+
+	// The sliders and the buttons that do not need an image
+	int value;
+	if(cmd == "label" || cmd == "radius")
+	{
+		if(!(ss >> value) || value < 0 || value > 255)
+			return "error " + cmd + " <0-255>";
+		(cmd == "label" ? state.mask_id : state.radiusClick) = value;
+		return "ok";
+	}
+	if(cmd == "add" || cmd == "delete")
+	{
+		state.add_on = cmd == "add";
+		return "ok";
+	}
+
+	if(!image)
+		return "error no image is open";
+
+	if(cmd == "channel")
+	{
+		if(!(ss >> value) || value < 0 || value > state.planes->size())
+			return "error channel <0-" + std::to_string(state.planes->size()) + ">";
+		// The same as the channel slider
+		state.actual_channel = value;
+		if(state.th_on && value > 0)
+		{
+			state.th_on = false;
+			if(state.th_range_on)
+				previewRange(state);
+			else
+				previewThreshold(state, state.th_value);
+		}
+		else
+		{
+			state.th_on = false;
+			display_img(state, state.mask_view_on);
+		}
+	}
+	else if(cmd == "threshold" || cmd == "invert" || cmd == "max")
+	{
+		if(cmd != "invert" && (!(ss >> value) || value < 0 || value > 255))
+			return "error " + cmd + " <0-255>";
+		if(cmd == "invert")
+		{
+			state.th_inv = !state.th_inv;
+			value = state.th_value;
+		}
+		if(cmd == "max")
+			state.th_max = value;
+		else
+			state.th_value = value;
+		// The inversion (and max) is kept for when a channel is thresholded. In range mode
+		// threshold and max bound the channel, and invert keeps the bounds
+		if(state.actual_channel > 0 && state.th_range_on)
+		{
+			if(cmd != "invert")
+				setRangeBounds(state, state.actual_channel - 1, state.th_value, state.th_max);
+			previewRange(state);
+		}
+		else if(state.actual_channel > 0 && cmd != "max")
+			previewThreshold(state, value);
+		else if(cmd == "threshold")
+			return "error the color image can not be thresholded";
+	}
+	else if(cmd == "range")
+	{
+		std::string on;
+		ss >> on;
+		if(on != "on" && on != "off")
+			return "error range on|off";
+		// The same as the R key (but the preview is only shown by the next threshold)
+		state.th_range_on = on == "on";
+		state.th_ranges.clear();
+		state.th_on = false;
+		display_img(state, state.mask_view_on);
+	}
+	else if(cmd == "apply")
+	{
+		if(!state.th_on || state.actual_channel == 0)
+			return "error there is no threshold";
+		applyThreshold(state);
+	}
+	else if(cmd == "mask")
+	{
+		std::string on;
+		ss >> on;
+		if(on != "on" && on != "off")
+			return "error mask on|off";
+		state.mask_view_on = on == "on";
+		if(state.mask_view_on)
+			state.th_on = false;
+		display_img(state, state.mask_view_on);
+	}
+	else if(cmd == "circle" || cmd == "rect")
+	{
+		cv::Point p1, p2;
+		if(!(ss >> p1.x >> p1.y) || (cmd == "rect" && !(ss >> p2.x >> p2.y)))
+			return "error " + cmd + (cmd == "rect" ? " <x1> <y1> <x2> <y2>" : " <x> <y>");
+		cv::Rect bounds(0, 0, state.mask.cols, state.mask.rows);
+		if(!bounds.contains(p1) || (cmd == "rect" && !bounds.contains(p2)))
+			return "error outside the image";
+		if(cmd == "circle")
+			drawCircle(state, p1);
+		else
+			drawRectangle(state, cv::Point(std::min(p1.x, p2.x), std::min(p1.y, p2.y)),
+						  cv::Point(std::max(p1.x, p2.x), std::max(p1.y, p2.y)));
+	}
+	else if(cmd == "stroke")
+	{
+		std::vector<cv::Point> points;
+		cv::Point p;
+		while(ss >> p.x >> p.y)
+			points.push_back(p);
+		if(points.empty())
+			return "error stroke <x> <y> [<x> <y> ...]";
+		beginStroke(state, points[0]);
+		for(size_t i=1; i<points.size(); i++)
+			continueStroke(state, points[i]);
+		endStroke(state);
+	}
+	else if(cmd == "region")
+	{
+		cv::Point p;
+		if(!(ss >> p.x >> p.y))
+			return "error region <x> <y>";
+		if(!fillRegion(state, p))
+			return "error no region there";
+	}
+	else if(cmd == "undo")
+	{
+		if(!undoEdit(state))
+			return "error nothing to undo";
+	}
+	else if(cmd == "redo")
+	{
+		if(!redoEdit(state))
+			return "error nothing to redo";
+	}
+	else if(cmd == "save")
+	{
+		saveMask(utils::mask_path(_root, _images.at(state.current_image), _options.mask_extension), state);
+	}
+	else if(cmd == "count")
+	{
+		if(!(ss >> value) || value < 0 || value > 255)
+			return "error count <0-255>";
+		cv::Rect box = state.label_stats.bounds(value);
+		return "ok " + std::to_string(state.label_stats.pixels(value)) + " " + std::to_string(box.x) + " "
+			+ std::to_string(box.y) + " " + std::to_string(box.width) + " " + std::to_string(box.height);
+	}
+	else if(cmd == "digest")
+	{
+		std::ostringstream digest;
+		digest << std::hex << maskDigest(state.mask);
+		return "ok " + digest.str();
+	}
+	else if(cmd == "view")
+	{
+		TRACE_SCOPE("session/view");
+		if(!cv::imencode(".png", state.imagePlusControls, payload))
+			return "error could not encode the view";
+		return "ok " + std::to_string(payload.size());
+	}
+	else
+		return "error unknown command " + cmd;
+
+	return "ok";
+}
@@ -0,0 +1,77 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "opencv2/core/core.hpp"
+
+#include "editor.h"
+#include "imagecache.h"
+
+// Struct that holds what every session of the server is created with
+struct sessionOptions
+{
+	size_t history_budget; // Bytes of undo history of each session
+	int history_tile; // Tile size of the history
+	bool history_compress;
+	std::string mask_extension; // Extension of the saved masks (see utils::mask_path)
+	labelPalette mask_palette; // Colors of the labels in the view
+	labelPalette threshold_palette; // Color of the threshold preview in the view
+	labelSet label_set; // Names of the labels (written with the stats of the saved masks)
+	int region_size; // Regions of the click-to-label index (see regionIndexer)
+	long long region_max_pixels;
+	regionIndexer* regions = nullptr; // Shared by the sessions (set by the server)
+};
+
+// Class that holds the state of one labeller of the server: its own data struct (mask,
+// undo history, sliders and view) over an image shared through the imageCache. Sessions
+// do not touch any global, so the server runs each one on its own thread. The commands
+// are text lines (see handle())
+class labelSession
+{
+public:
+	// id is unique for the server, root the directory of images (shared, it may still be
+	// growing while root is scanned)
+	labelSession(int id, const std::string& root, const utils::imageList& images, imageCache& cache,
+				 maskWriter& writer, const sessionOptions& options);
+	~labelSession();
+
+	// Handles one command and returns the reply line ("ok ..." or "error ..."). The view
+	// command also fills payload, which has to be sent right after the reply. quit is set
+	// when the session ends. The commands are:
+	//   open <idx>, next                          image of the list (replies "ok idx rows cols image")
+	//   label <id>, add, delete, radius <r>       the same as the sliders and buttons
+	//   channel <c>, threshold <v>, invert, apply
+	//   range on|off, max <v>                     range threshold (threshold and max bound the channel)
+	//   mask on|off                               whether the view shows the mask
+	//   circle <x> <y>, rect <x1> <y1> <x2> <y2>  edits in image coordinates
+	//   stroke <x> <y> [<x> <y> ...]              brush stroke through the points (one undo step)
+	//   region <x> <y>                            labels the region of the over-segmentation
+	//   count <id>                                pixels and bounding box of a label ("ok n x y w h")
+	//   undo, redo, save, digest, view (png of the view), quit
+	std::string handle(const std::string& line, std::vector<uchar>& payload, bool& quit);
+
+	int id() const;
+
+	labelSession(const labelSession&) = delete;
+	labelSession& operator=(const labelSession&) = delete;
+
+private:
+	// Opens the image idx of the list. Returns false (and the reason in error) if it can not
+	bool open(int idx, std::string& error);
+
+	int _id;
+	std::string _root;
+	const utils::imageList& _images;
+	imageCache& _cache;
+	maskWriter& _writer;
+	sessionOptions _options;
+
+	data state; // Everything the editor works on
+	std::shared_ptr<const decodedImage> image; // Keeps the shared image alive while it is open
+	std::string mask_file; // Mapped file of the mask of the open image (removed when it is left)
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include "threadpool.h"
+
+#include <algorithm>
+#include <iostream>
+
+threadPool::threadPool(int n_threads)
+	: next_queue(0), pending(0), queued(0), stop(false)
+{
+	if(n_threads <= 0)
+		n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	for(int i=0; i<n_threads; i++)
+		queues.emplace_back(new workerQueue());
+	for(int i=0; i<n_threads; i++)
+		workers.emplace_back(&threadPool::worker, this, i);
+}
+
+threadPool::~threadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		stop = true;
+	}
+	work_cv.notify_all();
+	for(auto& w: workers)
+		w.join();
+}
+
+void threadPool::submit(std::function<void()> task)
+{
+	// I count the task before queueing it, so as to wait() never sees it finished before
+	// it has been counted
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		pending++;
+		queued++;
+	}
+	unsigned q = next_queue++ % queues.size();
+	{
+		std::lock_guard<std::mutex> lock(queues[q]->_mutex);
+		queues[q]->tasks.push_back(std::move(task));
+	}
+	work_cv.notify_one();
+}
+
+void threadPool::wait()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	done_cv.wait(lock, [&]{ return pending == 0; });
+}
+
+int threadPool::size() const
+{
+	return static_cast<int>(workers.size());
+}
+
+bool threadPool::takeTask(int id, std::function<void()>& task)
+{
+	// First my own queue (newest task, its data is most likely still in cache)
+	{
+		workerQueue& own = *queues[id];
+		std::lock_guard<std::mutex> lock(own._mutex);
+		if(!own.tasks.empty())
+		{
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			return true;
+		}
+	}
+
+	// Then I steal the oldest task of the others
+	int n = static_cast<int>(queues.size());
+	for(int k=1; k<n; k++)
+	{
+		workerQueue& victim = *queues[(id + k) % n];
+		std::lock_guard<std::mutex> lock(victim._mutex);
+		if(!victim.tasks.empty())
+		{
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void threadPool::worker(int id)
+{
+	while(true)
+	{
+		std::function<void()> task;
+		if(takeTask(id, task))
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				queued--;
+			}
+			// A failing task must not kill the worker (nor leave wait() waiting forever)
+			try
+			{
+				task();
+			}
+			catch(const std::exception& e)
+			{
+				std::cerr << "Task failed: " << e.what() << std::endl;
+			}
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				pending--;
+			}
+			done_cv.notify_all();
+			continue;
+		}
+
+		// There is no task anywhere, so I wait until one gets submitted
+		std::unique_lock<std::mutex> lock(_mutex);
+		work_cv.wait(lock, [&]{ return stop || queued > 0; });
+		if(stop)
+			return;
+	}
+}
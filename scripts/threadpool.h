@@ -0,0 +1,53 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <atomic>
+
+// Work-stealing thread pool. Each worker has its own queue: it takes its tasks from the
+// back of it and, when it runs out of them, it steals from the front of the others. So
+// slow tasks (a huge image) do not leave the rest of the workers idle
+class threadPool
+{
+public:
+	// n_threads <= 0 means one per core
+	explicit threadPool(int n_threads);
+	~threadPool();
+
+	// Queues a task (tasks are spread among the workers)
+	void submit(std::function<void()> task);
+	// Waits until every submitted task has finished
+	void wait();
+
+	int size() const;
+
+private:
+	struct workerQueue
+	{
+		std::mutex _mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	void worker(int id);
+	// Takes a task from the own queue or steals one. Returns false if there is none
+	bool takeTask(int id, std::function<void()>& task);
+
+	std::vector<std::unique_ptr<workerQueue>> queues;
+	std::vector<std::thread> workers;
+	std::atomic<unsigned> next_queue; // Round robin of submit()
+
+	std::mutex _mutex;
+	std::condition_variable work_cv; // Workers wait here for tasks
+	std::condition_variable done_cv; // wait() waits here
+	long pending; // Submitted tasks that have not finished
+	long queued; // Submitted tasks that no worker has taken yet
+	bool stop;
+};
+
+#endif
@@ -0,0 +1,244 @@
+#include "threshold.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+thresholdIndex::thresholdIndex()
+	: last_th(0), last_inv(false), valid(false)
+{
+}
+
+void thresholdIndex::build(const cv::Mat& channel, const cv::Size& proxy_size)
+{
+	// INTER_AREA averages every source pixel, so as to the proxy looks like the displayed image
+	cv::resize(channel, _proxy, proxy_size, 0, 0, cv::INTER_AREA);
+	if(!_proxy.isContinuous())
+		_proxy = _proxy.clone();
+
+	// Counting sort of the pixels by value
+	const uchar* p = _proxy.ptr<uchar>(0);
+	int n = static_cast<int>(_proxy.total());
+	offsets.assign(257, 0);
+	for(int i=0; i<n; i++)
+		offsets[p[i] + 1]++;
+	for(int v=0; v<256; v++)
+		offsets[v + 1] += offsets[v];
+
+	order.resize(n);
+	std::vector<int> next(offsets.begin(), offsets.end() - 1);
+	for(int i=0; i<n; i++)
+		order[next[p[i]]++] = i;
+
+	_preview.create(_proxy.size(), CV_8UC1);
+	valid = false;
+}
+
+bool thresholdIndex::built() const
+{
+	return !_proxy.empty();
+}
+
+cv::Rect thresholdIndex::update(int th, bool inv)
+{
+	cv::Rect full(0, 0, _proxy.cols, _proxy.rows);
+	th = std::max(0, std::min(th, 255));
+
+	// If the inversion mode has changed (or it is the first time) every pixel changes
+	if(!valid || inv != last_inv)
+	{
+		cv::threshold(_proxy, _preview, th, 255, inv ? cv::THRESH_BINARY_INV : cv::THRESH_BINARY);
+		last_th = th;
+		last_inv = inv;
+		valid = true;
+		return full;
+	}
+
+	// Else only the values in (min(t0,t1), max(t0,t1)] cross the threshold
+	int lo = std::min(last_th, th) + 1;
+	int hi = std::max(last_th, th);
+	last_th = th;
+	if(lo > hi)
+		return cv::Rect();
+
+	uchar* out = _preview.ptr<uchar>(0);
+	const uchar* in = _proxy.ptr<uchar>(0);
+	int x0 = _proxy.cols, y0 = _proxy.rows, x1 = -1, y1 = -1;
+	for(int k=offsets[lo]; k<offsets[hi + 1]; k++)
+	{
+		int i = order[k];
+		bool above = in[i] > th;
+		out[i] = (above != inv) ? 255 : 0;
+
+		int x = i % _proxy.cols, y = i / _proxy.cols;
+		x0 = std::min(x0, x);
+		x1 = std::max(x1, x);
+		y0 = std::min(y0, y);
+		y1 = std::max(y1, y);
+	}
+
+	if(x1 < 0)
+		return cv::Rect();
+	return cv::Rect(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
+const cv::Mat& thresholdIndex::proxy() const
+{
+	return _proxy;
+}
+
+const cv::Mat& thresholdIndex::preview() const
+{
+	return _preview;
+}
+
+const int* thresholdIndex::pixels(int v) const
+{
+	return order.data() + offsets[v];
+}
+
+namespace
+{
+	// Pixels compared at once by rangeThreshold (every plane reads its part of the block
+	// while out stays in the cache)
+	const int RANGE_BLOCK = 4096;
+
+	// Clears the pixels of inside (n of them) whose value is not in [lo, hi]
+	void andInRange(const uchar* p, int n, int lo, int hi, uchar* inside)
+	{
+		if(lo > hi)
+		{
+			std::memset(inside, 0, n);
+			return;
+		}
+		// Unsigned wraparound: value - lo <= hi - lo is lo <= value <= hi with one compare
+		const uchar l = static_cast<uchar>(lo), width = static_cast<uchar>(hi - lo);
+		for(int x=0; x<n; x++)
+			inside[x] &= static_cast<uchar>(p[x] - l) <= width ? 0xff : 0;
+	}
+}
+
+void rangeThreshold(const std::vector<cv::Mat>& planes, const std::vector<planeRange>& ranges, bool inv, cv::Mat& out)
+{
+	CV_Assert(!planes.empty() && planes.size() == ranges.size());
+	cv::Size size = planes[0].size();
+	for(const auto& plane: planes)
+		CV_Assert(plane.type() == CV_8UC1 && plane.size() == size);
+	out.create(size, CV_8UC1);
+
+	// If every mat is continuous the image is walked as one row
+	bool continuous = out.isContinuous();
+	for(const auto& plane: planes)
+		continuous = continuous && plane.isContinuous();
+	int rows = continuous ? 1 : size.height;
+	int cols = continuous ? static_cast<int>(size.area()) : size.width;
+
+	std::vector<const uchar*> in(planes.size());
+	for(int y=0; y<rows; y++)
+	{
+		uchar* o = out.ptr<uchar>(y);
+		for(size_t i=0; i<planes.size(); i++)
+			in[i] = planes[i].ptr<uchar>(y);
+
+		for(int x0=0; x0<cols; x0+=RANGE_BLOCK)
+		{
+			int n = std::min(RANGE_BLOCK, cols - x0);
+			std::memset(o + x0, 0xff, n);
+			for(size_t i=0; i<planes.size(); i++)
+				andInRange(in[i] + x0, n, ranges[i].lo, ranges[i].hi, o + x0);
+			// The pixels inside are 0 (255 if inverted)
+			if(!inv)
+				for(int x=x0; x<x0+n; x++)
+					o[x] = ~o[x];
+		}
+	}
+}
+
+rangePreview::rangePreview()
+	: last_inv(false), valid(false)
+{
+}
+
+cv::Rect rangePreview::update(const std::vector<const thresholdIndex*>& indexes, const std::vector<planeRange>& ranges, bool inv)
+{
+	CV_Assert(!indexes.empty() && indexes.size() == ranges.size());
+	const cv::Mat& base = indexes[0]->proxy();
+	cv::Rect full(0, 0, base.cols, base.rows);
+
+	// I look for the only plane whose bounds have moved (if the planes or the inversion
+	// mode have changed, or several bounds have moved, every pixel may change)
+	int moved = -1;
+	bool incremental = valid && inv == last_inv && ranges.size() == last.size() && _preview.size() == base.size();
+	for(size_t i=0; incremental && i<ranges.size(); i++)
+	{
+		if(ranges[i].plane != last[i].plane)
+			incremental = false;
+		else if(ranges[i].lo != last[i].lo || ranges[i].hi != last[i].hi)
+		{
+			incremental = moved < 0;
+			moved = static_cast<int>(i);
+		}
+	}
+
+	if(!incremental)
+	{
+		std::vector<cv::Mat> proxies;
+		for(const auto* index: indexes)
+			proxies.push_back(index->proxy());
+		rangeThreshold(proxies, ranges, inv, _preview);
+		last = ranges;
+		last_inv = inv;
+		valid = true;
+		return full;
+	}
+	if(moved < 0)
+		return cv::Rect();
+
+	// Only the values that are in one of the old and new ranges but not in the other change
+	const planeRange old_range = last[moved];
+	last = ranges;
+	std::vector<const uchar*> in(ranges.size());
+	for(size_t i=0; i<ranges.size(); i++)
+		in[i] = indexes[i]->proxy().ptr<uchar>(0);
+	uchar* out = _preview.ptr<uchar>(0);
+	const thresholdIndex& index = *indexes[moved];
+
+	int x0 = base.cols, y0 = base.rows, x1 = -1, y1 = -1;
+	for(int v=0; v<256; v++)
+	{
+		bool was = v >= old_range.lo && v <= old_range.hi;
+		bool is = v >= ranges[moved].lo && v <= ranges[moved].hi;
+		if(was == is)
+			continue;
+		for(const int* k=index.pixels(v); k!=index.pixels(v + 1); k++)
+		{
+			int i = *k;
+			bool inside = is;
+			for(size_t p=0; inside && p<ranges.size(); p++)
+				inside = static_cast<int>(p) == moved || (in[p][i] >= ranges[p].lo && in[p][i] <= ranges[p].hi);
+			out[i] = (inside != inv) ? 0 : 255;
+
+			int x = i % base.cols, y = i / base.cols;
+			x0 = std::min(x0, x);
+			x1 = std::max(x1, x);
+			y0 = std::min(y0, y);
+			y1 = std::max(y1, y);
+		}
+	}
+
+	if(x1 < 0)
+		return cv::Rect();
+	return cv::Rect(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
+void rangePreview::reset()
+{
+	valid = false;
+	last.clear();
+}
+
+const cv::Mat& rangePreview::preview() const
+{
+	return _preview;
+}
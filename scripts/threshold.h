@@ -0,0 +1,83 @@
+#ifndef THRESHOLD_H
+#define THRESHOLD_H
+
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+// Class that holds a display resolution proxy of one channel together with its pixels
+// sorted by value (a histogram whose buckets hold the pixels of each value). When the
+// threshold moves from t0 to t1 only the pixels whose value is between t0 and t1 change,
+// so the preview gets updated by visiting those buckets only
+class thresholdIndex
+{
+public:
+	thresholdIndex();
+
+	// Resizes the channel to proxy_size and sorts its pixels by value
+	void build(const cv::Mat& channel, const cv::Size& proxy_size);
+	bool built() const;
+
+	// Updates the preview to the threshold th (inverted if inv), with the same rule as
+	// cv::threshold (255 if value > th, 0 else). Returns the bounding box of the pixels
+	// of the preview that have changed
+	cv::Rect update(int th, bool inv);
+
+	// The channel and the preview at display resolution
+	const cv::Mat& proxy() const;
+	const cv::Mat& preview() const;
+	// The idxs of the pixels of the proxy whose value is v go from pixels(v) to pixels(v + 1)
+	const int* pixels(int v) const;
+
+private:
+	cv::Mat _proxy;
+	cv::Mat _preview;
+	std::vector<int> offsets; // offsets[v] is the first position of the value v in order
+	std::vector<int> order; // Pixel idxs of the proxy sorted by value
+	int last_th;
+	bool last_inv;
+	bool valid; // Whether _preview holds last_th and last_inv
+};
+
+// Bounds of one plane (see channelPlane) in a range threshold: lo <= value <= hi
+struct planeRange
+{
+	int plane;
+	int lo;
+	int hi;
+};
+
+// Range threshold of several planes at once: out gets 0 where every planes[i] is inside
+// ranges[i] and 255 elsewhere (the opposite if inv), so as to, as with the single threshold,
+// the pixels that are 0 are the ones that get labelled. It is one fused pass over blocks of
+// pixels that fit in the cache (every plane is compared in turn against the same block of
+// out, with branchless loops the compiler vectorizes), instead of one full frame pass and
+// one temporary mask per plane
+void rangeThreshold(const std::vector<cv::Mat>& planes, const std::vector<planeRange>& ranges, bool inv, cv::Mat& out);
+
+// Class that holds the display resolution preview of a range threshold. When only the
+// bounds of one plane move, only the pixels whose value enters or leaves its range can
+// change, so they are taken from the buckets of the thresholdIndex of that plane (and
+// the other planes are only checked at those pixels)
+class rangePreview
+{
+public:
+	rangePreview();
+
+	// Updates the preview to ranges (inverted if inv). indexes[i] is the built index of the
+	// plane of ranges[i] (all of them have the same proxy size). Returns the bounding box
+	// of the pixels of the preview that have changed
+	cv::Rect update(const std::vector<const thresholdIndex*>& indexes, const std::vector<planeRange>& ranges, bool inv);
+	// Forgets the preview (the indexes it was computed from have changed)
+	void reset();
+
+	const cv::Mat& preview() const;
+
+private:
+	cv::Mat _preview;
+	std::vector<planeRange> last; // Ranges of _preview
+	bool last_inv;
+	bool valid;
+};
+
+#endif
@@ -0,0 +1,228 @@
+#include "trace.h"
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+
+std::atomic<bool> trace_enabled(false);
+
+namespace
+{
+	typedef std::chrono::steady_clock traceClock;
+
+	struct traceEvent
+	{
+		const char* name;
+		long long start_us; // Since the trace started
+		long long dur_us;
+		unsigned long interaction; // Interaction the event belongs to (0 if none)
+	};
+
+	// Each thread records to its own buffer, so as to threads do not contend
+	struct threadBuffer
+	{
+		int tid;
+		std::mutex _mutex;
+		std::vector<traceEvent> events;
+	};
+
+	struct openInteraction
+	{
+		const char* name;
+		traceClock::time_point start;
+		bool submitted; // Whether it has submitted a frame
+	};
+
+	struct interactionEvent
+	{
+		const char* name;
+		unsigned long id;
+		long long start_us;
+		long long dur_us; // From the callback to the frame shown
+	};
+
+	traceClock::time_point trace_start;
+	std::mutex trace_mutex; // Protects buffers, interactions and finished
+	std::vector<std::unique_ptr<threadBuffer>> buffers;
+	std::map<unsigned long, openInteraction> interactions;
+	std::vector<interactionEvent> finished;
+	unsigned long next_interaction = 1;
+
+	thread_local threadBuffer* local_buffer = nullptr;
+	thread_local unsigned long local_interaction = 0;
+
+	long long sinceStart(traceClock::time_point t)
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(t - trace_start).count();
+	}
+
+	threadBuffer& localBuffer()
+	{
+		if(!local_buffer)
+		{
+			std::lock_guard<std::mutex> lock(trace_mutex);
+			buffers.emplace_back(new threadBuffer());
+			buffers.back()->tid = static_cast<int>(buffers.size());
+			local_buffer = buffers.back().get();
+		}
+		return *local_buffer;
+	}
+
+	// Percentile p (0 to 1) of the sorted values
+	double percentile(const std::vector<long long>& sorted, double p)
+	{
+		if(sorted.empty())
+			return 0;
+		size_t idx = static_cast<size_t>(p*(sorted.size() - 1) + 0.5);
+		return sorted[std::min(idx, sorted.size() - 1)]/1000.0;
+	}
+
+	void printStats(std::ostream& out, const std::string& name, std::vector<long long>& durations)
+	{
+		std::sort(durations.begin(), durations.end());
+		out << "  " << name << ": n=" << durations.size() << " p50=" << percentile(durations, 0.5)
+			<< " ms p99=" << percentile(durations, 0.99) << " ms max=" << percentile(durations, 1.0) << " ms\n";
+	}
+
+	// Names are literals of the code, but I escape them anyway
+	std::string jsonString(const char* s)
+	{
+		std::string escaped = "\"";
+		for(; *s; s++)
+		{
+			if(*s == '"' || *s == '\\')
+				escaped += '\\';
+			escaped += *s;
+		}
+		return escaped + "\"";
+	}
+}
+
+void traceEnable()
+{
+	std::lock_guard<std::mutex> lock(trace_mutex);
+	trace_start = traceClock::now();
+	trace_enabled = true;
+}
+
+void traceRecord(const char* name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+	threadBuffer& buffer = localBuffer();
+	std::lock_guard<std::mutex> lock(buffer._mutex);
+	buffer.events.push_back({name, sinceStart(start), std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(),
+							 local_interaction});
+}
+
+void traceBeginInteraction(const char* name)
+{
+	std::lock_guard<std::mutex> lock(trace_mutex);
+	// The previous interactions that have not submitted anything will never be shown
+	for(auto it = interactions.begin(); it != interactions.end();)
+	{
+		if(!it->second.submitted)
+			it = interactions.erase(it);
+		else
+			it++;
+	}
+	local_interaction = next_interaction++;
+	interactions[local_interaction] = {name, traceClock::now(), false};
+}
+
+void traceEndInteraction()
+{
+	local_interaction = 0;
+}
+
+unsigned long traceFrameSubmitted()
+{
+	if(!traceEnabled() || local_interaction == 0)
+		return 0;
+	std::lock_guard<std::mutex> lock(trace_mutex);
+	auto it = interactions.find(local_interaction);
+	if(it == interactions.end())
+		return 0;
+	it->second.submitted = true;
+	return local_interaction;
+}
+
+void traceFrameShown(unsigned long interaction)
+{
+	if(!traceEnabled() || interaction == 0)
+		return;
+	traceClock::time_point now = traceClock::now();
+	std::lock_guard<std::mutex> lock(trace_mutex);
+	for(auto it = interactions.begin(); it != interactions.end() && it->first <= interaction;)
+	{
+		if(it->second.submitted)
+		{
+			finished.push_back({it->second.name, it->first, sinceStart(it->second.start),
+								std::chrono::duration_cast<std::chrono::microseconds>(now - it->second.start).count()});
+			it = interactions.erase(it);
+		}
+		else
+			it++;
+	}
+}
+
+bool traceWrite(const std::string& file)
+{
+	std::string tmp = file + ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::trunc);
+		if(!out)
+			return false;
+
+		std::lock_guard<std::mutex> lock(trace_mutex);
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		// The interactions go to their own track (tid 0), from the callback to the frame shown
+		out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"interactions\"}}";
+		for(const auto& e: finished)
+			out << ",\n{\"name\":" << jsonString(e.name) << ",\"cat\":\"interaction\",\"ph\":\"X\",\"pid\":1,\"tid\":0,\"ts\":"
+				<< e.start_us << ",\"dur\":" << e.dur_us << ",\"args\":{\"interaction\":" << e.id << "}}";
+		for(const auto& buffer: buffers)
+		{
+			std::lock_guard<std::mutex> buffer_lock(buffer->_mutex);
+			for(const auto& e: buffer->events)
+			{
+				out << ",\n{\"name\":" << jsonString(e.name) << ",\"cat\":\"scope\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+					<< ",\"ts\":" << e.start_us << ",\"dur\":" << e.dur_us;
+				if(e.interaction)
+					out << ",\"args\":{\"interaction\":" << e.interaction << "}";
+				out << "}";
+			}
+		}
+		out << "\n]}\n";
+		if(!out)
+			return false;
+	}
+	std::error_code ec;
+	std::filesystem::rename(tmp, file, ec);
+	return !ec;
+}
+
+void tracePrintSummary(std::ostream& out)
+{
+	std::map<std::string, std::vector<long long>> scopes, latencies;
+	{
+		std::lock_guard<std::mutex> lock(trace_mutex);
+		for(const auto& e: finished)
+			latencies[e.name].push_back(e.dur_us);
+		for(const auto& buffer: buffers)
+		{
+			std::lock_guard<std::mutex> buffer_lock(buffer->_mutex);
+			for(const auto& e: buffer->events)
+				scopes[e.name].push_back(e.dur_us);
+		}
+	}
+
+	out << "Interaction latency (callback to frame shown):\n";
+	for(auto& l: latencies)
+		printStats(out, l.first, l.second);
+	out << "Scopes:\n";
+	for(auto& s: scopes)
+		printStats(out, s.first, s.second);
+}
@@ -0,0 +1,106 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <ostream>
+#include <atomic>
+#include <chrono>
+
+// Lightweight latency tracing. Scopes (TRACE_SCOPE) record how long each part of the code
+// takes, and interactions (a mouse or trackbar callback) are followed until the frame they
+// have submitted gets shown. Everything is written as a Chrome/Perfetto trace. While it is
+// not enabled, each scope only costs the check of an atomic flag
+
+extern std::atomic<bool> trace_enabled;
+
+inline bool traceEnabled()
+{
+	return trace_enabled.load(std::memory_order_relaxed);
+}
+
+// Starts recording (the events are kept in memory until traceWrite)
+void traceEnable();
+
+// Records an event (name must be a string that outlives the trace, such as a literal)
+void traceRecord(const char* name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+// Starts an interaction of the calling thread (name must outlive the trace). The previous
+// interactions that did not submit any frame are forgotten
+void traceBeginInteraction(const char* name);
+// Ends the interaction of the calling thread (the events it records from now on belong to none)
+void traceEndInteraction();
+// Called when a frame is submitted. Returns the id of the current interaction of the calling
+// thread (0 if there is none), which gets marked as waiting for its frame
+unsigned long traceFrameSubmitted();
+// Called once the frame submitted by interaction has been shown. It closes it (and the older
+// ones, whose frames have been superseded by it)
+void traceFrameShown(unsigned long interaction);
+
+// Writes the Chrome trace json (chrome://tracing or ui.perfetto.dev). Returns false on failure
+bool traceWrite(const std::string& file);
+// Prints the p50/p99 of each scope and of the latency of each kind of interaction
+void tracePrintSummary(std::ostream& out);
+
+// Records the time between its construction and its destruction
+class traceScope
+{
+public:
+	explicit traceScope(const char* name)
+		: _name(traceEnabled() ? name : nullptr)
+	{
+		if(_name)
+			start = std::chrono::steady_clock::now();
+	}
+	~traceScope()
+	{
+		if(_name)
+			traceRecord(_name, start, std::chrono::steady_clock::now());
+	}
+
+	traceScope(const traceScope&) = delete;
+	traceScope& operator=(const traceScope&) = delete;
+
+private:
+	const char* _name;
+	std::chrono::steady_clock::time_point start;
+};
+
+// Starts an interaction on its construction (only if tracing is enabled) and records the time
+// until its destruction, which ends the interaction
+class traceInteraction
+{
+public:
+	explicit traceInteraction(const char* name)
+		: _name(traceEnabled() ? name : nullptr)
+	{
+		if(_name)
+		{
+			traceBeginInteraction(_name);
+			start = std::chrono::steady_clock::now();
+		}
+	}
+	~traceInteraction()
+	{
+		if(_name)
+		{
+			traceRecord(_name, start, std::chrono::steady_clock::now());
+			traceEndInteraction();
+		}
+	}
+
+	traceInteraction(const traceInteraction&) = delete;
+	traceInteraction& operator=(const traceInteraction&) = delete;
+
+private:
+	const char* _name;
+	std::chrono::steady_clock::time_point start;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// Traces the rest of the enclosing block
+#define TRACE_SCOPE(name) traceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+// Starts an interaction (only if tracing is enabled) and traces the rest of the block
+#define TRACE_INTERACTION(name) traceInteraction TRACE_CONCAT(trace_interaction_, __LINE__)(name)
+
+#endif
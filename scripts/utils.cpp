@@ -1,22 +1,336 @@
 #include "utils.h"
 
+#include <map>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+
+#include "threadpool.h"
+
 namespace utils
 {
+	namespace
+	{
+		// What the manifest remembers about each folder
+		struct fileRecord
+		{
+			std::string name;
+			int64_t size;
+			int64_t mtime;
+		};
+
+		struct dirRecord
+		{
+			int64_t mtime;
+			stringvec subdirs;
+			std::vector<fileRecord> files;
+		};
+
+		typedef std::map<std::string, dirRecord> manifestMap;
+
+		const std::string manifest_header = "maskCreator-manifest 1";
+
+		int64_t stamp(const std::filesystem::file_time_type& t)
+		{
+			return static_cast<int64_t>(t.time_since_epoch().count());
+		}
+
+		std::string join(const std::string& rel, const std::string& name)
+		{
+			return rel.empty() ? name : rel + "/" + name;
+		}
+
+		// Folder of a scan. Its files are published once it and every folder before it (in
+		// the order of the list) have been listed
+		struct scanNode
+		{
+			std::string rel;
+			bool listed = false;
+			stringvec files;
+			std::vector<std::unique_ptr<scanNode>> children;
+		};
+
+		// Manifest format: a "D mtime folder" line for each folder ("." is the root one),
+		// followed by a "S name" line for each subfolder and a "F size mtime name" line for
+		// each file of the folder
+		void loadManifest(const std::string& file, manifestMap& dirs)
+		{
+			std::ifstream in(file);
+			std::string line;
+			if(!std::getline(in, line) || line != manifest_header)
+				return;
+
+			dirRecord* current = nullptr;
+			while(std::getline(in, line))
+			{
+				std::istringstream ss(line);
+				char kind;
+				if(!(ss >> kind))
+					continue;
+
+				if(kind == 'D')
+				{
+					int64_t mtime;
+					std::string rel;
+					ss >> mtime;
+					ss.get();
+					std::getline(ss, rel);
+					current = &dirs[rel == "." ? "" : rel];
+					current->mtime = mtime;
+				}
+				else if(kind == 'S' && current)
+				{
+					std::string name;
+					ss.get();
+					std::getline(ss, name);
+					current->subdirs.push_back(name);
+				}
+				else if(kind == 'F' && current)
+				{
+					fileRecord f;
+					ss >> f.size >> f.mtime;
+					ss.get();
+					std::getline(ss, f.name);
+					current->files.push_back(f);
+				}
+			}
+		}
+
+		void writeManifest(const std::string& file, const manifestMap& dirs)
+		{
+			// I write to a temporary file that gets renamed, so as to a crash never
+			// leaves half a manifest
+			std::string tmp = file + ".tmp";
+			std::error_code ec;
+			std::filesystem::path parent = std::filesystem::path(file).parent_path();
+			if(!parent.empty())
+				std::filesystem::create_directories(parent, ec);
+			{
+				std::ofstream out(tmp, std::ios::trunc);
+				if(!out)
+					return;
+				out << manifest_header << "\n";
+				for(const auto& d: dirs)
+				{
+					out << "D " << d.second.mtime << " " << (d.first.empty() ? "." : d.first) << "\n";
+					for(const auto& s: d.second.subdirs)
+						out << "S " << s << "\n";
+					for(const auto& f: d.second.files)
+						out << "F " << f.size << " " << f.mtime << " " << f.name << "\n";
+				}
+				if(!out)
+					return;
+			}
+			std::filesystem::rename(tmp, file, ec);
+		}
+	}
+
+	imageList::imageList()
+		: done(false)
+	{
+	}
+
+	void imageList::push_back(const std::string& image)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			items.push_back(image);
+		}
+		grown_cv.notify_all();
+	}
+
+	void imageList::set_complete()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			done = true;
+		}
+		grown_cv.notify_all();
+	}
+
+	size_t imageList::size() const
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return items.size();
+	}
+
+	bool imageList::empty() const
+	{
+		return size() == 0;
+	}
+
+	bool imageList::complete() const
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return done;
+	}
+
+	std::string imageList::at(size_t idx) const
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return items.at(idx);
+	}
+
+	stringvec imageList::snapshot() const
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return items;
+	}
+
+	size_t imageList::wait_for_more(size_t n) const
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		grown_cv.wait(lock, [&]{ return done || items.size() > n; });
+		return items.size();
+	}
+
 	void read_directory(const std::string& name, stringvec& v)
 	{
-	    std::filesystem::path p(name);
-	    std::filesystem::directory_iterator it(p);
-	    std::filesystem::directory_iterator end;
+		std::mutex m;
+		scan_directory(name, "", 1, [&](const std::string& file)
+		{
+			// If the file has the desired extension, I store it on v
+			std::lock_guard<std::mutex> lock(m);
+			v.push_back(file);
+		});
+		std::sort(v.begin(), v.end());
+	}
+
+	size_t scan_directory(const std::string& name, const std::string& manifest, int n_threads,
+						  const std::function<void(const std::string&)>& on_file)
+	{
+		manifestMap previous, current;
+		std::mutex current_mutex;
+		size_t found = 0;
+		if(!manifest.empty())
+			loadManifest(manifest, previous);
 
-	    for(auto& p: std::filesystem::recursive_directory_iterator(name))
-	    {
-	    	if(std::filesystem::is_regular_file(*it) && it->path().extension() == extension)
-	    	{
-	    		// If the file has the desired extension, I store it on v
-	    		v.push_back(it->path().filename());
-	    	}
-	    	it++;
-	    }
+		std::filesystem::path root(name);
+		threadPool pool(n_threads);
+
+		// The folders are listed in parallel, but their files are published in the order of
+		// a serial scan: next holds the folders still to be published, the next one last
+		scanNode tree;
+		std::vector<scanNode*> next = {&tree};
+		std::mutex publish_mutex;
+		auto publish = [&]
+		{
+			while(!next.empty() && next.back()->listed)
+			{
+				scanNode* node = next.back();
+				next.pop_back();
+				for(const auto& f: node->files)
+				{
+					on_file(f);
+					found++;
+				}
+				node->files.clear();
+				for(auto it = node->children.rbegin(); it != node->children.rend(); ++it)
+					next.push_back(it->get());
+			}
+		};
+
+		// Each folder is a task, that submits a task for each of its subfolders
+		std::function<void(scanNode*)> scan = [&](scanNode* node)
+		{
+			const std::string& rel = node->rel;
+			std::error_code ec;
+			std::filesystem::path dir = rel.empty() ? root : root / rel;
+			auto mtime = std::filesystem::last_write_time(dir, ec);
+			if(ec)
+			{
+				std::lock_guard<std::mutex> lock(publish_mutex);
+				node->listed = true;
+				publish();
+				return;
+			}
+
+			dirRecord record;
+			record.mtime = stamp(mtime);
+
+			// If the folder has not changed (no file has been added, removed or renamed) I
+			// take its content from the manifest instead of listing it, so an unchanged tree
+			// costs one stat per folder and none per file. A file overwritten in place keeps
+			// its name, which is all the scan gives (the caches check their source themselves)
+			auto old = previous.find(rel);
+			if(old != previous.end() && old->second.mtime == record.mtime)
+				record = old->second;
+			else
+			{
+				for(std::filesystem::directory_iterator it(dir, std::filesystem::directory_options::skip_permission_denied, ec), end;
+					!ec && it != end; it.increment(ec))
+				{
+					std::error_code e;
+					std::string entry = it->path().filename().string();
+					if(it->is_directory(e))
+					{
+						// Hidden folders (the cache) and the masks are not images
+						if(entry.empty() || entry[0] == '.' || (rel.empty() && entry == "masks"))
+							continue;
+						record.subdirs.push_back(entry);
+					}
+					else if(it->is_regular_file(e) && it->path().extension() == extension)
+					{
+						fileRecord f;
+						f.name = entry;
+						f.size = static_cast<int64_t>(it->file_size(e));
+						f.mtime = stamp(it->last_write_time(e));
+						record.files.push_back(f);
+					}
+				}
+				std::sort(record.files.begin(), record.files.end(),
+						  [](const fileRecord& a, const fileRecord& b){ return a.name < b.name; });
+				std::sort(record.subdirs.begin(), record.subdirs.end());
+			}
+
+			std::vector<scanNode*> subdirs;
+			{
+				std::lock_guard<std::mutex> lock(publish_mutex);
+				for(const auto& f: record.files)
+					node->files.push_back(join(rel, f.name));
+				for(const auto& s: record.subdirs)
+				{
+					node->children.push_back(std::make_unique<scanNode>());
+					node->children.back()->rel = join(rel, s);
+					subdirs.push_back(node->children.back().get());
+				}
+				node->listed = true;
+				publish();
+			}
+			for(scanNode* sub: subdirs)
+				pool.submit([&scan, sub]{ scan(sub); });
+
+			std::lock_guard<std::mutex> lock(current_mutex);
+			current[rel] = std::move(record);
+		};
+
+		pool.submit([&scan, &tree]{ scan(&tree); });
+		pool.wait();
+
+		if(!manifest.empty())
+			writeManifest(manifest, current);
+		return found;
+	}
+
+	std::string mask_path(const std::string& path, const std::string& image, const std::string& ext)
+	{
+		// The masks keep the folders of the images: masks/<folder>/mask_<name>
+		std::filesystem::path rel(image);
+		if(!ext.empty())
+			rel.replace_extension(ext);
+		std::filesystem::path mask = std::filesystem::path("masks") / rel.parent_path() / ("mask_" + rel.filename().string());
+		return path + mask.string();
+	}
+
+	std::string saved_mask_path(const std::string& path, const std::string& image, const std::string& ext)
+	{
+		std::string file = mask_path(path, image, ext);
+		std::error_code ec;
+		if(ext.empty() || std::filesystem::exists(file, ec))
+			return file;
+		std::string legacy = mask_path(path, image);
+		return std::filesystem::exists(legacy, ec) ? legacy : file;
 	}
 
-}
\ No newline at end of file
+}
@@ -1,8 +1,14 @@
+#ifndef UTILS_H
+#define UTILS_H
+
 #include <iterator>
 #include <algorithm>
 #include <string>
 #include <vector>
 #include <filesystem>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
 
 // I declase extension extern so as to be read from main.cpp
 extern std::string extension;
@@ -11,5 +17,55 @@ namespace utils
 {
 	typedef std::vector<std::string> stringvec;
 
+	// List of image names that keeps growing while the directory is being scanned, and
+	// that can be read from other threads in the meanwhile
+	class imageList
+	{
+	public:
+		imageList();
+
+		void push_back(const std::string& image);
+		// Marks the scan as finished (no more images will be added)
+		void set_complete();
+
+		size_t size() const;
+		bool empty() const;
+		bool complete() const;
+		std::string at(size_t idx) const;
+		stringvec snapshot() const;
+		// Waits until the list holds more than n images or the scan has finished.
+		// Returns size()
+		size_t wait_for_more(size_t n) const;
+
+	private:
+		mutable std::mutex _mutex;
+		mutable std::condition_variable grown_cv;
+		stringvec items;
+		bool done;
+	};
+
+	// Lists every file with the desired extension in name and its subfolders, with its
+	// path relative to name. It is the same as scan_directory, but serial and sorted
 	void read_directory(const std::string& name, stringvec& v);
-}
\ No newline at end of file
+
+	// Scans name and its subfolders on n_threads (one per core if <= 0) and calls on_file
+	// (from one thread at a time) with the path relative to name of each file with the
+	// desired extension. The order is the same on every scan: the files of a folder (sorted)
+	// and then each of its subfolders (sorted), and a file is given as soon as its folder
+	// and the ones before it have been listed. The masks folder and hidden folders are
+	// skipped. If manifest is not empty, the folders whose modification time has not changed
+	// since the last scan are not listed again but read from it (with the size and time of
+	// their files), and it gets updated. Returns the number of files found
+	size_t scan_directory(const std::string& name, const std::string& manifest, int n_threads,
+						  const std::function<void(const std::string&)>& on_file);
+
+	// Path where the mask of the image (a name given by read_directory) gets saved. If ext
+	// is not empty, it replaces the extension of the image
+	std::string mask_path(const std::string& path, const std::string& image, const std::string& ext = "");
+	// Path of the saved mask of the image: the one mask_path gives with ext or, if there is
+	// none, the one of a mask saved before ext was used (mask_<image>, an image with the
+	// extension of the image). Returns the first one if neither exists
+	std::string saved_mask_path(const std::string& path, const std::string& image, const std::string& ext);
+}
+
+#endif
@@ -0,0 +1,105 @@
+#include "viewport.h"
+
+#include <cmath>
+#include <algorithm>
+
+// Maximum number of displayed pixels per real pixel
+#define MAX_MAGNIFICATION 8.0
+
+viewport::viewport()
+	: _zoom(1.0), off_x(0.0), off_y(0.0)
+{
+}
+
+void viewport::reset(const cv::Size& image, const cv::Size& display)
+{
+	_image = image;
+	_display = display;
+	_zoom = 1.0;
+	off_x = 0.0;
+	off_y = 0.0;
+}
+
+void viewport::zoomAt(const cv::Point& p, double factor)
+{
+	if(_image.width <= 0 || _image.height <= 0)
+		return;
+
+	cv::Point2d anchor = displayToImage(p);
+
+	// The zoom goes from fitting the whole image to MAX_MAGNIFICATION displayed pixels per real pixel
+	double max_zoom = std::max(1.0, MAX_MAGNIFICATION*std::max(static_cast<double>(_image.width)/_display.width,
+															   static_cast<double>(_image.height)/_display.height));
+	_zoom = std::min(std::max(_zoom*factor, 1.0), max_zoom);
+
+	// I move the offset so as to the anchor stays under p
+	off_x = anchor.x - p.x*(_image.width/_zoom)/_display.width;
+	off_y = anchor.y - p.y*(_image.height/_zoom)/_display.height;
+	clamp();
+}
+
+void viewport::pan(int dx, int dy)
+{
+	off_x -= dx*(_image.width/_zoom)/_display.width;
+	off_y -= dy*(_image.height/_zoom)/_display.height;
+	clamp();
+}
+
+void viewport::clamp()
+{
+	off_x = std::min(std::max(off_x, 0.0), _image.width - _image.width/_zoom);
+	off_y = std::min(std::max(off_y, 0.0), _image.height - _image.height/_zoom);
+}
+
+cv::Point2d viewport::displayToImage(const cv::Point& p) const
+{
+	return cv::Point2d(off_x + (p.x + 0.5)*(_image.width/_zoom)/_display.width - 0.5,
+					   off_y + (p.y + 0.5)*(_image.height/_zoom)/_display.height - 0.5);
+}
+
+cv::Rect viewport::imageToDisplay(const cv::Rect& r) const
+{
+	double sx = _display.width/(_image.width/_zoom);
+	double sy = _display.height/(_image.height/_zoom);
+	int x0 = static_cast<int>(std::floor((r.x - off_x)*sx));
+	int y0 = static_cast<int>(std::floor((r.y - off_y)*sy));
+	int x1 = static_cast<int>(std::ceil((r.x + r.width - off_x)*sx));
+	int y1 = static_cast<int>(std::ceil((r.y + r.height - off_y)*sy));
+	return cv::Rect(x0, y0, x1 - x0, y1 - y0) & cv::Rect(0, 0, _display.width, _display.height);
+}
+
+cv::Rect viewport::tileToSource(const cv::Rect& tile, const cv::Size& source) const
+{
+	// Scaling factors between the source and the read image
+	double fx = static_cast<double>(source.width)/_image.width;
+	double fy = static_cast<double>(source.height)/_image.height;
+	// Source pixels per displayed pixel
+	double sx = fx*(_image.width/_zoom)/_display.width;
+	double sy = fy*(_image.height/_zoom)/_display.height;
+
+	int x0 = cvRound(off_x*fx + tile.x*sx), x1 = cvRound(off_x*fx + (tile.x + tile.width)*sx);
+	int y0 = cvRound(off_y*fy + tile.y*sy), y1 = cvRound(off_y*fy + (tile.y + tile.height)*sy);
+	x0 = std::min(x0, source.width - 1);
+	y0 = std::min(y0, source.height - 1);
+	cv::Rect src(x0, y0, std::max(x1 - x0, 1), std::max(y1 - y0, 1));
+	return src & cv::Rect(0, 0, source.width, source.height);
+}
+
+cv::Rect viewport::visibleRect() const
+{
+	int x0 = static_cast<int>(std::floor(off_x)), y0 = static_cast<int>(std::floor(off_y));
+	int x1 = static_cast<int>(std::ceil(off_x + _image.width/_zoom));
+	int y1 = static_cast<int>(std::ceil(off_y + _image.height/_zoom));
+	return cv::Rect(x0, y0, x1 - x0, y1 - y0) & cv::Rect(0, 0, _image.width, _image.height);
+}
+
+cv::Size viewport::neededLevelSize() const
+{
+	return cv::Size(static_cast<int>(std::ceil(_display.width*_zoom)),
+					static_cast<int>(std::ceil(_display.height*_zoom)));
+}
+
+double viewport::zoom() const
+{
+	return _zoom;
+}
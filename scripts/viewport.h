@@ -0,0 +1,47 @@
+#ifndef VIEWPORT_H
+#define VIEWPORT_H
+
+#include "opencv2/core/core.hpp"
+
+// Class that holds which region of the read image is displayed. With zoom 1 the whole
+// image is squeezed into the display (as it always was); with zoom z only 1/z of each
+// side is displayed, starting at offset. Every conversion between displayed and real
+// coordinates goes through here
+class viewport
+{
+public:
+	viewport();
+
+	// Sets the size of the read image and of the display, and resets the zoom
+	void reset(const cv::Size& image, const cv::Size& display);
+
+	// Zooms by factor keeping the image point under the displayed point p still
+	void zoomAt(const cv::Point& p, double factor);
+	// Moves the displayed region by (dx, dy) displayed pixels
+	void pan(int dx, int dy);
+
+	// Point of the read image under the displayed point p
+	cv::Point2d displayToImage(const cv::Point& p) const;
+	// Displayed region that covers a region of the read image (clipped to the display)
+	cv::Rect imageToDisplay(const cv::Rect& r) const;
+	// Region of an image of size source (the read image or one of its pyramid levels)
+	// that gets displayed in a tile of the display
+	cv::Rect tileToSource(const cv::Rect& tile, const cv::Size& source) const;
+	// Region of the read image that is displayed
+	cv::Rect visibleRect() const;
+	// Size a pyramid level needs to be displayed without losing resolution
+	cv::Size neededLevelSize() const;
+
+	double zoom() const;
+
+private:
+	// Keeps the displayed region inside the image
+	void clamp();
+
+	cv::Size _image;
+	cv::Size _display;
+	double _zoom;
+	double off_x, off_y; // Real coordinates of the top-left displayed point
+};
+
+#endif
@@ -0,0 +1,212 @@
+#include "writer.h"
+
+#include <iostream>
+#include <filesystem>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "opencv2/imgcodecs/imgcodecs.hpp"
+
+#include "labelmask.h"
+#include "labels.h"
+
+uint32_t fnv1a(const uchar* p, size_t n)
+{
+	uint32_t h = 2166136261u;
+	for(size_t i=0; i<n; i++)
+		h = (h ^ p[i])*16777619u;
+	return h;
+}
+
+bool writeAll(int f, const uchar* p, size_t n)
+{
+	while(n > 0)
+	{
+		ssize_t w = ::write(f, p, n);
+		if(w < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		p += w;
+		n -= static_cast<size_t>(w);
+	}
+	return true;
+}
+
+bool writeFileAtomic(const std::string& file, const std::vector<uchar>& buffer)
+{
+	// If the folder (masks or a subfolder of it) does not exist, I create it
+	std::error_code ec;
+	std::filesystem::path folder = std::filesystem::path(file).parent_path();
+	if(!folder.empty())
+		std::filesystem::create_directories(folder, ec);
+
+	// The content is synced before the rename, or a crash could leave the new name with
+	// no data (and the journal of the mask is compacted once this returns)
+	std::string tmp = file + ".tmp";
+	int f = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(f < 0)
+		return false;
+	bool ok = writeAll(f, buffer.data(), buffer.size()) && ::fsync(f) == 0;
+	if(::close(f) != 0)
+		ok = false;
+	if(!ok)
+	{
+		std::filesystem::remove(tmp, ec);
+		return false;
+	}
+
+	std::filesystem::rename(tmp, file, ec);
+	return !ec && syncFolder(file);
+}
+
+bool syncFolder(const std::string& file)
+{
+	std::string folder = std::filesystem::path(file).parent_path().string();
+	int f = ::open(folder.empty() ? "." : folder.c_str(), O_RDONLY | O_DIRECTORY);
+	if(f < 0)
+		return false;
+	bool ok = ::fsync(f) == 0;
+	::close(f);
+	return ok;
+}
+
+bool writeMaskAtomic(const std::string& file, const cv::Mat& mask, const std::vector<int>& params)
+{
+	std::vector<uchar> buffer;
+	std::string ext = std::filesystem::path(file).extension().string();
+	if(ext == LABEL_MASK_EXTENSION)
+		encodeLabelMask(mask, buffer);
+	else
+	{
+		// I encode it in memory first (cv::imwrite takes the format from the extension, and
+		// the temporary file does not have it)
+		try
+		{
+			if(!cv::imencode(ext, mask, buffer, params))
+				return false;
+		}
+		catch(const cv::Exception& e)
+		{
+			std::cerr << "Could not encode " << file << ": " << e.what() << std::endl;
+			return false;
+		}
+	}
+	return writeFileAtomic(file, buffer);
+}
+
+maskWriter::maskWriter(const std::vector<int>& params, int max_pending)
+	: _params(params), _max_pending(max_pending > 0 ? max_pending : 1), writing(false), _failed(0), stop(false)
+{
+	thread = std::thread(&maskWriter::worker, this);
+}
+
+maskWriter::~maskWriter()
+{
+	flush();
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		stop = true;
+	}
+	work_cv.notify_all();
+	thread.join();
+}
+
+void maskWriter::save(const std::string& file, const cv::Mat& mask, const std::string& stats,
+					  const std::function<void()>& done)
+{
+	// I copy the mask outside the lock (it may be big)
+	pendingMask pending{file, mask.clone(), stats, done};
+	{
+		// If the same file is still waiting, the new mask replaces it (it does not take any
+		// more room, so it does not wait). Only a new file waits for room in the queue
+		auto replace = [&]
+		{
+			for(auto& queued: queue)
+			{
+				if(queued.file == file)
+				{
+					queued.mask = pending.mask;
+					queued.stats = pending.stats;
+					queued.done = pending.done;
+					return true;
+				}
+			}
+			return false;
+		};
+		std::unique_lock<std::mutex> lock(_mutex);
+		if(replace())
+			return;
+		space_cv.wait(lock, [&]{ return static_cast<int>(queue.size()) < _max_pending; });
+		// The file may have been queued by another thread while I waited
+		if(replace())
+			return;
+		queue.push_back(std::move(pending));
+	}
+	work_cv.notify_one();
+}
+
+void maskWriter::flush()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	space_cv.wait(lock, [&]{ return queue.empty() && !writing; });
+}
+
+void maskWriter::flush(const std::string& file)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	space_cv.wait(lock, [&]
+	{
+		if(writing && writing_file == file)
+			return false;
+		for(const auto& queued: queue)
+			if(queued.file == file)
+				return false;
+		return true;
+	});
+}
+
+int maskWriter::failed() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _failed;
+}
+
+void maskWriter::worker()
+{
+	while(true)
+	{
+		pendingMask pending;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			work_cv.wait(lock, [&]{ return stop || !queue.empty(); });
+			if(queue.empty())
+				return;
+
+			pending = std::move(queue.front());
+			queue.pop_front();
+			writing = true;
+			writing_file = pending.file;
+		}
+
+		bool ok = writeMaskAtomic(pending.file, pending.mask, _params);
+		if(ok && !pending.stats.empty())
+			ok = writeFileAtomic(labelStatsPath(pending.file), std::vector<uchar>(pending.stats.begin(), pending.stats.end()));
+		if(!ok)
+			std::cerr << "Could not write " << pending.file << std::endl;
+		else if(pending.done)
+			pending.done();
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			writing = false;
+			if(!ok)
+				_failed++;
+		}
+		space_cv.notify_all();
+	}
+}
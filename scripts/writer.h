@@ -0,0 +1,82 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#include "opencv2/core/core.hpp"
+
+// Function that writes the n bytes of p to the file descriptor f (retrying the partial
+// and interrupted writes). Returns false if they could not be written
+bool writeAll(int f, const uchar* p, size_t n);
+// FNV-1a hash of the n bytes of p (the checksum of the journal and shard records)
+uint32_t fnv1a(const uchar* p, size_t n);
+// Function that writes buffer to a temporary file next to file and renames it, so as to
+// file is never left half written. The file and the rename are synced to disk before it
+// returns, so a crash leaves either the old file or the new one. The folder of file gets
+// created if it does not exist. Returns false if it could not be written
+bool writeFileAtomic(const std::string& file, const std::vector<uchar>& buffer);
+// Function that syncs the folder of file, so as to a rename (or a removal) of file in it
+// survives a crash. Returns false if it could not be synced
+bool syncFolder(const std::string& file);
+// Function that encodes mask with the format given by the extension of file (.lbl or
+// any format of cv::imwrite, with its params) and writes it with writeFileAtomic
+bool writeMaskAtomic(const std::string& file, const cv::Mat& mask, const std::vector<int>& params);
+
+// Class that writes the masks on a background thread, so as to saving does not freeze
+// the UI. The masks are copied when they are queued, so they can keep being edited
+class maskWriter
+{
+public:
+	// params are the cv::imwrite params (compression) and max_pending the number of masks
+	// that can be waiting to be written before save() blocks
+	maskWriter(const std::vector<int>& params, int max_pending);
+	// Writes every pending mask before returning
+	~maskWriter();
+
+	// Queues a copy of mask to be written to file (and stats, if it is not empty, to
+	// labelStatsPath(file)). done (if any) is called on the writer thread once they have
+	// been written. If there are already max_pending masks waiting, it waits until one of
+	// them has been written
+	void save(const std::string& file, const cv::Mat& mask, const std::string& stats = std::string(),
+			  const std::function<void()>& done = nullptr);
+	// Waits until every queued mask has been written
+	void flush();
+	// Waits until the mask queued for file (if any) has been written
+	void flush(const std::string& file);
+	// Number of masks that could not be written
+	int failed() const;
+
+private:
+	struct pendingMask
+	{
+		std::string file;
+		cv::Mat mask;
+		std::string stats;
+		std::function<void()> done;
+	};
+
+	// Inf. loop run by the writer thread
+	void worker();
+
+	std::vector<int> _params; // cv::imwrite params
+	int _max_pending;
+	std::deque<pendingMask> queue; // Masks waiting to be written
+	bool writing; // Whether the thread is writing one right now
+	std::string writing_file; // File of the one it is writing
+	int _failed;
+
+	mutable std::mutex _mutex;
+	std::condition_variable work_cv; // The thread waits here for masks
+	std::condition_variable space_cv; // save() and flush() wait here for the thread
+	bool stop;
+	std::thread thread;
+};
+
+#endif
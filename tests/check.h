@@ -0,0 +1,39 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <iostream>
+#include <filesystem>
+#include <string>
+
+#include "opencv2/core/core.hpp"
+
+// Minimal checks for the ctest programs: a failed CHECK prints where it is and is counted,
+// and main returns the count (so ctest sees the failure) after running every check
+inline int check_failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if(!(cond)) \
+		{ \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+			check_failures++; \
+		} \
+	} while(0)
+
+// Whether two masks have the same size, type and pixels
+inline bool sameMask(const cv::Mat& a, const cv::Mat& b)
+{
+	return a.rows == b.rows && a.cols == b.cols && a.type() == b.type() &&
+		(a.empty() || cv::norm(a, b, cv::NORM_INF) == 0);
+}
+
+// Empty folder (removed first if it existed) for the files of a test
+inline std::string testFolder(const std::string& name)
+{
+	std::filesystem::path dir = std::filesystem::temp_directory_path() / ("maskCreator-" + name);
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir);
+	return dir.string();
+}
+
+#endif
@@ -0,0 +1,205 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+
+#include "opencv2/core/core.hpp"
+
+#include "journal.h"
+#include "check.h"
+
+namespace
+{
+	// Bytes a record takes in the file (see the format in journal.cpp)
+	size_t recordSize(const journalRecord& record)
+	{
+		return 1 + 4 + 2 + 4 + 4*record.args.size() + record.bytes.size() + 4;
+	}
+
+	std::vector<uchar> readFile(const std::string& file)
+	{
+		std::ifstream in(file, std::ios::binary);
+		return std::vector<uchar>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	}
+
+	void writeFile(const std::string& file, const std::vector<uchar>& data, size_t n)
+	{
+		std::ofstream out(file, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(n));
+	}
+
+	bool sameRecords(const std::vector<journalRecord>& a, const std::vector<journalRecord>& b, size_t n)
+	{
+		if(a.size() != n || b.size() < n)
+			return false;
+		for(size_t i=0; i<n; i++)
+			if(a[i].type != b[i].type || a[i].args != b[i].args || a[i].bytes != b[i].bytes || a[i].seq != b[i].seq)
+				return false;
+		return true;
+	}
+
+	std::vector<journalRecord> fixtureRecords()
+	{
+		cv::Mat tile = cv::Mat::zeros(20, 30, CV_8UC1);
+		tile.colRange(5, 25).setTo(2);
+		tile.at<uchar>(7, 3) = 9;
+
+		std::vector<journalRecord> records;
+		records.emplace_back(journalRecord::BEGIN);
+		records.emplace_back(journalRecord::SEGMENT, std::vector<int>{10, 20, 30, 40, 5, 1});
+		records.emplace_back(journalRecord::END);
+		records.emplace_back(journalRecord::CIRCLE, std::vector<int>{-3, 7, 12, 0});
+		records.emplace_back(journalRecord::RANGE, std::vector<int>{1, 2, 0, 20, 40, 1, 100, 255});
+		records.push_back(tileRecord(cv::Rect(4, 6, tile.cols, tile.rows), tile.data));
+		records.emplace_back(journalRecord::THRESHOLD, std::vector<int>{2, 120, 0, 3});
+		for(size_t i=0; i<records.size(); i++)
+			records[i].seq = static_cast<uint32_t>(i + 1);
+		return records;
+	}
+
+	void testRoundTrip(const std::string& file, const std::vector<journalRecord>& records)
+	{
+		{
+			editJournal journal(5);
+			CHECK(journal.open(file));
+			for(const auto& r: records)
+				journal.append(r);
+			CHECK(journal.mark() == records.size());
+			journal.close();
+		}
+		std::vector<journalRecord> read;
+		size_t length = 0;
+		CHECK(readJournal(file, read, &length));
+		CHECK(sameRecords(read, records, records.size()));
+		CHECK(length == readFile(file).size());
+
+		// Reopening keeps the records and the new ones follow them
+		editJournal journal(5);
+		CHECK(journal.open(file));
+		CHECK(journal.mark() == records.size());
+		journal.close();
+	}
+
+	void testTruncated(const std::string& file, const std::vector<journalRecord>& records)
+	{
+		std::vector<uchar> data = readFile(file);
+		// Every cut leaves the records that are complete before it
+		for(size_t cut=0; cut<data.size(); cut++)
+		{
+			writeFile(file, data, cut);
+			size_t complete = 0, end = 0;
+			while(complete < records.size() && end + recordSize(records[complete]) <= cut)
+				end += recordSize(records[complete++]);
+			std::vector<journalRecord> read;
+			size_t length = 1;
+			CHECK(readJournal(file, read, &length));
+			CHECK(sameRecords(read, records, complete));
+			CHECK(length == end);
+		}
+
+		// Opening a cut journal removes the half written record
+		size_t two = recordSize(records[0]) + recordSize(records[1]);
+		writeFile(file, data, two + 5);
+		{
+			editJournal journal(5);
+			CHECK(journal.open(file));
+			CHECK(journal.mark() == 2);
+			journal.append(records[2]);
+			journal.close();
+		}
+		std::vector<journalRecord> read;
+		CHECK(readJournal(file, read));
+		CHECK(sameRecords(read, records, 3));
+		writeFile(file, data, data.size());
+	}
+
+	void testCorrupt(const std::string& file, const std::vector<journalRecord>& records)
+	{
+		std::vector<uchar> data = readFile(file);
+		std::vector<size_t> starts;
+		size_t end = 0;
+		for(const auto& r: records)
+		{
+			starts.push_back(end);
+			end += recordSize(r);
+		}
+
+		std::vector<journalRecord> read;
+		size_t length = 0;
+		// A changed byte in the args, the tile or the checksum of a record ends the journal there
+		for(size_t k: {size_t(1), size_t(4), size_t(5), records.size() - 1})
+		{
+			std::vector<uchar> corrupt = data;
+			size_t next = k + 1 < records.size() ? starts[k + 1] : data.size();
+			corrupt[(starts[k] + next)/2] ^= 0x40;
+			writeFile(file, corrupt, corrupt.size());
+			CHECK(readJournal(file, read, &length));
+			CHECK(sameRecords(read, records, k));
+			CHECK(length == starts[k]);
+
+			corrupt = data;
+			corrupt[next - 1] ^= 0x01;
+			writeFile(file, corrupt, corrupt.size());
+			CHECK(readJournal(file, read, &length));
+			CHECK(sameRecords(read, records, k));
+		}
+
+		// An unknown type or too many args
+		std::vector<uchar> corrupt = data;
+		corrupt[starts[2]] = 200;
+		writeFile(file, corrupt, corrupt.size());
+		CHECK(readJournal(file, read, &length));
+		CHECK(sameRecords(read, records, 2));
+		corrupt = data;
+		corrupt[starts[3] + 5] = 0xff;
+		corrupt[starts[3] + 6] = 0xff;
+		writeFile(file, corrupt, corrupt.size());
+		CHECK(readJournal(file, read, &length));
+		CHECK(sameRecords(read, records, 3));
+
+		// Garbage is not a journal, and a missing file can not be read
+		std::vector<uchar> garbage(100, 0xa5);
+		writeFile(file, garbage, garbage.size());
+		CHECK(readJournal(file, read, &length));
+		CHECK(read.empty() && length == 0);
+		CHECK(!readJournal(file + ".missing", read, &length));
+		writeFile(file, data, data.size());
+	}
+
+	void testTiles()
+	{
+		cv::Mat tile = cv::Mat::zeros(20, 300, CV_8UC1);
+		tile.colRange(5, 290).setTo(2);
+		tile.at<uchar>(7, 3) = 9;
+		cv::Rect rect(40, 10, tile.cols, tile.rows);
+		journalRecord record = tileRecord(rect, tile.data);
+
+		cv::Mat mask = cv::Mat::zeros(100, 400, CV_8UC1);
+		CHECK(applyTileRecord(record, mask));
+		CHECK(sameMask(mask(rect), tile));
+		CHECK(cv::countNonZero(mask) == cv::countNonZero(tile));
+
+		// A tile outside the mask or with runs that do not fill it is not applied
+		cv::Mat small = cv::Mat::zeros(20, 100, CV_8UC1);
+		CHECK(!applyTileRecord(record, small));
+		CHECK(cv::countNonZero(small) == 0);
+		journalRecord cut = record;
+		cut.bytes.resize(cut.bytes.size() - 2);
+		cv::Mat untouched = cv::Mat::zeros(100, 400, CV_8UC1);
+		CHECK(!applyTileRecord(cut, untouched));
+		CHECK(cv::countNonZero(untouched) == 0);
+	}
+}
+
+int main()
+{
+	std::string dir = testFolder("journal");
+	std::string file = dir + "/mask.png.journal";
+	std::vector<journalRecord> records = fixtureRecords();
+	testRoundTrip(file, records);
+	testTruncated(file, records);
+	testCorrupt(file, records);
+	testTiles();
+	std::filesystem::remove_all(dir);
+	return check_failures;
+}
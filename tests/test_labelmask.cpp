@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+
+#include "opencv2/core/core.hpp"
+
+#include "labelmask.h"
+#include "writer.h"
+#include "check.h"
+
+namespace
+{
+	// Mask with runs of every length: single pixels, runs over the 127 of one varint byte,
+	// whole rows of one label and whole empty rows
+	cv::Mat fixtureMask()
+	{
+		cv::Mat mask = cv::Mat::zeros(90, 700, CV_8UC1);
+		cv::RNG rng(12345);
+		for(int y=0; y<mask.rows; y++)
+		{
+			if(y % 11 == 0)
+			{
+				mask.row(y).setTo(y % 2 ? 3 : 0);
+				continue;
+			}
+			int max_run = y % 3 == 0 ? 400 : 8;
+			int x = 0;
+			while(x < mask.cols)
+			{
+				int run = std::min(rng.uniform(1, max_run), mask.cols - x);
+				uchar v = static_cast<uchar>(rng.uniform(0, 4));
+				mask.row(y).colRange(x, x + run).setTo(v);
+				x += run;
+			}
+		}
+		mask.at<uchar>(0, 0) = 255;
+		return mask;
+	}
+
+	void testLabelMask(const std::string& dir)
+	{
+		cv::Mat mask = fixtureMask();
+		std::vector<uchar> buffer;
+		encodeLabelMask(mask, buffer);
+
+		cv::Mat decoded;
+		CHECK(decodeLabelMask(buffer.data(), buffer.size(), decoded));
+		CHECK(sameMask(decoded, mask));
+
+		// A mask of the same size and type is decoded in place
+		cv::Mat in_place = cv::Mat::zeros(mask.rows, mask.cols, CV_8UC1);
+		uchar* data = in_place.data;
+		CHECK(decodeLabelMask(buffer.data(), buffer.size(), in_place));
+		CHECK(in_place.data == data);
+		CHECK(sameMask(in_place, mask));
+
+		// A buffer cut short is not valid
+		cv::Mat truncated;
+		CHECK(!decodeLabelMask(buffer.data(), buffer.size() - 1, truncated));
+		CHECK(!decodeLabelMask(buffer.data(), 8, truncated));
+
+		std::string file = dir + "/mask.lbl";
+		CHECK(writeMaskAtomic(file, mask, {}));
+		cv::Mat read;
+		CHECK(readLabelMask(file, read));
+		CHECK(sameMask(read, mask));
+		CHECK(readMask(file, read));
+		CHECK(sameMask(read, mask));
+
+		cv::Mat rows;
+		CHECK(readLabelRows(file, 37, 20, rows));
+		CHECK(sameMask(rows, mask.rowRange(37, 57)));
+		CHECK(readLabelRows(file, mask.rows - 1, 1, rows));
+		CHECK(sameMask(rows, mask.rowRange(mask.rows - 1, mask.rows)));
+		CHECK(!readLabelRows(file, mask.rows - 5, 10, rows));
+	}
+
+	void testCocoCounts()
+	{
+		cv::Mat mask = fixtureMask();
+		cv::Mat transposed;
+		cv::transpose(mask, transposed);
+		for(int label=1; label<=3; label++)
+		{
+			std::vector<uint32_t> counts = cocoCounts(transposed, label);
+			unsigned long long total = 0;
+			for(uint32_t c: counts)
+				total += c;
+			CHECK(total == mask.total());
+
+			cv::Mat applied = cv::Mat::zeros(mask.rows, mask.cols, CV_8UC1);
+			applyCocoCounts(counts, label, applied);
+			cv::Mat expected = cv::Mat::zeros(mask.rows, mask.cols, CV_8UC1);
+			expected.setTo(label, mask == label);
+			CHECK(sameMask(applied, expected));
+
+			CHECK(cocoStringToCounts(cocoCountsToString(counts)) == counts);
+		}
+
+		// From the fourth count on the difference with the one two places before is written,
+		// and a negative one is sign extended when it is read (0 - 1 is the single chunk 'O')
+		std::vector<uint32_t> counts = {1, 1, 1, 0};
+		CHECK(cocoCountsToString(counts) == "111O");
+		CHECK(cocoStringToCounts("111O") == counts);
+
+		// Differences of every sign and size (many chunks, and the largest counts)
+		counts = {0, 100, 3, 40, 70000, 1, 5, 2000000, 0, 33554432, 4000000000u, 7, 1, 0};
+		CHECK(cocoStringToCounts(cocoCountsToString(counts)) == counts);
+	}
+
+	void testCocoFile(const std::string& dir)
+	{
+		cv::Mat mask = fixtureMask();
+		std::string file = dir + "/mask.json";
+		// The name of the image is escaped in the json
+		CHECK(writeCocoMask(file, "dir\\image \"1\".png", mask));
+		cv::Mat read;
+		CHECK(readCocoMask(file, read));
+		CHECK(sameMask(read, mask));
+		CHECK(readMask(file, read));
+		CHECK(sameMask(read, mask));
+
+		std::ifstream in(file);
+		std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		CHECK(json.find("dir\\\\image \\\"1\\\".png") != std::string::npos);
+
+		// Converted to .lbl and back
+		std::string lbl = dir + "/converted.lbl";
+		CHECK(convertMask(file, lbl));
+		CHECK(readLabelMask(lbl, read));
+		CHECK(sameMask(read, mask));
+	}
+}
+
+int main()
+{
+	std::string dir = testFolder("labelmask");
+	testLabelMask(dir);
+	testCocoCounts();
+	testCocoFile(dir);
+	std::filesystem::remove_all(dir);
+	return check_failures;
+}
@@ -0,0 +1,172 @@
+#include <string>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "morphology.h"
+#include "check.h"
+
+namespace
+{
+	// The cleanup of cleanLabel done over the whole mask with the OpenCV filters and
+	// components, as the reference of the banded, run based one
+	cv::Mat referenceCleanup(const cv::Mat& mask, const labelCleanup& step)
+	{
+		cv::Mat out = mask.clone();
+		cv::Mat bin = mask == step.label;
+		if(step.open_radius > 0)
+		{
+			cv::Mat opened;
+			int side = 2*step.open_radius + 1;
+			cv::morphologyEx(bin, opened, cv::MORPH_OPEN, cv::getStructuringElement(cv::MORPH_RECT, cv::Size(side, side)));
+			out.setTo(0, bin & ~opened);
+			bin = opened;
+		}
+		if(step.close_radius > 0)
+		{
+			// The closing only takes the background, never the other labels
+			cv::Mat closed;
+			int side = 2*step.close_radius + 1;
+			cv::morphologyEx(bin, closed, cv::MORPH_CLOSE, cv::getStructuringElement(cv::MORPH_RECT, cv::Size(side, side)));
+			cv::Mat add = closed & ~bin & (out == 0);
+			out.setTo(step.label, add);
+			bin = bin | add;
+		}
+		if(step.fill_holes)
+		{
+			// The holes are the 4-connected components of the rest that do not touch the border
+			cv::Mat components;
+			int n = cv::connectedComponents(bin == 0, components, 4);
+			std::vector<char> outside(n, 0);
+			for(int y=0; y<components.rows; y++)
+				for(int x=0; x<components.cols; x++)
+					if(y == 0 || x == 0 || y == components.rows - 1 || x == components.cols - 1)
+						outside[components.at<int>(y, x)] = 1;
+			for(int y=0; y<components.rows; y++)
+				for(int x=0; x<components.cols; x++)
+				{
+					int c = components.at<int>(y, x);
+					if(c > 0 && !outside[c] && out.at<uchar>(y, x) == 0)
+					{
+						out.at<uchar>(y, x) = static_cast<uchar>(step.label);
+						bin.at<uchar>(y, x) = 255;
+					}
+				}
+		}
+		if(step.min_area > 0)
+		{
+			cv::Mat components, stats, centroids;
+			cv::connectedComponentsWithStats(bin, components, stats, centroids, 8);
+			for(int y=0; y<components.rows; y++)
+				for(int x=0; x<components.cols; x++)
+				{
+					int c = components.at<int>(y, x);
+					if(c > 0 && stats.at<int>(c, cv::CC_STAT_AREA) < step.min_area)
+						out.at<uchar>(y, x) = 0;
+				}
+		}
+		return out;
+	}
+
+	// The mask after cleanLabel (its region pasted over a copy of mask)
+	cv::Mat cleanedMask(const cv::Mat& mask, const labelCleanup& step, const cv::Rect& bounds)
+	{
+		cv::Mat cleaned;
+		cv::Rect roi = cleanLabel(mask, step, bounds, cleaned);
+		cv::Mat out = mask.clone();
+		if(!roi.empty())
+			cleaned.copyTo(out(roi));
+		return out;
+	}
+
+	// Blobs of label 1 with holes (of one pixel and larger), specks, a one pixel wide spur,
+	// a gap next to label 2 (that the closing can not take) and small components
+	cv::Mat blobsMask()
+	{
+		cv::Mat mask = cv::Mat::zeros(160, 210, CV_8UC1);
+		cv::rectangle(mask, cv::Rect(20, 20, 60, 50), cv::Scalar(1), cv::FILLED);
+		cv::rectangle(mask, cv::Rect(40, 35, 4, 3), cv::Scalar(0), cv::FILLED);
+		mask.at<uchar>(55, 60) = 0;
+		cv::line(mask, cv::Point(80, 45), cv::Point(120, 45), cv::Scalar(1), 1);
+		mask.at<uchar>(100, 30) = 1;
+		mask.at<uchar>(101, 31) = 1;
+		cv::rectangle(mask, cv::Rect(140, 20, 4, 4), cv::Scalar(1), cv::FILLED);
+		cv::rectangle(mask, cv::Rect(100, 90, 30, 30), cv::Scalar(1), cv::FILLED);
+		cv::rectangle(mask, cv::Rect(133, 90, 30, 30), cv::Scalar(1), cv::FILLED);
+		cv::rectangle(mask, cv::Rect(130, 100, 3, 10), cv::Scalar(2), cv::FILLED);
+		cv::rectangle(mask, cv::Rect(20, 120, 40, 25), cv::Scalar(2), cv::FILLED);
+		cv::rectangle(mask, cv::Rect(30, 128, 8, 8), cv::Scalar(0), cv::FILLED);
+		cv::circle(mask, cv::Point(45, 132), 3, cv::Scalar(1), cv::FILLED);
+		return mask;
+	}
+
+	// Label 1 touching the borders of the image, with notches at them and a hole that is open
+	// to the border
+	cv::Mat borderMask()
+	{
+		cv::Mat mask = cv::Mat::zeros(90, 120, CV_8UC1);
+		cv::rectangle(mask, cv::Rect(0, 0, 50, 40), cv::Scalar(1), cv::FILLED);
+		cv::rectangle(mask, cv::Rect(0, 10, 2, 5), cv::Scalar(0), cv::FILLED);
+		cv::rectangle(mask, cv::Rect(20, 0, 3, 1), cv::Scalar(0), cv::FILLED);
+		cv::rectangle(mask, cv::Rect(80, 50, 40, 40), cv::Scalar(1), cv::FILLED);
+		cv::rectangle(mask, cv::Rect(100, 70, 20, 5), cv::Scalar(0), cv::FILLED);
+		cv::rectangle(mask, cv::Rect(90, 60, 5, 5), cv::Scalar(0), cv::FILLED);
+		return mask;
+	}
+
+	// Noise of labels 1 and 2
+	cv::Mat noiseMask()
+	{
+		cv::Mat mask = cv::Mat::zeros(130, 170, CV_8UC1);
+		cv::RNG rng(7);
+		for(int y=10; y<mask.rows - 5; y++)
+			for(int x=5; x<mask.cols - 20; x++)
+			{
+				int r = rng.uniform(0, 100);
+				mask.at<uchar>(y, x) = r < 45 ? 1 : r < 55 ? 2 : 0;
+			}
+		return mask;
+	}
+
+	labelCleanup cleanup(int label, int open_radius, int close_radius, bool fill_holes, int min_area)
+	{
+		labelCleanup step;
+		step.label = label;
+		step.open_radius = open_radius;
+		step.close_radius = close_radius;
+		step.fill_holes = fill_holes;
+		step.min_area = min_area;
+		return step;
+	}
+}
+
+int main()
+{
+	std::vector<cv::Mat> masks = {blobsMask(), borderMask(), noiseMask()};
+	std::vector<labelCleanup> steps = {
+		cleanup(1, 1, 0, false, 0),
+		cleanup(1, 0, 2, false, 0),
+		cleanup(1, 0, 0, true, 0),
+		cleanup(1, 0, 0, false, 20),
+		cleanup(1, 1, 2, true, 20),
+		cleanup(1, 2, 1, false, 5),
+		cleanup(2, 1, 3, true, 10),
+		cleanup(3, 1, 1, true, 10), // No pixel has the label
+	};
+	for(size_t m=0; m<masks.size(); m++)
+		for(const auto& step: steps)
+		{
+			const cv::Mat& mask = masks[m];
+			cv::Mat expected = referenceCleanup(mask, step);
+			bool same = sameMask(cleanedMask(mask, step, cv::Rect()), expected);
+			// With the bounding box of the label (what the editor passes) it is the same
+			cv::Rect box = cv::boundingRect(mask == step.label);
+			same = sameMask(cleanedMask(mask, step, box), expected) && same;
+			if(!same)
+				std::cerr << "Fixture " << m << ", label " << step.label << " " << step.open_radius << " "
+					<< step.close_radius << " " << step.fill_holes << " " << step.min_area << ":" << std::endl;
+			CHECK(same);
+		}
+	return check_failures;
+}